@@ -0,0 +1,83 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/goat.h"
+#include "src/irc.h"
+
+// compares goat_command() with the bsearch lookup it replaced, over every
+// command string plus a few that aren't commands
+
+#define ITERATIONS (200000)
+
+static const char *const misses[] = {
+    "", "000", "999", "1234", "privmsg", "PRIVMSGX", "CAP", "AUTHENTICATE",
+};
+
+static int _cmp(const void *key, const void *iter) {
+    return strcmp((const char *) key, *(const char **) iter);
+}
+
+static GoatError _bsearch_command(const char *command_string, GoatCommand *command) {
+    const char **ptr = bsearch(command_string, irc_strings, GOAT_IRC_LAST,
+                               sizeof(irc_strings[0]), _cmp);
+
+    if (NULL == ptr) return GOAT_E_UNREC;
+
+    *command = (GoatCommand) (ptr - irc_strings);
+    return 0;
+}
+
+static double _now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double _run(const char *const *strings, size_t n,
+                   GoatError (*lookup)(const char *, GoatCommand *), unsigned *sink) {
+    GoatCommand command = 0;
+    double start = _now();
+
+    for (unsigned i = 0; i < ITERATIONS; i++) {
+        for (size_t j = 0; j < n; j++) {
+            *sink += lookup(strings[j], &command) + command;
+        }
+    }
+
+    return (_now() - start) * 1e9 / ((double) ITERATIONS * n);
+}
+
+int main(void) {
+    const size_t n_misses = sizeof(misses) / sizeof(misses[0]);
+    const size_t n = GOAT_IRC_LAST + n_misses;
+    const char **strings = calloc(n, sizeof(*strings));
+    unsigned sink = 0;
+
+    if (NULL == strings) return 1;
+
+    for (size_t i = 0; i < GOAT_IRC_LAST; i++) {
+        GoatCommand a, b;
+
+        strings[i] = irc_strings[i];
+
+        if (goat_command(strings[i], &a) || _bsearch_command(strings[i], &b) || a != b) {
+            fprintf(stderr, "mismatch for %s\n", strings[i]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < n_misses; i++) {
+        strings[GOAT_IRC_LAST + i] = misses[i];
+    }
+
+    printf("%zu lookups x %d\n", n, ITERATIONS);
+    printf("bsearch:      %6.2f ns/lookup\n", _run(strings, n, &_bsearch_command, &sink));
+    printf("goat_command: %6.2f ns/lookup\n", _run(strings, n, &goat_command, &sink));
+
+    free(strings);
+    return sink == 0xdeadbeef;
+}
@@ -2,30 +2,87 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "connection.h"
 #include "context.h"
 #include "message.h"
+#include "ringbuf.h"
 #include "sm.h"
 #include "tresolver.h"
 #include "util.h"
 
+// reads start small and adapt to how much the socket actually has waiting
+#define CONN_READ_MIN   (516)
+#define CONN_READ_MAX   (65536)
+
+// longest line a server may send: 8191 bytes of tags, and 512 of the rest.
+// a partial line that's already longer is never going to end
+#define CONN_LINE_MAX   (GOAT_MESSAGE_BUF_SZ - 1)
+
+// queued lines are gathered into tls records up to the largest plaintext one
+// can carry, rather than each line paying for a record of its own
+#define CONN_TLS_RECORD_MAX (16384)
+
+// defaults, until changed with goat_set_timeouts()
+#define CONN_CONNECT_MS     (30 * 1000)
+#define CONN_PING_MS        (90 * 1000)
+#define CONN_PONG_MS        (60 * 1000)
+#define CONN_RECONNECT_MS   (0)
+
+// reconnect delays double with each failure in a row, up to this many times
+#define CONN_RECONNECT_BACKOFF_MAX (5)
+
+// while connecting, how long each address has to itself before the next one
+// is tried alongside it (rfc 8305's connection attempt delay), and how many
+// can be underway at once
+#define CONN_ATTEMPT_DELAY_MS   (250)
+#define CONN_ATTEMPTS_MAX       (8)
+
+// servers disconnect clients that send too much too quickly.  by default, a
+// few lines go at once, and then one every couple of seconds
+#define CONN_FLOOD_BURST        (5)
+#define CONN_FLOOD_INTERVAL_MS  (2000)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)    /* platforms without it use SO_NOSIGPIPE instead */
+#endif
+
 static ssize_t _conn_recv_data(Connection *);
 static ssize_t _conn_send_data(Connection *);
+static ssize_t _conn_recv_tls(Connection *conn);
+static ssize_t _conn_send_tls(Connection *conn);
+static int _conn_check_line_len(Connection *conn);
+static size_t _conn_gather_written(const StrQueueHead *queue, size_t offset, char *buf, size_t size);
+static size_t _conn_consume_written(StrQueueHead *queue, size_t offset, size_t written);
 static int _conn_enqueue_message(StrQueueHead *queue, const GoatMessage *message);
-static GoatMessage *_conn_dequeue_message(StrQueueHead *queue);
+static void _conn_free_queue(StrQueueHead *queue);
+static ConnLane _conn_lane(const GoatMessage *message);
+static void _conn_flood_refill(Connection *conn, uint64_t now);
+static void _conn_flood_release(Connection *conn, uint64_t now);
+static int _conn_inject_message(RingBuf *rb, const GoatMessage *message);
+static GoatMessage *_conn_dequeue_message(RingBuf *rb);
+static size_t _conn_chomp_line(char *line, size_t len);
 static void _conn_set_state(Connection *conn, ConnState new_state);
-static int _conn_start_connect(Connection *conn, const struct addrinfo *ai);
+static int _conn_start_connect(const struct addrinfo *ai, int *socketp);
+static int _conn_race(Connection *conn, uint64_t now);
+static uint64_t _conn_race_deadline(const ConnectingStateData *race);
+static void _conn_close_network(Connection *conn);
+static void _conn_schedule(Connection *conn, ConnState new_state, uint64_t now);
+static void _conn_timed_out(Connection *conn, uint64_t now);
 
 static const char *const _conn_state_names[] = {
     [GOAT_CONN_DISCONNECTED]    = "disconnected",
     [GOAT_CONN_RESOLVING]       = "resolving",
     [GOAT_CONN_CONNECTING]      = "connecting",
-    [GOAT_CONN_SSLHANDSHAKE]    = "ssl handshake",
+    [GOAT_CONN_SSLHANDSHAKE]    = "ssl-handshake",  // no spaces: it can be a middle param
     [GOAT_CONN_CONNECTED]       = "connected",
     [GOAT_CONN_DISCONNECTING]   = "disconnecting",
     [GOAT_CONN_ERROR]           = "error"
@@ -112,11 +169,30 @@ int conn_init(Connection *conn) {
     memset(conn, 0, sizeof(Connection));
 
     conn->m_network.socket = -1;
+    conn->m_poll.fd = -1;
+
+    conn->m_timing.settings = (GoatTimeouts) {
+        CONN_CONNECT_MS, CONN_PING_MS, CONN_PONG_MS, CONN_RECONNECT_MS
+    };
+
+    conn->m_flood.settings = (GoatFloodControl) {
+        CONN_FLOOD_BURST, CONN_FLOOD_INTERVAL_MS
+    };
+    conn->m_flood.tokens = CONN_FLOOD_BURST;
+    for (int i = 0; i < CONN_LANE_LAST; i++)  STAILQ_INIT(&conn->m_flood.lanes[i]);
 
     STAILQ_INIT(&conn->m_write_queue);
-    STAILQ_INIT(&conn->m_read_queue);
 
-    return pthread_mutex_init(&conn->m_mutex, NULL);
+    // grows as reads need it to, rather than every connection starting big
+    int r = ringbuf_init(&conn->m_read_buf, CONN_READ_MIN);
+    if (r) return r;
+    conn->m_read_size = CONN_READ_MIN;
+
+    if (0 != (r = pthread_mutex_init(&conn->m_mutex, NULL))) {
+        ringbuf_destroy(&conn->m_read_buf);
+    }
+
+    return r;
 }
 
 int conn_destroy(Connection *conn) {
@@ -130,24 +206,14 @@ int conn_destroy(Connection *conn) {
 
         if (conn->m_network.hostname) free(conn->m_network.hostname);
         if (conn->m_network.servname) free(conn->m_network.servname);
-        if (conn->m_network.ai0) freeaddrinfo(conn->m_network.ai0);
-        if (conn->m_network.tls) tls_free(conn->m_network.tls);
+        if (conn->m_network.ai0) resolver_freeaddrinfo(conn->m_network.ai0);
+        _conn_close_network(conn);
 
-        StrQueueEntry *node = STAILQ_FIRST(&conn->m_write_queue);
-        while (NULL != node) {
-            StrQueueEntry *next = STAILQ_NEXT(node, entries);
-            free(node);
-            node = next;
-        }
-        STAILQ_INIT(&conn->m_write_queue);
+        for (int i = 0; i < CONN_LANE_LAST; i++)  _conn_free_queue(&conn->m_flood.lanes[i]);
+        _conn_free_queue(&conn->m_write_queue);
+        conn->m_write_offset = 0;
 
-        node = STAILQ_FIRST(&conn->m_read_queue);
-        while (NULL != node) {
-            StrQueueEntry *next = STAILQ_NEXT(node, entries);
-            free(node);
-            node = next;
-        }
-        STAILQ_INIT(&conn->m_read_queue);
+        ringbuf_destroy(&conn->m_read_buf);
 
         pthread_mutex_unlock(&conn->m_mutex);
         ret = pthread_mutex_destroy(&conn->m_mutex);
@@ -163,10 +229,16 @@ int conn_connect(Connection *conn, const char *hostname, const char *servname, i
     int r = pthread_mutex_lock(&conn->m_mutex);
     if (r) return r;
 
+    if (conn->m_network.hostname) free(conn->m_network.hostname);
+    if (conn->m_network.servname) free(conn->m_network.servname);
+
     conn->m_network.hostname = strdup(hostname);
     conn->m_network.servname = strdup(servname);
     conn->m_use_ssl = ssl;
 
+    conn->m_timing.client_disconnect = 0;
+    conn->m_timing.reconnects = 0;
+
     conn->m_state.change_reason = strdup("connect requested by client");
     _conn_set_state(conn, GOAT_CONN_RESOLVING);
 
@@ -181,6 +253,8 @@ int conn_disconnect(Connection *conn) {
     int r = pthread_mutex_lock(&conn->m_mutex);
     if (r) return r;
 
+    conn->m_timing.client_disconnect = 1;
+
     conn->m_state.change_reason = strdup("disconnect requested by client");
     _conn_set_state(conn, GOAT_CONN_DISCONNECTING);
 
@@ -188,13 +262,21 @@ int conn_disconnect(Connection *conn) {
     return 0;
 }
 
+// tls can need the socket to be readable to finish a write, or writeable to
+// finish a read, so while it's waiting on one it mustn't be woken for the other
 int conn_wants_read(const Connection *conn) {
     assert(conn != NULL);
 
     switch (conn->m_state.state) {
+        case GOAT_CONN_SSLHANDSHAKE:
+            return conn->m_network.tls_write_wants != TLS_WANT_POLLOUT;
+
+        case GOAT_CONN_DISCONNECTING:
+            if (conn->m_network.tls)  return conn->m_network.tls_write_wants != TLS_WANT_POLLOUT;
+            return 1;
+
         case GOAT_CONN_CONNECTING:
         case GOAT_CONN_CONNECTED:
-        case GOAT_CONN_DISCONNECTING:
             return 1;
 
         default:
@@ -206,10 +288,20 @@ int conn_wants_write(const Connection *conn) {
     assert(conn != NULL);
     switch (conn->m_state.state) {
         case GOAT_CONN_CONNECTED:
-            if (STAILQ_EMPTY(&conn->m_write_queue))  return 0;
-            /* fall through */
-        case GOAT_CONN_CONNECTING:
+            if (conn->m_network.tls) {
+                if (conn->m_network.tls_read_wants == TLS_WANT_POLLOUT)  return 1;
+                if (conn->m_network.tls_write_wants == TLS_WANT_POLLIN)  return 0;
+            }
+            return !STAILQ_EMPTY(&conn->m_write_queue);
+
+        case GOAT_CONN_SSLHANDSHAKE:
+            return conn->m_network.tls_write_wants != TLS_WANT_POLLIN;
+
         case GOAT_CONN_DISCONNECTING:
+            if (conn->m_network.tls)  return conn->m_network.tls_write_wants != TLS_WANT_POLLIN;
+            return 1;
+
+        case GOAT_CONN_CONNECTING:
             return 1;
 
         default:
@@ -221,17 +313,141 @@ int conn_wants_timeout(const Connection *conn) {
     assert(conn != NULL);
     switch (conn->m_state.state) {
         case GOAT_CONN_RESOLVING:
-            return 1;
+            // with nobody to say when the lookup's done, keep checking
+            return NULL == conn->m_resolved.func;
 
         default:
             return 0;
     }
 }
 
+int conn_get_timeouts(Connection *conn, GoatTimeouts *timeouts) {
+    assert(conn != NULL);
+    assert(timeouts != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    *timeouts = conn->m_timing.settings;
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
+// new timeouts take effect from the next state change, or the next ping
+int conn_set_timeouts(Connection *conn, const GoatTimeouts *timeouts) {
+    assert(conn != NULL);
+    assert(timeouts != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    conn->m_timing.settings = *timeouts;
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
+// when the connection next needs ticking regardless of io: its own deadline,
+// or a held line's turn to go, whichever is sooner
+uint64_t conn_deadline(const Connection *conn) {
+    assert(conn != NULL);
+
+    const uint64_t deadline = conn->m_timing.deadline;
+    const uint64_t next_at = conn->m_flood.next_at;
+
+    if (0 == deadline) return next_at;
+    if (0 == next_at) return deadline;
+    return next_at < deadline ? next_at : deadline;
+}
+
+int conn_get_flood_control(Connection *conn, GoatFloodControl *flood) {
+    assert(conn != NULL);
+    assert(flood != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    *flood = conn->m_flood.settings;
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
+// takes effect straight away: lines being held are let go as soon as the
+// new settings allow
+int conn_set_flood_control(Connection *conn, const GoatFloodControl *flood) {
+    assert(conn != NULL);
+    assert(flood != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    conn->m_flood.settings = *flood;
+
+    const unsigned burst = flood->burst ? flood->burst : 1;
+    if (conn->m_flood.tokens > burst)  conn->m_flood.tokens = burst;
+
+    if (conn->m_state.state == GOAT_CONN_CONNECTED)  _conn_flood_release(conn, timer_now_ms());
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
+int conn_get_queue_stats(Connection *conn, GoatQueueStats *stats) {
+    assert(conn != NULL);
+    assert(stats != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    const StrQueueEntry *node;
+    size_t offset = conn->m_write_offset;
+
+    memset(stats, 0, sizeof(*stats));
+
+    STAILQ_FOREACH(node, &conn->m_write_queue, entries) {
+        ++ stats->lines;
+        stats->bytes += node->len - offset;
+        offset = 0;
+    }
+
+    for (int i = 0; i < CONN_LANE_LAST; i++) {
+        STAILQ_FOREACH(node, &conn->m_flood.lanes[i], entries) {
+            ++ stats->held;
+            stats->bytes += node->len;
+        }
+    }
+    stats->lines += stats->held;
+
+    const uint64_t interval = conn->m_flood.settings.interval_ms;
+    if (interval) {
+        const uint64_t now = timer_now_ms();
+        _conn_flood_refill(conn, now);
+
+        // the first has to wait for the next token, and the rest one each.
+        // a full bucket won't start filling again until it's used
+        if (stats->held > conn->m_flood.tokens) {
+            const uint64_t next = conn->m_flood.refilled_at ? conn->m_flood.refilled_at + interval - now
+                                                            : interval;
+            const uint64_t drain = next + (stats->held - conn->m_flood.tokens - 1) * interval;
+            stats->drain_ms = drain < UINT_MAX ? drain : UINT_MAX;
+        }
+    }
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
 int conn_tick(Connection *conn, int socket_readable, int socket_writeable) {
     assert(conn != NULL);
 
     if (0 == pthread_mutex_lock(&conn->m_mutex)) {
+        if (conn->m_timing.deadline) {
+            const uint64_t now = timer_now_ms();
+            if (now >= conn->m_timing.deadline)  _conn_timed_out(conn, now);
+        }
+
         conn->m_state.socket_is_readable = socket_readable;
         conn->m_state.socket_is_writeable = socket_writeable;
         ConnState next_state;
@@ -260,7 +476,7 @@ int conn_tick(Connection *conn, int socket_readable, int socket_writeable) {
 
     if (conn->m_state.state == GOAT_CONN_ERROR)  return -1;
 
-    return !STAILQ_EMPTY(&conn->m_read_queue);  // cheap estimate of number of events
+    return ringbuf_has_line(&conn->m_read_buf);  // cheap estimate of number of events
 }
 
 int conn_reset_error(Connection *conn) {
@@ -279,15 +495,27 @@ int conn_reset_error(Connection *conn) {
     return 0;
 }
 
-int conn_send_message(Connection *conn, const GoatMessage *message) {
+// *was_idle is set if the write queue was empty until now, in which case
+// whoever is waiting on the connection's poller may need waking to send it
+int conn_send_message(Connection *conn, const GoatMessage *message, int *was_idle) {
     assert(conn != NULL);
     assert(message != NULL);
+    assert(was_idle != NULL);
+
+    *was_idle = 0;
 
     int r = pthread_mutex_lock(&conn->m_mutex);
     if (r) return r;
 
-    // now stick it on the connection's write queue
-    r = _conn_enqueue_message(&conn->m_write_queue, message);
+    int idle = STAILQ_EMPTY(&conn->m_write_queue);
+    for (int i = 0; i < CONN_LANE_LAST; i++)  idle = idle && STAILQ_EMPTY(&conn->m_flood.lanes[i]);
+
+    // now stick it in its lane, and let it go if flood control allows
+    r = _conn_enqueue_message(&conn->m_flood.lanes[_conn_lane(message)], message);
+    if (0 == r) {
+        if (conn->m_state.state == GOAT_CONN_CONNECTED)  _conn_flood_release(conn, timer_now_ms());
+        *was_idle = idle;
+    }
 
     pthread_mutex_unlock(&conn->m_mutex);
     return r;
@@ -297,7 +525,12 @@ GoatMessage *conn_recv_message(Connection *conn) {
     assert(conn != NULL);
 
     if (0 == pthread_mutex_lock(&conn->m_mutex)) {
-        GoatMessage *message = _conn_dequeue_message(&conn->m_read_queue);
+        GoatMessage *message = NULL;
+
+        // don't pull lines out from under a borrowed message
+        if (0 == conn->m_read_borrowed) {
+            message = _conn_dequeue_message(&conn->m_read_buf);
+        }
 
         pthread_mutex_unlock(&conn->m_mutex);
         return message;
@@ -307,6 +540,186 @@ GoatMessage *conn_recv_message(Connection *conn) {
     }
 }
 
+// parses the next received line in place, without copying or allocating.
+// the view stays valid until conn_release_message(), which must be called
+// before borrowing again.  returns ENOENT if there's nothing to borrow, or
+// EBUSY if another thread is already borrowing from this connection
+int conn_borrow_message(Connection *conn, GoatMessage *view) {
+    assert(conn != NULL);
+    assert(view != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    char *line;
+    size_t len;
+
+    while (0 == (r = ringbuf_borrow_line(&conn->m_read_buf, &line, &len))) {
+        size_t n = _conn_chomp_line(line, len);
+
+        if (n > 0 && 0 == message_view_init(view, line, n)) {
+            conn->m_read_borrowed = len;
+            break;
+        }
+
+        // unparseable, skip it
+        ringbuf_release_line(&conn->m_read_buf, len);
+    }
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return r;
+}
+
+int conn_release_message(Connection *conn, GoatMessage *view) {
+    assert(conn != NULL);
+    assert(view != NULL);
+
+    message_view_fini(view);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    assert(conn->m_read_borrowed > 0);
+
+    ringbuf_release_line(&conn->m_read_buf, conn->m_read_borrowed);
+    conn->m_read_borrowed = 0;
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
+// whether there's a line waiting, without borrowing it.  it might not parse
+int conn_has_message(Connection *conn) {
+    assert(conn != NULL);
+
+    if (pthread_mutex_lock(&conn->m_mutex)) return 0;
+
+    int r = ringbuf_has_line(&conn->m_read_buf);
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return r;
+}
+
+int conn_recv_bytes(Connection *conn, const char *buf, ssize_t len) {
+    assert(conn != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return -1;
+
+    if (conn->m_state.state == GOAT_CONN_CONNECTED) {
+        if (len > 0) {
+            assert(buf != NULL);
+            conn->m_timing.last_recv = timer_now_ms();
+            conn->m_timing.awaiting_pong = 0;
+            if (ringbuf_write(&conn->m_read_buf, buf, len)) {
+                conn->m_state.change_reason = strdup(strerror(ENOMEM));
+                _conn_set_state(conn, GOAT_CONN_DISCONNECTING);
+            }
+            else if (_conn_check_line_len(conn)) {
+                _conn_set_state(conn, GOAT_CONN_DISCONNECTING);
+            }
+        }
+        else {
+            conn->m_state.change_reason = strdup(len ? strerror(-len) : "connection closed by peer");
+            _conn_set_state(conn, GOAT_CONN_DISCONNECTING);
+        }
+    }
+
+    r = ringbuf_has_line(&conn->m_read_buf);
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return r;
+}
+
+size_t conn_detach_write_queue(Connection *conn, StrQueueHead *queue, size_t *offset, size_t max) {
+    assert(conn != NULL);
+    assert(queue != NULL);
+    assert(offset != NULL);
+
+    size_t count = 0;
+
+    STAILQ_INIT(queue);
+    *offset = conn->m_write_offset;
+
+    while (count < max && !STAILQ_EMPTY(&conn->m_write_queue)) {
+        StrQueueEntry *node = STAILQ_FIRST(&conn->m_write_queue);
+
+        STAILQ_REMOVE_HEAD(&conn->m_write_queue, entries);
+        STAILQ_INSERT_TAIL(queue, node, entries);
+        ++ count;
+    }
+
+    conn->m_write_offset = 0;
+
+    return count;
+}
+
+int conn_finish_write(Connection *conn, StrQueueHead *queue, size_t offset, size_t written) {
+    assert(conn != NULL);
+    assert(queue != NULL);
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    offset = _conn_consume_written(queue, offset, written);
+
+    if (conn->m_state.state == GOAT_CONN_CONNECTED) {
+        // whatever wasn't written goes back on the front of the write queue
+        if (!STAILQ_EMPTY(queue)) conn->m_write_offset = offset;
+        STAILQ_CONCAT(queue, &conn->m_write_queue);
+        STAILQ_CONCAT(&conn->m_write_queue, queue);
+    }
+    else {
+        StrQueueEntry *node = STAILQ_FIRST(queue);
+        while (NULL != node) {
+            StrQueueEntry *next = STAILQ_NEXT(node, entries);
+            free(node);
+            node = next;
+        }
+        STAILQ_INIT(queue);
+    }
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return 0;
+}
+
+size_t conn_write_iov(const StrQueueHead *queue, size_t offset, struct iovec *iov, size_t max) {
+    assert(queue != NULL);
+    assert(iov != NULL);
+
+    const StrQueueEntry *node;
+    size_t count = 0;
+
+    STAILQ_FOREACH(node, queue, entries) {
+        if (count == max) break;
+
+        iov[count].iov_base = (char *) &node->str[offset];
+        iov[count].iov_len = node->len - offset;
+        offset = 0;
+        ++ count;
+    }
+
+    return count;
+}
+
+// frees the entries at the head of the queue that have been completely
+// written, and returns the offset of the first unwritten byte in the new head
+size_t _conn_consume_written(StrQueueHead *queue, size_t offset, size_t written) {
+    while (written > 0 && !STAILQ_EMPTY(queue)) {
+        StrQueueEntry *node = STAILQ_FIRST(queue);
+        size_t remaining = node->len - offset;
+
+        if (written < remaining)  return offset + written;
+
+        written -= remaining;
+        offset = 0;
+        STAILQ_REMOVE_HEAD(queue, entries);
+        free(node);
+    }
+
+    return offset;
+}
+
 void _conn_set_state(Connection *conn, ConnState new_state) {
     assert(conn != NULL);
 
@@ -316,16 +729,20 @@ void _conn_set_state(Connection *conn, ConnState new_state) {
 
     state_exit[old_state](conn);
 
+    // enter functions expect to already be in their state
+    conn->m_state.state = new_state;
+
     if (0 != state_enter[new_state](conn)) {
         // FIXME how to handle old change reason?
         if (conn->m_state.change_reason) free(conn->m_state.change_reason);
         conn->m_state.change_reason = strdup("state change failed");
 
         new_state = GOAT_CONN_ERROR;
+        conn->m_state.state = new_state;
         state_enter[GOAT_CONN_ERROR](conn);
     }
 
-    conn->m_state.state = new_state;
+    _conn_schedule(conn, new_state, timer_now_ms());
 
     const char *params[] = {
         "changed",
@@ -339,7 +756,7 @@ void _conn_set_state(Connection *conn, ConnState new_state) {
 
     GoatMessage *message;
     if (NULL != (message = goat_message_new(":goat.connection", "state", params))) {
-        _conn_enqueue_message(&conn->m_read_queue, message);
+        _conn_inject_message(&conn->m_read_buf, message);
         goat_message_delete(message);
     }
 
@@ -350,11 +767,17 @@ void _conn_set_state(Connection *conn, ConnState new_state) {
 ssize_t _conn_send_data(Connection *conn) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
     ssize_t total_bytes_sent = 0;
+    struct iovec iov[IOV_MAX];
 
     while (!STAILQ_EMPTY(&conn->m_write_queue)) {
-        StrQueueEntry *node = STAILQ_FIRST(&conn->m_write_queue);
+        struct msghdr msg = {0};
+        size_t i, len = 0;
 
-        ssize_t wrote = write(conn->m_network.socket, node->str, node->len);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = conn_write_iov(&conn->m_write_queue, conn->m_write_offset, iov, IOV_MAX);
+        for (i = 0; i < (size_t) msg.msg_iovlen; i++)  len += iov[i].iov_len;
+
+        ssize_t wrote = sendmsg(conn->m_network.socket, &msg, MSG_NOSIGNAL);
 
         if (wrote < 0) {
             int e = errno;
@@ -372,30 +795,15 @@ ssize_t _conn_send_data(Connection *conn) {
         }
         else if (wrote == 0) {
             // socket has been disconnected
-            return total_bytes_sent ? total_bytes_sent : 0;
+            return total_bytes_sent ? total_bytes_sent : -1;
         }
-        else if ((size_t) wrote < node->len) {
-            // partial write - reinsert the remainder at the queue head for next
-            // time the socket is writeable
-            STAILQ_REMOVE_HEAD(&conn->m_write_queue, entries);
-            total_bytes_sent += wrote;
-
-            size_t len = node->len - wrote;
-            StrQueueEntry *tmp = malloc(sizeof(StrQueueEntry) + len + 1);
-            tmp->len = len;
-            tmp->has_eol = node->has_eol;
-            strcpy(tmp->str, &node->str[wrote]);
 
-            STAILQ_INSERT_HEAD(&conn->m_write_queue, tmp, entries);
+        total_bytes_sent += wrote;
+        conn->m_write_offset = _conn_consume_written(&conn->m_write_queue,
+            conn->m_write_offset, (size_t) wrote);
 
-            free(node);
-            return total_bytes_sent;
-        }
-        else {
-            // wrote the whole thing, remove it from the queue
-            STAILQ_REMOVE_HEAD(&conn->m_write_queue, entries);
-            total_bytes_sent += wrote;
-        }
+        // short write - socket buffer is full, wait until it's writeable again
+        if ((size_t) wrote < len)  return total_bytes_sent;
     }
 
     return total_bytes_sent;
@@ -404,127 +812,614 @@ ssize_t _conn_send_data(Connection *conn) {
 ssize_t _conn_recv_data(Connection *conn) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
 
-    char buf[516] = {0};
     ssize_t bytes, total_bytes_read = 0;
 
-    bytes = read(conn->m_network.socket, buf, sizeof(buf));
-    while (bytes > 0) {
-        const char * const end = &buf[bytes];
-        char *curr = buf, *next = NULL;
-
-        while (curr != end) {
-            next = curr;
-            while (next != end && *(next++) != '\x0a') ;
-
-            if (*(next - 1) == '\x0a') {
-                // found a complete line, queue it
-                // if the previously-queued line was incomplete, dequeue it and combine with this
-                StrQueueEntry *const partial = STAILQ_LAST(
-                    &conn->m_read_queue,
-                    str_queue_entry,
-                    entries
-                );
-
-                size_t partial_len = partial->has_eol ? 0 : partial->len;
-                size_t len = next - curr;
-
-                StrQueueEntry *node = malloc(
-                    sizeof(StrQueueEntry) + partial_len + len + 1
-                );
-                node->len = partial_len + len;
-                node->has_eol = 1;
-                memset(node->str, '\0', node->len + 1);
-
-                if (partial_len) {
-                    strncat(node->str, partial->str, partial_len);
-                    STAILQ_REMOVE(&conn->m_read_queue, partial, str_queue_entry, entries);
-                    free(partial);
-                }
+    for (;;) {
+        size_t want = conn->m_read_size;
 
-                strncat(node->str, curr, len);
+        // read straight into the buffer, no intermediate copy
+        char *buf = ringbuf_reserve(&conn->m_read_buf, want);
+        if (NULL == buf) return -1;
 
-                STAILQ_INSERT_TAIL(&conn->m_read_queue, node, entries);
-            }
-            else {
-                // found a partial line, queue it for completion later
-                size_t len = next - curr;
+        bytes = read(conn->m_network.socket, buf, want);
+        if (bytes <= 0) break;
+
+        ringbuf_commit(&conn->m_read_buf, bytes);
+        total_bytes_read += bytes;
 
-                StrQueueEntry *node = malloc(sizeof(StrQueueEntry) + len + 1);
-                node->len = len;
-                node->has_eol = 0;
-                strncpy(node->str, curr, len);
-                node->str[len] = '\0';
+        if (_conn_check_line_len(conn)) return -1;
 
-                STAILQ_INSERT_TAIL(&conn->m_read_queue, node, entries);
-            }
+        if ((size_t) bytes == want && want < CONN_READ_MAX) {
+            conn->m_read_size = want * 2;
+        }
+        else if ((size_t) bytes < want / 4 && want > CONN_READ_MIN) {
+            conn->m_read_size = want / 2;
+        }
+    }
 
-            curr = next;
+    return total_bytes_read;
+}
+
+// like _conn_recv_data, but through tls.  a readable socket might only have
+// part of a record, so returns 0 if there's nothing yet, or -1 once the other
+// end has closed or it's failed
+ssize_t _conn_recv_tls(Connection *conn) {
+    assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
+    assert(conn->m_network.tls != NULL);
+
+    ssize_t bytes, total_bytes_read = 0;
+
+    conn->m_network.tls_read_wants = 0;
+
+    for (;;) {
+        size_t want = conn->m_read_size;
+
+        char *buf = ringbuf_reserve(&conn->m_read_buf, want);
+        if (NULL == buf) return -1;
+
+        // keeps going until tls has nothing decrypted left either
+        bytes = tls_read(conn->m_network.tls, buf, want);
+
+        if (bytes == TLS_WANT_POLLIN || bytes == TLS_WANT_POLLOUT) {
+            conn->m_network.tls_read_wants = bytes;
+            break;
+        }
+        if (bytes <= 0) {
+            // closed, or failed
+            return total_bytes_read ? total_bytes_read : -1;
         }
 
+        ringbuf_commit(&conn->m_read_buf, bytes);
         total_bytes_read += bytes;
-        bytes = read(conn->m_network.socket, buf, sizeof(buf));
+
+        if (_conn_check_line_len(conn)) return -1;
+
+        if ((size_t) bytes == want && want < CONN_READ_MAX) {
+            conn->m_read_size = want * 2;
+        }
+        else if ((size_t) bytes < want / 4 && want > CONN_READ_MIN) {
+            conn->m_read_size = want / 2;
+        }
     }
 
     return total_bytes_read;
 }
 
+// a peer that never sends an eol would otherwise have the read buffer grow
+// without end.  returns nonzero, with the reason set, if it's gone too far
+int _conn_check_line_len(Connection *conn) {
+    if (ringbuf_partial_len(&conn->m_read_buf) <= CONN_LINE_MAX) return 0;
+
+    if (conn->m_state.change_reason)  free(conn->m_state.change_reason);
+    conn->m_state.change_reason = strdup("line too long");
+    return -1;
+}
+
+// like _conn_send_data, but through tls, a record's worth of lines at a time.
+// a write that couldn't finish is tried again with at least the same bytes,
+// which are still at the front of the queue
+ssize_t _conn_send_tls(Connection *conn) {
+    assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
+    assert(conn->m_network.tls != NULL);
+
+    ssize_t total_bytes_sent = 0;
+    char record[CONN_TLS_RECORD_MAX];
+
+    conn->m_network.tls_write_wants = 0;
+
+    while (!STAILQ_EMPTY(&conn->m_write_queue)) {
+        size_t len = _conn_gather_written(&conn->m_write_queue, conn->m_write_offset,
+                                          record, sizeof(record));
+
+        ssize_t wrote = tls_write(conn->m_network.tls, record, len);
+
+        if (wrote == TLS_WANT_POLLIN || wrote == TLS_WANT_POLLOUT) {
+            conn->m_network.tls_write_wants = wrote;
+            return total_bytes_sent;
+        }
+        if (wrote <= 0)  return -1;
+
+        total_bytes_sent += wrote;
+        conn->m_write_offset = _conn_consume_written(&conn->m_write_queue,
+            conn->m_write_offset, (size_t) wrote);
+    }
+
+    return total_bytes_sent;
+}
+
+// copies as much of the queue as fits into buf, returning how much that was
+size_t _conn_gather_written(const StrQueueHead *queue, size_t offset, char *buf, size_t size) {
+    const StrQueueEntry *node;
+    size_t len = 0;
+
+    STAILQ_FOREACH(node, queue, entries) {
+        size_t n = node->len - offset;
+        if (n > size - len)  n = size - len;
+
+        memcpy(&buf[len], &node->str[offset], n);
+        len += n;
+        offset = 0;
+
+        if (len == size) break;
+    }
+
+    return len;
+}
+
 int _conn_enqueue_message(StrQueueHead *queue, const GoatMessage *message) {
     assert(queue != NULL);
     assert(message != NULL);
     // FIXME assert is valid message
 
-    char *tmp = goat_message_strdup(message);
-    if (NULL == tmp) return ENOMEM;
-
-    size_t len = strlen(tmp) + 2;  // crlf
-    int r = 0;
+    // serialised straight into the entry, so that's the only allocation
+    const size_t len = message_serialized_len(message) + 2;  // crlf
 
     StrQueueEntry *entry = malloc(sizeof(StrQueueEntry) + len + 1);
-    if (NULL == entry) {
-        r = ENOMEM;
-        goto cleanup;
-    }
+    if (NULL == entry) return ENOMEM;
+
+    char *p = message_serialize(message, entry->str);
+    memcpy(p, "\x0d\x0a", 3);
 
     entry->len = len;
     entry->has_eol = 1;
-    snprintf(entry->str, len + 1, "%s\x0d\x0a", tmp);
     STAILQ_INSERT_TAIL(queue, entry, entries);
 
-cleanup:
-    if (tmp) free(tmp);
-    return r;
+    return 0;
 }
 
-GoatMessage *_conn_dequeue_message(StrQueueHead *queue) {
-    assert(queue != NULL);
+void _conn_free_queue(StrQueueHead *queue) {
+    StrQueueEntry *node = STAILQ_FIRST(queue);
+    while (NULL != node) {
+        StrQueueEntry *next = STAILQ_NEXT(node, entries);
+        free(node);
+        node = next;
+    }
+    STAILQ_INIT(queue);
+}
 
-    GoatMessage *message = NULL;
+// keepalives and registration can't wait behind a backlog of chatter without
+// the server giving up on us, so they get to go first
+ConnLane _conn_lane(const GoatMessage *message) {
+    GoatCommand command;
+
+    if (0 == goat_message_get_command(message, &command)) {
+        switch (command) {
+            case GOAT_IRC_PING:
+            case GOAT_IRC_PONG:
+            case GOAT_IRC_PASS:
+            case GOAT_IRC_NICK:
+            case GOAT_IRC_USER:
+                return CONN_LANE_URGENT;
+
+            case GOAT_IRC_PRIVMSG:
+            case GOAT_IRC_NOTICE:
+            case GOAT_IRC_SQUERY:
+                return CONN_LANE_BULK;
 
-    StrQueueEntry *node = STAILQ_FIRST(queue);
-    if (node != NULL && node->has_eol) {
-        if (NULL != (message = goat_message_new_from_string(node->str, node->len))) {
-            STAILQ_REMOVE_HEAD(queue, entries);
-            free(node);
+            default:
+                return CONN_LANE_NORMAL;
+        }
+    }
+
+    // capability negotiation and sasl aren't commands we recognise
+    const char *command_string = goat_message_get_command_string(message);
+    if (command_string && (0 == strcasecmp(command_string, "CAP")
+                           || 0 == strcasecmp(command_string, "AUTHENTICATE"))
+    ) {
+        return CONN_LANE_URGENT;
+    }
+
+    return CONN_LANE_NORMAL;
+}
+
+// tops the bucket up with a token for every interval that's passed since it
+// was last topped up, to no more than the burst
+void _conn_flood_refill(Connection *conn, uint64_t now) {
+    const unsigned interval = conn->m_flood.settings.interval_ms;
+    const unsigned burst = conn->m_flood.settings.burst ? conn->m_flood.settings.burst : 1;
+
+    if (0 == interval || 0 == conn->m_flood.refilled_at) {
+        conn->m_flood.tokens = burst;
+        conn->m_flood.refilled_at = 0;
+        return;
+    }
+
+    const uint64_t n = (now - conn->m_flood.refilled_at) / interval;
+
+    if (n >= burst - conn->m_flood.tokens) {
+        conn->m_flood.tokens = burst;
+        conn->m_flood.refilled_at = 0;
+    }
+    else {
+        conn->m_flood.tokens += n;
+        conn->m_flood.refilled_at += n * interval;
+    }
+}
+
+// moves as many held lines onto the write queue as there are tokens for,
+// most urgent first, and notes when the next token is due if any are left
+void _conn_flood_release(Connection *conn, uint64_t now) {
+    const int limited = conn->m_flood.settings.interval_ms != 0;
+
+    conn->m_flood.next_at = 0;
+    if (limited)  _conn_flood_refill(conn, now);
+
+    for (int i = 0; i < CONN_LANE_LAST; i++) {
+        StrQueueHead *const lane = &conn->m_flood.lanes[i];
+
+        while (!STAILQ_EMPTY(lane)) {
+            if (limited) {
+                if (0 == conn->m_flood.tokens) {
+                    conn->m_flood.next_at = conn->m_flood.refilled_at + conn->m_flood.settings.interval_ms;
+                    return;
+                }
+
+                // a full bucket starts filling again from when it's first used
+                if (0 == conn->m_flood.refilled_at)  conn->m_flood.refilled_at = now;
+                -- conn->m_flood.tokens;
+            }
+
+            StrQueueEntry *node = STAILQ_FIRST(lane);
+            STAILQ_REMOVE_HEAD(lane, entries);
+            STAILQ_INSERT_TAIL(&conn->m_write_queue, node, entries);
         }
     }
+}
+
+// state change notifications are delivered in order with received lines
+int _conn_inject_message(RingBuf *rb, const GoatMessage *message) {
+    assert(rb != NULL);
+    assert(message != NULL);
+
+    const size_t len = message_serialized_len(message) + 2;  // crlf
+    char line[len + 1];
+
+    char *p = message_serialize(message, line);
+    memcpy(p, "\x0d\x0a", 3);
+
+    return ringbuf_insert_line(rb, line, len);
+}
+
+GoatMessage *_conn_dequeue_message(RingBuf *rb) {
+    assert(rb != NULL);
+
+    GoatMessage *message = NULL;
+    size_t offset, len;
+
+    while (NULL == message && 0 == ringbuf_next_line(rb, &offset, &len)) {
+        char *line = &rb->m_buf[offset];
+        size_t n = _conn_chomp_line(line, len);
+
+        if (n > 0)  message = goat_message_new_from_string(line, n);
+
+        ringbuf_consume(rb, len);
+    }
 
     return message;
 }
 
-int _conn_start_connect(Connection *conn, const struct addrinfo *ai) {
-    assert(conn != NULL);
+// chomps and terminates a received line in place, since the parser wants a
+// c string.  returns its new length, or 0 if it's blank or has embedded nuls
+// and should be dropped
+size_t _conn_chomp_line(char *line, size_t len) {
+    assert(line != NULL);
+    assert(len > 0 && line[len - 1] == '\x0a');
+
+    size_t n = len - 1;
+
+    if (n > 0 && line[n - 1] == '\x0d')  -- n;
+    line[n] = '\0';
+
+    if (NULL != memchr(line, '\0', n))  return 0;
+
+    return n;
+}
+
+// opens a socket and starts it connecting to ai.  on failure, nothing is
+// left open
+int _conn_start_connect(const struct addrinfo *ai, int *socketp) {
     assert(ai != NULL);
+    assert(socketp != NULL);
+
+    const int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) return errno;
+
+    int err = 0;
+
+    // the event loop never blocks on an individual socket
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        err = errno;
+    }
+    else if (0 != connect(fd, ai->ai_addr, ai->ai_addrlen)
+             && errno != EALREADY && errno != EINPROGRESS
+    ) {
+        err = errno;
+    }
 
-    conn->m_network.socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (err) {
+        close(fd);
+        return err;
+    }
+
+    *socketp = fd;
+    return 0;
+}
+
+// puts ai0's addresses in the order to try them: alternating between its
+// first address's family and the rest, otherwise in the resolver's order.
+// returns how many there are
+size_t conn_interleave(const struct addrinfo *ai0, ConnectAttempt *attempts) {
+    assert(ai0 != NULL);
+    assert(attempts != NULL);
+
+    const int family = ai0->ai_family;
+    const struct addrinfo *same = ai0, *other = ai0;
+    int take_same = 1;
+    size_t n = 0;
+
+    for (;;) {
+        while (same && same->ai_family != family)  same = same->ai_next;
+        while (other && other->ai_family == family)  other = other->ai_next;
+
+        if (NULL == same && NULL == other) break;
 
-    if (conn->m_network.socket < 0) return errno;
+        const struct addrinfo **const next = ((take_same && same) || NULL == other) ? &same : &other;
 
-    int ret = connect(conn->m_network.socket, ai->ai_addr, ai->ai_addrlen);
-    int err = errno;
+        attempts[n].ai = *next;
+        attempts[n].socket = -1;
+        attempts[n].expires = 0;
+        ++ n;
 
-    if (ret == 0 || err == EALREADY || err == EINPROGRESS)  return 0;
+        *next = (*next)->ai_next;
+        take_same = !take_same;
+    }
 
-    return err;
+    return n;
+}
+
+// moves the race along: finishes attempts that have connected, failed or run
+// out of time, and starts the next if it's due.  once one has connected it
+// becomes m_network.socket and the rest are closed; until then the poller
+// watches the newest.  returns 0, or an errno once they've all failed
+int _conn_race(Connection *conn, uint64_t now) {
+    ConnectingStateData *const race = conn->m_state.data.connecting;
+    const unsigned connect_ms = conn->m_timing.settings.connect_ms;
+    struct pollfd fds[CONN_ATTEMPTS_MAX];
+    ConnectAttempt *polled[CONN_ATTEMPTS_MAX];
+    int finished[CONN_ATTEMPTS_MAX];
+    size_t n_polled = 0, n_finished = 0;
+
+    if (race->won) return 0;
+
+    for (size_t i = 0; i < race->n_started; i++) {
+        if (race->attempts[i].socket < 0) continue;
+
+        fds[n_polled].fd = race->attempts[i].socket;
+        fds[n_polled].events = POLLOUT;
+        fds[n_polled].revents = 0;
+        polled[n_polled ++] = &race->attempts[i];
+    }
+
+    // the poller only watches one of them, so look at them all
+    if (n_polled > 0 && poll(fds, n_polled, 0) < 0 && errno != EINTR)  return errno;
+
+    for (size_t i = 0; i < n_polled; i++) {
+        ConnectAttempt *const attempt = polled[i];
+        int err = 0;
+
+        if (fds[i].revents) {
+            // "writeable" means connect() finished, SO_ERROR says how
+            socklen_t errsize = sizeof(err);
+            if (0 != getsockopt(attempt->socket, SOL_SOCKET, SO_ERROR, &err, &errsize))  err = errno;
+        }
+        else if (attempt->expires && now >= attempt->expires) {
+            err = ETIMEDOUT;
+        }
+        else {
+            continue;
+        }
+
+        if (0 == err && !race->won) {
+            race->won = 1;
+            conn->m_network.socket = attempt->socket;
+        }
+        else {
+            if (err)  race->error = err;
+            finished[n_finished ++] = attempt->socket;
+        }
+
+        attempt->socket = -1;
+        -- race->n_pending;
+    }
+
+    // a failure means the next one can start straight away
+    int due = n_finished > 0 || now >= race->next_at;
+
+    while (!race->won && race->n_started < race->n_attempts && race->n_pending < CONN_ATTEMPTS_MAX
+           && (0 == race->n_pending || due)
+    ) {
+        ConnectAttempt *const attempt = &race->attempts[race->n_started ++];
+
+        int err = _conn_start_connect(attempt->ai, &attempt->socket);
+        if (err) {
+            race->error = err;
+            continue;
+        }
+
+        attempt->expires = connect_ms ? now + connect_ms : 0;
+        race->next_at = now + CONN_ATTEMPT_DELAY_MS;
+        ++ race->n_pending;
+        due = 0;
+    }
+
+    if (now >= race->next_at)  race->next_at = now + CONN_ATTEMPT_DELAY_MS;
+
+    // not closed until now, so that none of the new sockets can have reused
+    // the descriptor the poller was watching
+    for (size_t i = 0; i < n_finished; i++)  close(finished[i]);
+
+    if (race->won) {
+        for (size_t i = 0; i < race->n_started; i++) {
+            if (race->attempts[i].socket >= 0) {
+                close(race->attempts[i].socket);
+                race->attempts[i].socket = -1;
+            }
+        }
+        race->n_pending = 0;
+        return 0;
+    }
+
+    conn->m_network.socket = -1;
+    for (size_t i = race->n_started; i-- > 0; ) {
+        if (race->attempts[i].socket >= 0) {
+            conn->m_network.socket = race->attempts[i].socket;
+            break;
+        }
+    }
+
+    if (0 == race->n_pending)  return race->error ? race->error : ECONNREFUSED;
+
+    return 0;
+}
+
+// when the race next needs looking at, even if the poller doesn't say so
+uint64_t _conn_race_deadline(const ConnectingStateData *race) {
+    uint64_t deadline = 0;
+
+    // another attempt is due, or there are some the poller isn't watching
+    if (race->n_started < race->n_attempts || race->n_pending > 1)  deadline = race->next_at;
+
+    for (size_t i = 0; i < race->n_started; i++) {
+        const ConnectAttempt *const attempt = &race->attempts[i];
+
+        if (attempt->socket >= 0 && attempt->expires && (0 == deadline || attempt->expires < deadline)) {
+            deadline = attempt->expires;
+        }
+    }
+
+    return deadline;
+}
+
+// ready to start again from scratch
+void _conn_close_network(Connection *conn) {
+    if (conn->m_network.tls) {
+        tls_free(conn->m_network.tls);
+        conn->m_network.tls = NULL;
+    }
+    conn->m_network.tls_read_wants = 0;
+    conn->m_network.tls_write_wants = 0;
+
+    if (conn->m_network.socket >= 0) {
+        close(conn->m_network.socket);
+        conn->m_network.socket = -1;
+    }
+}
+
+// works out when, having just entered new_state, the connection next needs
+// attention even if nothing happens on its socket
+void _conn_schedule(Connection *conn, ConnState new_state, uint64_t now) {
+    const GoatTimeouts *const settings = &conn->m_timing.settings;
+    uint64_t deadline = 0;
+
+    switch (new_state) {
+        case GOAT_CONN_RESOLVING:
+        case GOAT_CONN_SSLHANDSHAKE:
+            if (settings->connect_ms)  deadline = now + settings->connect_ms;
+            break;
+
+        case GOAT_CONN_CONNECTING:
+            // each address has its own timeout
+            deadline = _conn_race_deadline(conn->m_state.data.connecting);
+            break;
+
+        case GOAT_CONN_CONNECTED:
+            conn->m_timing.last_recv = now;
+            conn->m_timing.awaiting_pong = 0;
+            conn->m_timing.reconnects = 0;
+            if (settings->ping_ms)  deadline = now + settings->ping_ms;
+            break;
+
+        case GOAT_CONN_DISCONNECTED:
+        case GOAT_CONN_ERROR:
+            if (settings->reconnect_ms && !conn->m_timing.client_disconnect
+                && conn->m_network.hostname && conn->m_network.servname
+            ) {
+                unsigned shift = conn->m_timing.reconnects;
+                if (shift > CONN_RECONNECT_BACKOFF_MAX)  shift = CONN_RECONNECT_BACKOFF_MAX;
+
+                deadline = now + ((uint64_t) settings->reconnect_ms << shift);
+                ++ conn->m_timing.reconnects;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    conn->m_timing.deadline = deadline;
+}
+
+// the connection's deadline has passed.  what that means depends on what
+// it was waiting for
+void _conn_timed_out(Connection *conn, uint64_t now) {
+    const GoatTimeouts *const settings = &conn->m_timing.settings;
+
+    conn->m_timing.deadline = 0;
+
+    switch (conn->m_state.state) {
+        case GOAT_CONN_CONNECTING:
+            // attempts that have run out of time are finished, and the next
+            // started, when it executes
+            break;
+
+        case GOAT_CONN_RESOLVING:
+        case GOAT_CONN_SSLHANDSHAKE:
+            conn->m_state.change_reason = strdup(strerror(ETIMEDOUT));
+            _conn_set_state(conn, GOAT_CONN_ERROR);
+            break;
+
+        case GOAT_CONN_CONNECTED:
+            if (conn->m_timing.awaiting_pong) {
+                // nothing back since we pinged, so it's gone
+                conn->m_state.change_reason = strdup("ping timeout");
+                _conn_set_state(conn, GOAT_CONN_DISCONNECTING);
+            }
+            else if (settings->ping_ms && now - conn->m_timing.last_recv >= settings->ping_ms) {
+                const char *params[] = { "goat", NULL };
+                GoatMessage *ping = goat_message_new(NULL, "PING", params);
+
+                if (ping) {
+                    // ahead of anything held, and straight out if there's a token for it
+                    if (0 == _conn_enqueue_message(&conn->m_flood.lanes[CONN_LANE_URGENT], ping)) {
+                        conn->m_timing.awaiting_pong = 1;
+                        _conn_flood_release(conn, now);
+                    }
+                    goat_message_delete(ping);
+                }
+
+                conn->m_timing.deadline = now + (conn->m_timing.awaiting_pong && settings->pong_ms
+                                                 ? settings->pong_ms : settings->ping_ms);
+            }
+            else if (settings->ping_ms) {
+                // heard from it since, so not yet
+                conn->m_timing.deadline = conn->m_timing.last_recv + settings->ping_ms;
+            }
+            break;
+
+        case GOAT_CONN_DISCONNECTED:
+        case GOAT_CONN_ERROR:
+            // a scheduled reconnect
+            _conn_close_network(conn);
+            conn->m_state.error = GOAT_E_NONE;
+
+            conn->m_state.change_reason = strdup("reconnecting");
+            _conn_set_state(conn, GOAT_CONN_RESOLVING);
+            break;
+
+        default:
+            break;
+    }
 }
 
 
@@ -545,22 +1440,36 @@ CONN_STATE_ENTER(RESOLVING) {
     conn->m_state.data.resolving = NULL;
 
     if (conn->m_network.ai0) {
-        freeaddrinfo(conn->m_network.ai0);
+        resolver_freeaddrinfo(conn->m_network.ai0);
         conn->m_network.ai0 = NULL;
     }
 
-    return 0;
+    // starts the lookup now, and its poller is told when it's done
+    return resolver_getaddrinfo(
+        &conn->m_state.data.resolving,
+        conn->m_resolver_cache,
+        conn->m_network.hostname,
+        conn->m_network.servname,
+        &conn->m_network.ai0,
+        &conn->m_resolved
+    );
 }
 
 CONN_STATE_EXECUTE(RESOLVING) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_RESOLVING);
 
-    int r = resolver_getaddrinfo(
-        &conn->m_state.data.resolving,
-        conn->m_network.hostname,
-        conn->m_network.servname,
-        &conn->m_network.ai0
-    );
+    int r = 0;
+
+    if (conn->m_state.data.resolving) {
+        r = resolver_getaddrinfo(
+            &conn->m_state.data.resolving,
+            conn->m_resolver_cache,
+            conn->m_network.hostname,
+            conn->m_network.servname,
+            &conn->m_network.ai0,
+            NULL
+        );
+    }
 
     if (r != 0) {
         conn->m_state.change_reason = strdup(gai_strerror(r));
@@ -592,14 +1501,22 @@ CONN_STATE_ENTER(CONNECTING) {
     assert(conn->m_state.data.raw == NULL);
     assert(conn->m_network.ai0 != NULL);
 
-    conn->m_state.data.connecting = calloc(1, sizeof(ConnectingStateData));
-    if (NULL == conn->m_state.data.connecting) {
+    size_t n = 0;
+    for (const struct addrinfo *ai = conn->m_network.ai0; ai != NULL; ai = ai->ai_next)  ++ n;
+
+    ConnectingStateData *race = calloc(1, sizeof(ConnectingStateData) + n * sizeof(ConnectAttempt));
+    if (NULL == race) {
         return -1;
     }
 
-    conn->m_state.data.connecting->ai = conn->m_network.ai0;
+    race->n_attempts = conn_interleave(conn->m_network.ai0, race->attempts);
+
+    // from an earlier connection
+    _conn_close_network(conn);
 
-    int ret = _conn_start_connect(conn, conn->m_state.data.connecting->ai);
+    conn->m_state.data.connecting = race;
+
+    int ret = _conn_race(conn, timer_now_ms());
 
     if (0 != ret) {
         free(conn->m_state.data.connecting);
@@ -612,47 +1529,23 @@ CONN_STATE_ENTER(CONNECTING) {
 
 CONN_STATE_EXECUTE(CONNECTING) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTING);
-    if (conn->m_state.socket_is_writeable) {
-        int err;
-        socklen_t errsize = sizeof(err);
-
-        // "writeable" socket means connect() finished
-        // getsockopt() can tell us whether it actually connected or not
-
-        if (0 == getsockopt(conn->m_network.socket, SOL_SOCKET, SO_ERROR, &err, &errsize)) {
-            if (err) {
-                if (err == EALREADY || err == EINPROGRESS) {
-                    // connect hasn't finished but for some reason we're writeable?
-                    assert(0 == "shouldn't get here?");
-                    // just keep waiting for it to finish?
-                    return conn->m_state.state;
-                }
-
-                // connect failed -- try the next address if there is one
-                if (conn->m_state.data.connecting->ai->ai_next != NULL) {
-                    conn->m_state.data.connecting->ai =
-                        conn->m_state.data.connecting->ai->ai_next;
 
-                    // FIXME send a message about trying again
+    ConnectingStateData *const race = conn->m_state.data.connecting;
 
-                    err = _conn_start_connect(conn, conn->m_state.data.connecting->ai);
-                    if (0 == err) return conn->m_state.state;
-                }
-
-                conn->m_state.change_reason = strdup(strerror(err));
-                return GOAT_CONN_ERROR;
-            }
-
-            if (conn->m_use_ssl)  return GOAT_CONN_SSLHANDSHAKE;
+    int err = _conn_race(conn, timer_now_ms());
+    if (err) {
+        conn->m_state.change_reason = strdup(strerror(err));
+        return GOAT_CONN_ERROR;
+    }
 
-            return GOAT_CONN_CONNECTED;
-        }
+    if (race->won) {
+        if (conn->m_use_ssl)  return GOAT_CONN_SSLHANDSHAKE;
 
-        // getsockopt itself failed, that's unexpected...
-        conn->m_state.change_reason = strdup(strerror(errno));
-        return GOAT_CONN_ERROR;
+        return GOAT_CONN_CONNECTED;
     }
 
+    conn->m_timing.deadline = _conn_race_deadline(race);
+
     return conn->m_state.state;
 }
 
@@ -660,6 +1553,17 @@ CONN_STATE_EXIT(CONNECTING) {
     assert(conn != NULL);
     assert(conn->m_state.state == GOAT_CONN_CONNECTING);
     assert(conn->m_state.data.raw != NULL);
+
+    ConnectingStateData *const race = conn->m_state.data.connecting;
+
+    // whichever the poller was watching, or the winner, is closed along
+    // with the rest of the network
+    for (size_t i = 0; i < race->n_started; i++) {
+        if (race->attempts[i].socket >= 0 && race->attempts[i].socket != conn->m_network.socket) {
+            close(race->attempts[i].socket);
+        }
+    }
+
     free(conn->m_state.data.connecting);
     conn->m_state.data.connecting = NULL;
 }
@@ -669,14 +1573,25 @@ CONN_STATE_ENTER(SSLHANDSHAKE) {
 
     assert(conn->m_network.tls == NULL);
 
+    // shared with its context's other connections, and with the last
+    // session to the same server if nobody else is resuming it right now
+    struct tls_config *config = tlscache_acquire(conn->m_tls_cache,
+        conn->m_network.hostname, &conn->m_tls_session);
+    if (NULL == config) {
+        return -1;
+    }
+
     struct tls *tls = tls_client();
-    tls = tls_client();
     if (NULL == tls) {
+        tlscache_release(conn->m_tls_cache, &conn->m_tls_session, NULL);
         return -1;
     }
 
-    if (0 != tls_configure(tls, NULL)) {
+    if (0 != tls_configure(tls, config)
+        || 0 != tls_connect_socket(tls, conn->m_network.socket, conn->m_network.hostname)
+    ) {
         tls_free(tls);
+        tlscache_release(conn->m_tls_cache, &conn->m_tls_session, NULL);
         return -1;
     }
 
@@ -688,15 +1603,17 @@ CONN_STATE_EXECUTE(SSLHANDSHAKE) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_SSLHANDSHAKE);
     assert(conn->m_network.tls != NULL);
 
-    int ret = tls_connect_socket(conn->m_network.tls,
-        conn->m_network.socket, conn->m_network.hostname);
+    int ret = tls_handshake(conn->m_network.tls);
 
     switch (ret) {
         case 0:
+            conn->m_network.tls_write_wants = 0;
+            tlscache_release(conn->m_tls_cache, &conn->m_tls_session, conn->m_network.tls);
             return GOAT_CONN_CONNECTED;
 
-        case TLS_READ_AGAIN:
-        case TLS_WRITE_AGAIN:
+        case TLS_WANT_POLLIN:
+        case TLS_WANT_POLLOUT:
+            conn->m_network.tls_write_wants = ret;
             return conn->m_state.state;
     }
 
@@ -704,20 +1621,65 @@ CONN_STATE_EXECUTE(SSLHANDSHAKE) {
     return GOAT_CONN_ERROR;
 }
 
-CONN_STATE_EXIT(SSLHANDSHAKE) { ARG_UNUSED(conn); }
+CONN_STATE_EXIT(SSLHANDSHAKE) {
+    assert(conn != NULL);
 
-CONN_STATE_ENTER(CONNECTED) { ARG_UNUSED(conn); return 0; }
+    // didn't finish, so the session's not been touched
+    if (conn->m_tls_session) {
+        tlscache_release(conn->m_tls_cache, &conn->m_tls_session, NULL);
+    }
+}
+
+CONN_STATE_ENTER(CONNECTED) {
+    assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
+
+    // the server's flood counter starts from nothing, so the bucket starts full
+    conn->m_flood.refilled_at = 0;
+    _conn_flood_release(conn, timer_now_ms());
+
+    return 0;
+}
 
 CONN_STATE_EXECUTE(CONNECTED) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
 
+    // held lines whose turn has come
+    if (conn->m_flood.next_at && timer_now_ms() >= conn->m_flood.next_at) {
+        _conn_flood_release(conn, timer_now_ms());
+    }
+
+    if (conn->m_network.tls) {
+        const int readable = conn->m_state.socket_is_readable;
+        const int writeable = conn->m_state.socket_is_writeable;
+
+        // each of them might be waiting on either
+        if (readable || (writeable && conn->m_network.tls_read_wants == TLS_WANT_POLLOUT)) {
+            ssize_t n = _conn_recv_tls(conn);
+            if (n < 0)  return GOAT_CONN_DISCONNECTING;
+
+            if (n > 0) {
+                conn->m_timing.last_recv = timer_now_ms();
+                conn->m_timing.awaiting_pong = 0;
+            }
+        }
+        if (writeable || (readable && conn->m_network.tls_write_wants == TLS_WANT_POLLIN)) {
+            if (_conn_send_tls(conn) < 0)  return GOAT_CONN_DISCONNECTING;
+        }
+
+        return conn->m_state.state;
+    }
+
     if (conn->m_state.socket_is_readable) {
         if (_conn_recv_data(conn) <= 0) {
             return GOAT_CONN_DISCONNECTING;
         }
+
+        conn->m_timing.last_recv = timer_now_ms();
+        conn->m_timing.awaiting_pong = 0;
     }
     if (conn->m_state.socket_is_writeable) {
-        if (_conn_send_data(conn) <= 0) {
+        // nothing sent is fine, the socket buffer might just be full
+        if (_conn_send_data(conn) < 0) {
             return GOAT_CONN_DISCONNECTING;
         }
     }
@@ -725,20 +1687,23 @@ CONN_STATE_EXECUTE(CONNECTED) {
     return conn->m_state.state;
 }
 
-CONN_STATE_EXIT(CONNECTED) { ARG_UNUSED(conn); }
+CONN_STATE_EXIT(CONNECTED) {
+    assert(conn != NULL && conn->m_state.state == GOAT_CONN_CONNECTED);
+
+    // nothing more will be let go until it's connected again
+    conn->m_flood.next_at = 0;
+}
 
 CONN_STATE_ENTER(DISCONNECTING) {
     assert(conn != NULL && conn->m_state.state == GOAT_CONN_DISCONNECTING);
 
-    // clear out the write queue, we're not going to send it
-    StrQueueEntry *n1, *n2;
-    n1 = STAILQ_FIRST(&conn->m_write_queue);
-    while (n1 != NULL) {
-        n2 = STAILQ_NEXT(n1, entries);
-        free(n1);
-        n1 = n2;
-    }
-    STAILQ_INIT(&conn->m_write_queue);
+    // clear out the write queue and anything held back, we're not going to send it
+    for (int i = 0; i < CONN_LANE_LAST; i++)  _conn_free_queue(&conn->m_flood.lanes[i]);
+    _conn_free_queue(&conn->m_write_queue);
+    conn->m_write_offset = 0;
+
+    // whatever a write was waiting for doesn't matter to closing
+    conn->m_network.tls_write_wants = 0;
 
     return 0;
 }
@@ -751,16 +1716,17 @@ CONN_STATE_EXECUTE(DISCONNECTING) {
 
         int ret = tls_close(conn->m_network.tls);
 
-        // FIXME depends on non-blocking tls_close
         switch(ret) {
             case 0:
                 tls_free(conn->m_network.tls);
                 conn->m_network.tls = NULL;
+                conn->m_network.tls_write_wants = 0;
                 goto queue_wait;
 
-            case TLS_READ_AGAIN:
-            case TLS_WRITE_AGAIN:
+            case TLS_WANT_POLLIN:
+            case TLS_WANT_POLLOUT:
                 // need to call close again to finish handshake
+                conn->m_network.tls_write_wants = ret;
                 return conn->m_state.state;
 
             default:
@@ -780,7 +1746,7 @@ CONN_STATE_EXECUTE(DISCONNECTING) {
 queue_wait:
     // once the socket is shut down, stay in disconnecting state until read queue
     // has been emptied (since it contains our status events, not just net io)
-    if (STAILQ_EMPTY(&conn->m_read_queue))  return GOAT_CONN_DISCONNECTED;
+    if (!ringbuf_has_line(&conn->m_read_buf))  return GOAT_CONN_DISCONNECTED;
 
     return conn->m_state.state;
 }
@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/queue.h>
 
 #include <netdb.h>
@@ -13,7 +14,11 @@
 #include <tls.h>
 
 #include "goat.h"
+#include "epoch.h"
 #include "message.h"
+#include "ringbuf.h"
+#include "timer.h"
+#include "tlscache.h"
 #include "tresolver.h"
 
 typedef enum {
@@ -37,8 +42,32 @@ typedef struct str_queue_entry {
 
 typedef STAILQ_HEAD(str_queue_head, str_queue_entry) StrQueueHead;
 
+// outgoing lines wait in these for flood control to let them go, and the
+// more urgent a lane's lines, the sooner they go
+typedef enum {
+    CONN_LANE_URGENT = 0,   // keepalives and registration
+    CONN_LANE_NORMAL,
+    CONN_LANE_BULK,         // messages to users and channels
+
+    CONN_LANE_LAST
+} ConnLane;
+
 typedef struct {
-    struct addrinfo *ai;
+    const struct addrinfo   *ai;
+    int                     socket;     // -1 until started, and once finished
+    uint64_t                expires;    // when it's given up on, or 0 for never
+} ConnectAttempt;
+
+// addresses are raced (rfc 8305): a new attempt starts every so often while
+// the earlier ones are still going, and the first to connect wins
+typedef struct {
+    size_t          n_attempts;
+    size_t          n_started;      // attempts before this have been started
+    size_t          n_pending;      // ... and this many of them are still going
+    uint64_t        next_at;        // when to start another, or look in on them
+    int             won;            // m_network.socket is the winner's
+    int             error;          // from the latest to fail
+    ConnectAttempt  attempts[];     // alternating between address families
 } ConnectingStateData;
 
 typedef struct {
@@ -49,6 +78,8 @@ typedef struct {
         char                *servname;
         struct addrinfo     *ai0;
         struct tls          *tls;
+        int                 tls_read_wants;     // TLS_WANT_POLLIN/OUT if the last read couldn't finish
+        int                 tls_write_wants;    // ... or write, handshake or close
     } m_network;
     struct {
         ConnState           state;
@@ -62,9 +93,45 @@ typedef struct {
         GoatError           error;
         char                *change_reason;
     } m_state;
+    struct {
+        int                 fd;
+        int                 events;
+        int                 ticking;
+        unsigned            gen;
+        int                 recv;
+        unsigned            recv_gen;
+        void                *send;
+    } m_poll;
+    struct {
+        GoatTimeouts        settings;
+        uint64_t            deadline;       // when it next wants ticking regardless of io, or 0
+        uint64_t            armed;          // the deadline its timer is set for, or 0
+        uint64_t            last_recv;
+        int                 awaiting_pong;
+        int                 client_disconnect;  // so don't reconnect
+        unsigned            reconnects;     // attempts since last connected, for backing off
+    } m_timing;
+    Timer               m_timer;
+    struct {
+        GoatFloodControl    settings;
+        StrQueueHead        lanes[CONN_LANE_LAST];
+        unsigned            tokens;         // lines that may go now
+        uint64_t            refilled_at;    // when tokens last went up, or 0 if it's full
+        uint64_t            next_at;        // when lines are held for another token, or 0
+    } m_flood;
     int                 m_use_ssl;
-    StrQueueHead        m_write_queue;
-    StrQueueHead        m_read_queue;
+    StrQueueHead        m_write_queue;      // lines flood control has let go
+    size_t              m_write_offset;     // bytes of the queue head already sent
+    RingBuf             m_read_buf;
+    size_t              m_read_size;
+    size_t              m_read_borrowed;    // length of the line a borrowed message is over
+    unsigned            m_shard;            // worker it belongs to, if the context has them
+    ResolverNotify      m_resolved;         // tells its poller a lookup has finished
+    ResolverCache       *m_resolver_cache;  // its context's
+    TlsCache            *m_tls_cache;       // ... and its tls config
+    TlsCacheEntry       *m_tls_session;     // has its server's session, while handshaking
+    int                 m_dispatch_queued;  // has a task waiting in the context's dispatcher
+    EpochRetired        m_retired;          // for freeing once nobody can see it
 } Connection;
 
 int conn_init(Connection *conn);
@@ -79,10 +146,31 @@ int conn_wants_timeout(const Connection *);
 
 int conn_reset_error(Connection *conn);
 
-int conn_send_message(Connection *conn, const GoatMessage *message);
+int conn_get_timeouts(Connection *conn, GoatTimeouts *timeouts);
+int conn_set_timeouts(Connection *conn, const GoatTimeouts *timeouts);
+uint64_t conn_deadline(const Connection *conn); // caller holds m_mutex
+
+int conn_get_flood_control(Connection *conn, GoatFloodControl *flood);
+int conn_set_flood_control(Connection *conn, const GoatFloodControl *flood);
+int conn_get_queue_stats(Connection *conn, GoatQueueStats *stats);
+
+int conn_send_message(Connection *conn, const GoatMessage *message, int *was_idle);
 
 GoatMessage *conn_recv_message(Connection *conn);
 
+int conn_borrow_message(Connection *conn, GoatMessage *view);
+int conn_release_message(Connection *conn, GoatMessage *view);
+int conn_has_message(Connection *conn);
+
 int conn_tick(Connection *conn, int socket_readable, int socket_writeable);
 
+// for pollers that do the socket io themselves
+int conn_recv_bytes(Connection *conn, const char *buf, ssize_t len);
+size_t conn_detach_write_queue(Connection *conn, StrQueueHead *queue, size_t *offset, size_t max); // caller holds m_mutex
+int conn_finish_write(Connection *conn, StrQueueHead *queue, size_t offset, size_t written);
+
+size_t conn_write_iov(const StrQueueHead *queue, size_t offset, struct iovec *iov, size_t max);
+
+size_t conn_interleave(const struct addrinfo *ai0, ConnectAttempt *attempts);
+
 #endif
@@ -1,22 +1,323 @@
 #include <assert.h>
+#include <errno.h>
 
 #include "context.h"
+#include "timer.h"
 
-Connection *context_get_connection(GoatContext *context, int index) {
+static int _context_grow_slots(GoatContext *context);
+static int _context_grow_live(GoatContext *context);
+
+// the caller must hold m_rwlock, and index must be within m_connections_size
+ConnSlot *context_slot(GoatContext *context, size_t index) {
+    assert(NULL != context);
+    assert(index < context->m_connections_size);
+
+    size_t offset;
+    size_t chunk = context_slot_chunk(index, &offset);
+
+    return &context->m_slots[chunk][offset];
+}
+
+// looks a handle up without taking any locks.  the caller must either be
+// inside epoch_enter() or hold m_rwlock, and may only use the connection
+// until it leaves or unlocks.  handles that have been deleted, and whose
+// slot may have been reused since, are not found
+Connection *context_get_connection(GoatContext *context, int handle) {
+    assert(NULL != context);
+
+    if (handle < 0) return NULL;
+
+    const size_t index = CONN_HANDLE_INDEX(handle);
+    size_t offset;
+    const size_t chunk_index = context_slot_chunk(index, &offset);
+
+    ConnSlot *chunk = __atomic_load_n(&context->m_slots[chunk_index], __ATOMIC_ACQUIRE);
+    if (NULL == chunk) return NULL;
+
+    ConnSlot *const slot = &chunk[offset];
+
+    // connection first: if a new one has been put here since, the
+    // generation we read next will be the new one, and won't match
+    Connection *const conn = __atomic_load_n(&slot->m_conn, __ATOMIC_ACQUIRE);
+    if (NULL == conn) return NULL;
+
+    const unsigned gen = __atomic_load_n(&slot->m_gen, __ATOMIC_ACQUIRE);
+    if (CONN_HANDLE(index, gen) != handle) return NULL;
+
+    return conn;
+}
+
+// for walking the table: the i'th connection in use, and its handle.  the
+// caller must hold m_rwlock, and i must be less than m_connections_count
+Connection *context_connection_at(GoatContext *context, size_t i, int *handle) {
+    assert(i < context->m_connections_count);
+
+    const size_t index = context->m_live[i];
+    ConnSlot *const slot = context_slot(context, index);
+
+    if (handle) *handle = CONN_HANDLE(index, slot->m_gen);
+
+    return slot->m_conn;
+}
+
+// puts conn in a free slot, returning its handle or a negative errno.  the
+// caller must hold m_rwlock for writing
+int context_add_connection(GoatContext *context, Connection *conn) {
     assert(NULL != context);
+    assert(NULL != conn);
+
+    int r;
+
+    if (0 == context->m_free_slots && (r = _context_grow_slots(context))) return -r;
+    if (context->m_connections_count == context->m_live_size && (r = _context_grow_live(context))) return -r;
+
+    const size_t index = context->m_free_slots - 1;
+    ConnSlot *const slot = context_slot(context, index);
+
+    context->m_free_slots = slot->m_next_free;
+    slot->m_next_free = 0;
+
+    slot->m_live = context->m_connections_count;
+    context->m_live[context->m_connections_count ++] = index;
+
+    __atomic_store_n(&slot->m_conn, conn, __ATOMIC_RELEASE);
 
-    Connection *conn = NULL;
+    return CONN_HANDLE(index, slot->m_gen);
+}
+
+// takes the connection out of the table, returning it, or NULL if the handle
+// isn't in use.  the caller must hold m_rwlock for writing, and must not free
+// the connection until nobody can be looking at it
+Connection *context_remove_connection(GoatContext *context, int handle) {
+    assert(NULL != context);
+
+    Connection *const conn = context_get_connection(context, handle);
+    if (NULL == conn) return NULL;
+
+    const size_t index = CONN_HANDLE_INDEX(handle);
+    ConnSlot *const slot = context_slot(context, index);
+
+    // empty the slot before moving on its generation, so a lookup that
+    // sees the new generation can't also see the old connection
+    __atomic_store_n(&slot->m_conn, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->m_gen, slot->m_gen + 1, __ATOMIC_RELEASE);
+
+    // the last live one fills the gap
+    const uint32_t last = context->m_live[-- context->m_connections_count];
+    context->m_live[slot->m_live] = last;
+    context_slot(context, last)->m_live = slot->m_live;
+
+    slot->m_next_free = context->m_free_slots;
+    context->m_free_slots = index + 1;
+
+    return conn;
+}
+
+// frees the table itself, once all its connections are gone
+void context_free_slots(GoatContext *context) {
+    assert(NULL != context);
+    assert(0 == context->m_connections_count);
+
+    for (size_t i = 0; i < CONN_SLOT_CHUNKS; i++) {
+        free(context->m_slots[i]);
+        context->m_slots[i] = NULL;
+    }
+    context->m_connections_size = 0;
+    context->m_free_slots = 0;
+
+    free(context->m_live);
+    context->m_live = NULL;
+    context->m_live_size = 0;
+}
+
+// the poller that looks after conn: its worker's, if the context has them
+Poller *context_poller(GoatContext *context, const Connection *conn) {
+    assert(NULL != context);
+    assert(NULL != conn);
+
+    if (context->m_n_shards) return &context->m_shards[conn->m_shard].m_poller;
+
+    return &context->m_poller;
+}
+
+// the timer wheel that conn's deadlines go in: its worker's, if the context
+// has them
+TimerWheel *context_timers(GoatContext *context, const Connection *conn) {
+    assert(NULL != context);
+    assert(NULL != conn);
+
+    if (context->m_n_shards) return &context->m_shards[conn->m_shard].m_timers;
+
+    return &context->m_timers;
+}
 
-    if (0 == pthread_rwlock_rdlock(&context->m_rwlock)) {
-        if (index >= 0
-            && index < (int) context->m_connections_size
-            && context->m_connections[index] != NULL
-        ) {
-            conn = context->m_connections[index];
+// brings the poller and timer wheel up to date with what the connection
+// now wants from them
+int context_update_connection(GoatContext *context, Connection *conn, int handle) {
+    assert(NULL != context);
+    assert(NULL != conn);
+
+    int r = poller_update(context_poller(context, conn), conn, handle);
+
+    if (0 == pthread_mutex_lock(&conn->m_mutex)) {
+        const uint64_t deadline = conn_deadline(conn);
+
+        // an unchanged deadline is already in the wheel.  once the
+        // connection has been deleted, its timer mustn't go back in
+        if (deadline != conn->m_timing.armed && context_get_connection(context, handle) == conn) {
+            TimerWheel *const wheel = context_timers(context, conn);
+            int t = deadline ? timer_add(wheel, &conn->m_timer, handle, deadline)
+                             : timer_cancel(wheel, &conn->m_timer);
+
+            if (0 == t)  conn->m_timing.armed = deadline;
+            if (0 == r)  r = t;
         }
 
-        pthread_rwlock_unlock(&context->m_rwlock);
+        pthread_mutex_unlock(&conn->m_mutex);
     }
 
-    return conn;
+    return r;
+}
+
+// ticks every connection whose deadline has come, returning the number of
+// events they now have.  with dispatch, also runs their callbacks.  the
+// caller must hold m_rwlock for reading
+int context_run_timers(GoatContext *context, TimerWheel *wheel, int dispatch) {
+    assert(NULL != context);
+    assert(NULL != wheel);
+
+    int expired[POLLER_MAX_EVENTS];
+    size_t n;
+    int events = 0;
+
+    do {
+        n = timer_wheel_advance(wheel, timer_now_ms(), expired, POLLER_MAX_EVENTS);
+
+        for (size_t i = 0; i < n; i++) {
+            Connection *const conn = context_get_connection(context, expired[i]);
+            if (NULL == conn) continue;
+
+            // it's out of the wheel now, so has to go back in if it's still
+            // waiting on the same deadline (one further out than the wheel
+            // reaches comes round early)
+            if (0 == pthread_mutex_lock(&conn->m_mutex)) {
+                conn->m_timing.armed = 0;
+                pthread_mutex_unlock(&conn->m_mutex);
+            }
+
+            int conn_events = conn_tick(conn, 0, 0);
+            context_update_connection(context, conn, expired[i]);
+
+            if (conn_events > 0)  events += conn_events;
+            if (dispatch)  context_dispatch_connection(context, conn, expired[i]);
+        }
+    } while (n == POLLER_MAX_EVENTS);
+
+    return events;
+}
+
+// whichever is sooner of timeout (which may be NULL, for none) and the next
+// timer.  buf is somewhere to put the result if it's the timer
+struct timeval *context_timeout(TimerWheel *wheel, struct timeval *timeout, struct timeval *buf) {
+    assert(NULL != wheel);
+    assert(NULL != buf);
+
+    const long ms = timer_wheel_next_ms(wheel, timer_now_ms());
+    if (ms < 0) return timeout;
+
+    if (timeout && (timeout->tv_sec < ms / 1000
+                    || (timeout->tv_sec == ms / 1000 && timeout->tv_usec <= (ms % 1000) * 1000))) {
+        return timeout;
+    }
+
+    buf->tv_sec = ms / 1000;
+    buf->tv_usec = (ms % 1000) * 1000;
+    return buf;
+}
+
+// finishes an event from poller and ticks its connection, returning the
+// number of events the connection now has.  *connp is set to the connection,
+// or NULL if it has gone away.  the caller must hold m_rwlock for reading
+int context_complete_event(GoatContext *context, Poller *poller, PollerEvent *event, Connection **connp) {
+    assert(NULL != context);
+    assert(NULL != poller);
+    assert(NULL != event);
+    assert(NULL != connp);
+
+    const int handle = event->handle;
+    Connection *const conn = context_get_connection(context, handle);
+
+    *connp = conn;
+
+    if (NULL == conn) {
+        // connection has gone away, but the poller may still need to
+        // release whatever it was holding on its behalf
+        poller_complete(poller, NULL, event);
+        return 0;
+    }
+
+    int conn_events = poller_complete(poller, conn, event);
+
+    if (event->op == POLLER_OP_POLL || event->op == POLLER_OP_TICK) {
+        conn_events = conn_tick(conn, event->readable, event->writeable);
+    }
+
+    context_update_connection(context, conn, handle);
+
+    return conn_events;
+}
+
+// runs callbacks for everything conn has received.  the caller must hold
+// m_rwlock for reading
+void context_dispatch_connection(GoatContext *context, Connection *conn, int handle) {
+    assert(NULL != context);
+    assert(NULL != conn);
+
+    // callbacks get a view straight over the receive buffer
+    GoatMessage message;
+    while (0 == conn_borrow_message(conn, &message)) {
+        event_process(context, handle, &message);
+        conn_release_message(conn, &message);
+    }
+}
+
+// adds the next chunk, which is as big as all the ones before it together
+int _context_grow_slots(GoatContext *context) {
+    size_t first = context->m_connections_size;
+    if (first >= CONN_SLOTS_MAX) return ENFILE;
+
+    size_t offset;
+    const size_t chunk_index = context_slot_chunk(first, &offset);
+    assert(offset == 0);
+
+    size_t n = (size_t) 1 << (CONN_SLOT_CHUNK_BITS + chunk_index);
+    if (first + n > CONN_SLOTS_MAX) n = CONN_SLOTS_MAX - first;
+
+    ConnSlot *chunk = calloc(n, sizeof(ConnSlot));
+    if (NULL == chunk) return errno;
+
+    // lowest index first
+    for (size_t i = 0; i < n; i++) {
+        chunk[i].m_next_free = (i + 1 < n) ? first + i + 2 : context->m_free_slots;
+    }
+    context->m_free_slots = first + 1;
+
+    // chunks are never moved or freed while the context is alive, so
+    // lookups don't need to worry about the table changing under them
+    __atomic_store_n(&context->m_slots[chunk_index], chunk, __ATOMIC_RELEASE);
+    context->m_connections_size += n;
+
+    return 0;
+}
+
+int _context_grow_live(GoatContext *context) {
+    size_t new_size = context->m_live_size ? 2 * context->m_live_size : 16;
+
+    uint32_t *tmp = realloc(context->m_live, new_size * sizeof(uint32_t));
+    if (NULL == tmp) return errno;
+
+    context->m_live = tmp;
+    context->m_live_size = new_size;
+
+    return 0;
 }
@@ -2,6 +2,7 @@
 #define GOAT_CONTEXT_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <tls.h>
@@ -9,16 +10,87 @@
 #include "goat.h"
 
 #include "connection.h"
+#include "epoch.h"
+#include "event.h"
+#include "executor.h"
+#include "poller.h"
+#include "shard.h"
+#include "timer.h"
+#include "tlscache.h"
+#include "tresolver.h"
 
+// handles are a slot index plus the slot's generation.  the generation is
+// moved on each time the slot is emptied, so a handle to a deleted connection
+// stops matching rather than aliasing whatever takes its place.  it's kept
+// to 15 bits so that handles stay positive
+#define CONN_HANDLE_INDEX_BITS  (16)
+#define CONN_HANDLE_GEN_MASK    ((1u << 15) - 1)
+#define CONN_HANDLE(index, gen) \
+    ((int) ((((unsigned) (gen) & CONN_HANDLE_GEN_MASK) << CONN_HANDLE_INDEX_BITS) | (index)))
+#define CONN_HANDLE_INDEX(h)    ((size_t) (h) & (CONN_SLOTS_MAX - 1))
+
+#define CONN_SLOTS_MAX          (1u << CONN_HANDLE_INDEX_BITS)
+
+// slots come in chunks that double in size, the first holding
+// 1 << CONN_SLOT_CHUNK_BITS of them, so the table grows geometrically
+// without ever moving a slot.  enough chunks to cover every index
+#define CONN_SLOT_CHUNK_BITS    (4)
+#define CONN_SLOT_CHUNKS        (CONN_HANDLE_INDEX_BITS - CONN_SLOT_CHUNK_BITS + 1)
+
+typedef struct {
+    Connection          *m_conn;
+    unsigned            m_gen;
+    uint32_t            m_next_free;    // index + 1 of the next free slot, if free
+    uint32_t            m_live;         // position in m_live, if in use
+} ConnSlot;
+
+// m_rwlock is taken to change which connections are in the table, and to walk
+// it, but not to look up a single handle: that's lock-free, with connections
+// kept alive by m_epoch until nobody can be looking at them any more
 struct goat_context {
     pthread_rwlock_t    m_rwlock;
-    Connection          **m_connections;
-    size_t              m_connections_size;
+    ConnSlot            *m_slots[CONN_SLOT_CHUNKS]; // chunks never move once allocated
+    size_t              m_connections_size;     // slots in allocated chunks
     size_t              m_connections_count;
+    uint32_t            m_free_slots;           // index + 1 of the first free slot
+    uint32_t            *m_live;                // indices of slots in use, packed
+    size_t              m_live_size;
     GoatCallback        *m_callbacks;
-    struct tls_config   *m_tls_config;
+    EventSlot           *m_subscriptions;
+    Poller              m_poller;
+    TimerWheel          m_timers;
+    ResolverCache       m_resolver_cache;
+    TlsCache            m_tls_cache;
+    Shard               *m_shards;      // if the context runs its own workers
+    unsigned            m_n_shards;
+    Executor            *m_dispatcher;  // runs callbacks, if not inline
+    Epoch               m_epoch;
 };
 
-Connection *context_get_connection(GoatContext *context, int index);
+ConnSlot *context_slot(GoatContext *context, size_t index);
+Connection *context_get_connection(GoatContext *context, int handle);
+Connection *context_connection_at(GoatContext *context, size_t i, int *handle);
+
+int context_add_connection(GoatContext *context, Connection *conn);
+Connection *context_remove_connection(GoatContext *context, int handle);
+void context_free_slots(GoatContext *context);
+
+Poller *context_poller(GoatContext *context, const Connection *conn);
+TimerWheel *context_timers(GoatContext *context, const Connection *conn);
+int context_update_connection(GoatContext *context, Connection *conn, int handle);
+int context_run_timers(GoatContext *context, TimerWheel *wheel, int dispatch);
+struct timeval *context_timeout(TimerWheel *wheel, struct timeval *timeout, struct timeval *buf);
+int context_complete_event(GoatContext *context, Poller *poller, PollerEvent *event, Connection **connp);
+void context_dispatch_connection(GoatContext *context, Connection *conn, int handle);
+
+// which chunk index is in, and where within it
+static inline size_t context_slot_chunk(size_t index, size_t *offset) {
+    const size_t base = (size_t) 1 << CONN_SLOT_CHUNK_BITS;
+    const size_t chunk = (8 * sizeof(unsigned long) - 1 - __builtin_clzl(index + base))
+                         - CONN_SLOT_CHUNK_BITS;
+
+    *offset = index + base - (base << chunk);
+    return chunk;
+}
 
 #endif
@@ -0,0 +1,198 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+// each thread that has ever entered keeps a record of the global epoch as
+// it was when it last entered, with the low bit set while it's inside.  the
+// global epoch can only move on once every thread inside has caught up with
+// it, so anything retired two epochs ago can no longer be seen by anyone
+#define EPOCH_ACTIVE    (1u)
+
+struct epoch_thread {
+    LIST_ENTRY(epoch_thread) entries;
+    Epoch       *m_epoch;
+    unsigned    m_local;
+    unsigned    m_depth;
+};
+
+static EpochThread *_epoch_get_thread(Epoch *epoch);
+static void _epoch_thread_destroy(void *arg);
+static int _epoch_try_advance(Epoch *epoch);
+
+int epoch_init(Epoch *epoch) {
+    assert(epoch != NULL);
+
+    int r = pthread_mutex_init(&epoch->m_mutex, NULL);
+    if (r) return r;
+
+    r = pthread_key_create(&epoch->m_key, &_epoch_thread_destroy);
+    if (r) {
+        pthread_mutex_destroy(&epoch->m_mutex);
+        return r;
+    }
+
+    epoch->m_global = 0;
+    epoch->m_retired = NULL;
+    LIST_INIT(&epoch->m_threads);
+
+    return 0;
+}
+
+// frees everything still retired, so nobody may be inside any more
+void epoch_destroy(Epoch *epoch) {
+    assert(epoch != NULL);
+
+    pthread_key_delete(epoch->m_key);
+
+    while (epoch->m_retired) {
+        EpochRetired *retired = epoch->m_retired;
+        epoch->m_retired = retired->next;
+        retired->m_free(retired);
+    }
+
+    while (!LIST_EMPTY(&epoch->m_threads)) {
+        EpochThread *thread = LIST_FIRST(&epoch->m_threads);
+        LIST_REMOVE(thread, entries);
+        free(thread);
+    }
+
+    pthread_mutex_destroy(&epoch->m_mutex);
+}
+
+// may be nested; only the outermost enter and exit count
+int epoch_enter(Epoch *epoch) {
+    assert(epoch != NULL);
+
+    EpochThread *thread = _epoch_get_thread(epoch);
+    if (NULL == thread) return ENOMEM;
+
+    if (thread->m_depth++ > 0) return 0;
+
+    // must be visible before anything we go on to read, hence seq_cst
+    unsigned global = __atomic_load_n(&epoch->m_global, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&thread->m_local, (global << 1) | EPOCH_ACTIVE, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+void epoch_exit(Epoch *epoch) {
+    assert(epoch != NULL);
+
+    EpochThread *thread = pthread_getspecific(epoch->m_key);
+    assert(thread != NULL);
+    assert(thread->m_depth > 0);
+
+    if (-- thread->m_depth > 0) return;
+
+    __atomic_store_n(&thread->m_local, thread->m_local & ~EPOCH_ACTIVE, __ATOMIC_RELEASE);
+}
+
+// the caller must already have made retired unreachable to new readers
+void epoch_retire(Epoch *epoch, EpochRetired *retired, void (*free_fn)(EpochRetired *)) {
+    assert(epoch != NULL);
+    assert(retired != NULL);
+    assert(free_fn != NULL);
+
+    retired->m_free = free_fn;
+
+    pthread_mutex_lock(&epoch->m_mutex);
+    retired->m_epoch = __atomic_load_n(&epoch->m_global, __ATOMIC_SEQ_CST);
+    retired->next = epoch->m_retired;
+    epoch->m_retired = retired;
+    pthread_mutex_unlock(&epoch->m_mutex);
+
+    epoch_reclaim(epoch);
+}
+
+// frees whatever nobody can see any more.  cheap if there's nothing retired
+void epoch_reclaim(Epoch *epoch) {
+    assert(epoch != NULL);
+
+    EpochRetired *done = NULL;
+
+    if (NULL == __atomic_load_n(&epoch->m_retired, __ATOMIC_RELAXED)) return;
+
+    if (pthread_mutex_lock(&epoch->m_mutex)) return;
+
+    _epoch_try_advance(epoch);
+
+    const unsigned global = epoch->m_global;
+    EpochRetired **p = &epoch->m_retired;
+
+    while (*p) {
+        EpochRetired *retired = *p;
+
+        if (global - retired->m_epoch >= 2) {
+            *p = retired->next;
+            retired->next = done;
+            done = retired;
+        }
+        else {
+            p = &retired->next;
+        }
+    }
+
+    pthread_mutex_unlock(&epoch->m_mutex);
+
+    // free outside the lock, in case it's slow
+    while (done) {
+        EpochRetired *retired = done;
+        done = retired->next;
+        retired->m_free(retired);
+    }
+}
+
+// caller holds m_mutex
+int _epoch_try_advance(Epoch *epoch) {
+    const unsigned global = __atomic_load_n(&epoch->m_global, __ATOMIC_SEQ_CST);
+    EpochThread *thread;
+
+    LIST_FOREACH(thread, &epoch->m_threads, entries) {
+        unsigned local = __atomic_load_n(&thread->m_local, __ATOMIC_SEQ_CST);
+
+        if ((local & EPOCH_ACTIVE) && (local >> 1) != (global & (~0u >> 1))) return 0;
+    }
+
+    __atomic_store_n(&epoch->m_global, global + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+EpochThread *_epoch_get_thread(Epoch *epoch) {
+    EpochThread *thread = pthread_getspecific(epoch->m_key);
+    if (thread) return thread;
+
+    thread = calloc(1, sizeof(*thread));
+    if (NULL == thread) return NULL;
+
+    thread->m_epoch = epoch;
+
+    if (pthread_setspecific(epoch->m_key, thread)) goto err;
+    if (pthread_mutex_lock(&epoch->m_mutex)) goto err;
+
+    LIST_INSERT_HEAD(&epoch->m_threads, thread, entries);
+
+    pthread_mutex_unlock(&epoch->m_mutex);
+    return thread;
+
+err:
+    pthread_setspecific(epoch->m_key, NULL);
+    free(thread);
+    return NULL;
+}
+
+void _epoch_thread_destroy(void *arg) {
+    EpochThread *thread = arg;
+    Epoch *epoch = thread->m_epoch;
+
+    if (0 == pthread_mutex_lock(&epoch->m_mutex)) {
+        LIST_REMOVE(thread, entries);
+        pthread_mutex_unlock(&epoch->m_mutex);
+
+        free(thread);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef GOAT_EPOCH_H
+#define GOAT_EPOCH_H
+
+#include <config.h>
+
+#include <pthread.h>
+#include <sys/queue.h>
+
+// epoch-based reclamation: readers bracket their use of shared objects with
+// epoch_enter() and epoch_exit(), and objects that have been unpublished
+// are retired rather than freed, until every reader that might still have
+// seen them has moved on
+typedef struct epoch_retired {
+    struct epoch_retired    *next;
+    unsigned                m_epoch;
+    void                    (*m_free)(struct epoch_retired *);
+} EpochRetired;
+
+typedef struct epoch_thread EpochThread;
+
+typedef struct {
+    pthread_mutex_t     m_mutex;
+    pthread_key_t       m_key;
+    unsigned            m_global;
+    EpochRetired        *m_retired;
+    LIST_HEAD(, epoch_thread) m_threads;
+} Epoch;
+
+int epoch_init(Epoch *epoch);
+void epoch_destroy(Epoch *epoch);
+
+int epoch_enter(Epoch *epoch);
+void epoch_exit(Epoch *epoch);
+
+void epoch_retire(Epoch *epoch, EpochRetired *retired, void (*free_fn)(EpochRetired *));
+void epoch_reclaim(Epoch *epoch);
+
+#endif
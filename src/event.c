@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -12,11 +13,87 @@ static const GoatCallback event_default_callbacks[GOAT_EVENT_LAST] = {
 };
 
 static void _event_get_type(const GoatMessage *message, EventPair *events);
+static const EventSlot *_event_get_slot(const GoatContext *context, const GoatMessage *message);
+
+EventSlot *event_slots_new(void) {
+    return calloc(EVENT_SLOTS, sizeof(EventSlot));
+}
+
+void event_slots_delete(EventSlot *slots) {
+    if (NULL == slots) return;
+
+    for (size_t i = 0; i < EVENT_SLOTS; i++) {
+        free(slots[i].m_subscribers);
+    }
+
+    free(slots);
+}
+
+// numerics we recognise share the slot of their command
+size_t event_slot_for_numeric(unsigned numeric) {
+    assert(numeric < 1000);
+
+    GoatCommand command;
+
+    if (0 == irc_numeric_command(numeric, &command)) return command;
+
+    return EVENT_SLOT_NUMERIC(numeric);
+}
+
+int event_subscribe(EventSlot *slot, GoatCommandCallback callback, void *user_data) {
+    assert(slot != NULL);
+    assert(callback != NULL);
+
+    if (slot->m_count == slot->m_size) {
+        if (slot->m_size == UINT16_MAX) return ENOSPC;
+
+        size_t new_size = slot->m_size ? 2 * slot->m_size : 2;
+        if (new_size > UINT16_MAX) new_size = UINT16_MAX;
+
+        EventSubscriber *tmp = realloc(slot->m_subscribers, new_size * sizeof(EventSubscriber));
+        if (NULL == tmp) return errno;
+
+        slot->m_subscribers = tmp;
+        slot->m_size = new_size;
+    }
+
+    slot->m_subscribers[slot->m_count].m_callback = callback;
+    slot->m_subscribers[slot->m_count].m_user_data = user_data;
+    ++ slot->m_count;
+
+    return 0;
+}
+
+// removes the earliest matching subscription, keeping the rest in order
+int event_unsubscribe(EventSlot *slot, GoatCommandCallback callback, void *user_data) {
+    assert(slot != NULL);
+
+    for (size_t i = 0; i < slot->m_count; i++) {
+        EventSubscriber *sub = &slot->m_subscribers[i];
+
+        if (sub->m_callback == callback && sub->m_user_data == user_data) {
+            memmove(sub, sub + 1, (slot->m_count - i - 1) * sizeof(*sub));
+            -- slot->m_count;
+            return 0;
+        }
+    }
+
+    return ECANCELED;
+}
 
 void event_process(GoatContext *context, int connection, const GoatMessage *message) {
     assert(context != NULL);
     assert(message != NULL);
 
+    const EventSlot *slot = _event_get_slot(context, message);
+    if (slot) {
+        for (size_t i = 0; i < slot->m_count; i++) {
+            const EventSubscriber *sub = &slot->m_subscribers[i];
+
+            sub->m_callback(context, connection, message, sub->m_user_data);
+        }
+    }
+
     EventPair ep;
     _event_get_type(message, &ep);
 
@@ -57,7 +134,7 @@ void _event_get_type(const GoatMessage *message, EventPair *events) {
         events->primary = irc_events[message->m_command].primary;
         events->secondary = irc_events[message->m_command].secondary;
     }
-    else if (strspn(message->m_command_string, "0123456789") == strlen(message->m_command_string)) {
+    else if (message->m_numeric) {
         events->primary = GOAT_EVENT_NUMERIC;
         events->secondary = GOAT_EVENT_GENERIC;
     }
@@ -66,3 +143,14 @@ void _event_get_type(const GoatMessage *message, EventPair *events) {
         events->secondary = GOAT_EVENT_GENERIC;
     }
 }
+
+const EventSlot *_event_get_slot(const GoatContext *context, const GoatMessage *message) {
+    if (message->m_have_recognised_command) {
+        return &context->m_subscriptions[message->m_command];
+    }
+    else if (message->m_numeric) {
+        return &context->m_subscriptions[EVENT_SLOT_NUMERIC(message->m_numeric - 1)];
+    }
+
+    return NULL;
+}
@@ -3,9 +3,35 @@
 
 #include <config.h>
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "goat.h"
 #include "message.h"
 
+typedef struct {
+    GoatCommandCallback m_callback;
+    void *m_user_data;
+} EventSubscriber;
+
+typedef struct {
+    EventSubscriber *m_subscribers;
+    uint16_t m_count;
+    uint16_t m_size;
+} EventSlot;
+
+// a flat table with a slot for each command, then one for each three-digit
+// numeric, so finding a message's subscribers is a single index
+#define EVENT_SLOT_NUMERIC(n)   (GOAT_IRC_LAST + (n))
+#define EVENT_SLOTS             (EVENT_SLOT_NUMERIC(1000))
+
+EventSlot *event_slots_new(void);
+void event_slots_delete(EventSlot *slots);
+size_t event_slot_for_numeric(unsigned numeric);
+
+int event_subscribe(EventSlot *slot, GoatCommandCallback callback, void *user_data);
+int event_unsubscribe(EventSlot *slot, GoatCommandCallback callback, void *user_data);
+
 void event_process(GoatContext *context, int connection, const GoatMessage *message);
 
 #endif
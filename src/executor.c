@@ -0,0 +1,237 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "executor.h"
+
+#define EXECUTOR_QUEUE_INITIAL_SIZE (16)
+
+struct executor_worker {
+    Executor            *m_executor;
+    pthread_t           m_thread;
+    pthread_mutex_t     m_mutex;
+    ExecutorTask        *m_tasks;   // ring
+    size_t              m_head;
+    size_t              m_count;
+    size_t              m_size;
+};
+
+static void _executor_stop(Executor *executor, unsigned n_started);
+static void *_executor_main(void *arg);
+static int _executor_take(ExecutorWorker *worker, int steal, ExecutorTask *task);
+static int _executor_find(ExecutorWorker *worker, ExecutorTask *task);
+static int _executor_grow(ExecutorWorker *worker);
+
+int executor_init(Executor *executor, unsigned n_workers) {
+    assert(executor != NULL);
+    assert(n_workers > 0);
+
+    unsigned i;
+    int r;
+
+    memset(executor, 0, sizeof(*executor));
+
+    executor->m_workers = calloc(n_workers, sizeof(ExecutorWorker));
+    if (NULL == executor->m_workers) return errno;
+
+    if (0 != (r = pthread_mutex_init(&executor->m_mutex, NULL))) goto cleanup_workers;
+    if (0 != (r = pthread_cond_init(&executor->m_cond, NULL))) goto cleanup_mutex;
+
+    // every queue has to be ready before any thread goes looking in them
+    for (i = 0; i < n_workers; i++) {
+        ExecutorWorker *const worker = &executor->m_workers[i];
+
+        worker->m_executor = executor;
+
+        if (0 != (r = pthread_mutex_init(&worker->m_mutex, NULL))) goto cleanup_queues;
+    }
+    executor->m_n_workers = n_workers;
+
+    for (i = 0; i < n_workers; i++) {
+        if (0 != (r = pthread_create(&executor->m_workers[i].m_thread, NULL, &_executor_main, &executor->m_workers[i]))) {
+            _executor_stop(executor, i);
+            i = n_workers;
+            goto cleanup_queues;
+        }
+    }
+
+    return 0;
+
+cleanup_queues:
+    while (i-- > 0) {
+        pthread_mutex_destroy(&executor->m_workers[i].m_mutex);
+    }
+    pthread_cond_destroy(&executor->m_cond);
+cleanup_mutex:
+    pthread_mutex_destroy(&executor->m_mutex);
+cleanup_workers:
+    free(executor->m_workers);
+    executor->m_workers = NULL;
+    executor->m_n_workers = 0;
+    return r;
+}
+
+// runs whatever is still queued, then stops the threads.  must not be
+// called from one of them
+void executor_destroy(Executor *executor) {
+    assert(executor != NULL);
+
+    _executor_stop(executor, executor->m_n_workers);
+
+    for (unsigned i = 0; i < executor->m_n_workers; i++) {
+        ExecutorWorker *const worker = &executor->m_workers[i];
+
+        pthread_mutex_destroy(&worker->m_mutex);
+        free(worker->m_tasks);
+    }
+
+    pthread_cond_destroy(&executor->m_cond);
+    pthread_mutex_destroy(&executor->m_mutex);
+
+    free(executor->m_workers);
+    executor->m_workers = NULL;
+    executor->m_n_workers = 0;
+}
+
+// queues the task on the next thread's queue in turn.  if that thread is
+// busy, an idle one will take it from there
+int executor_submit(Executor *executor, const ExecutorTask *task) {
+    assert(executor != NULL);
+    assert(task != NULL);
+    assert(task->m_func != NULL);
+
+    const unsigned i = __atomic_fetch_add(&executor->m_next, 1, __ATOMIC_RELAXED) % executor->m_n_workers;
+    ExecutorWorker *const worker = &executor->m_workers[i];
+
+    int r = pthread_mutex_lock(&worker->m_mutex);
+    if (r) return r;
+
+    if (worker->m_count == worker->m_size && 0 != (r = _executor_grow(worker))) {
+        pthread_mutex_unlock(&worker->m_mutex);
+        return r;
+    }
+
+    worker->m_tasks[(worker->m_head + worker->m_count) % worker->m_size] = *task;
+    ++ worker->m_count;
+
+    // counted before waking anyone, so a thread about to sleep either sees
+    // it or gets woken
+    __atomic_add_fetch(&executor->m_queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&worker->m_mutex);
+
+    pthread_mutex_lock(&executor->m_mutex);
+    pthread_cond_signal(&executor->m_cond);
+    pthread_mutex_unlock(&executor->m_mutex);
+
+    return 0;
+}
+
+// the first n_started workers have threads to wait for
+void _executor_stop(Executor *executor, unsigned n_started) {
+    pthread_mutex_lock(&executor->m_mutex);
+    executor->m_stop = 1;
+    pthread_cond_broadcast(&executor->m_cond);
+    pthread_mutex_unlock(&executor->m_mutex);
+
+    for (unsigned i = 0; i < n_started; i++) {
+        pthread_join(executor->m_workers[i].m_thread, NULL);
+    }
+}
+
+void *_executor_main(void *arg) {
+    ExecutorWorker *const worker = arg;
+    Executor *const executor = worker->m_executor;
+    ExecutorTask task;
+
+    for (;;) {
+        if (_executor_find(worker, &task)) {
+            task.m_func(task.m_arg, task.m_handle);
+            __atomic_add_fetch(&executor->m_tasks, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        pthread_mutex_lock(&executor->m_mutex);
+
+        while (0 == __atomic_load_n(&executor->m_queued, __ATOMIC_SEQ_CST) && !executor->m_stop) {
+            pthread_cond_wait(&executor->m_cond, &executor->m_mutex);
+        }
+
+        const int done = executor->m_stop && 0 == __atomic_load_n(&executor->m_queued, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_unlock(&executor->m_mutex);
+
+        if (done) break;
+    }
+
+    return NULL;
+}
+
+// the oldest task from our own queue, or failing that, the newest from
+// someone else's
+int _executor_find(ExecutorWorker *worker, ExecutorTask *task) {
+    Executor *const executor = worker->m_executor;
+
+    if (_executor_take(worker, 0, task)) return 1;
+
+    const size_t self = worker - executor->m_workers;
+
+    for (unsigned i = 1; i < executor->m_n_workers; i++) {
+        ExecutorWorker *const victim = &executor->m_workers[(self + i) % executor->m_n_workers];
+
+        if (_executor_take(victim, 1, task)) {
+            __atomic_add_fetch(&executor->m_steals, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int _executor_take(ExecutorWorker *worker, int steal, ExecutorTask *task) {
+    int found = 0;
+
+    if (pthread_mutex_lock(&worker->m_mutex)) return 0;
+
+    if (worker->m_count > 0) {
+        if (steal) {
+            *task = worker->m_tasks[(worker->m_head + worker->m_count - 1) % worker->m_size];
+        }
+        else {
+            *task = worker->m_tasks[worker->m_head];
+            worker->m_head = (worker->m_head + 1) % worker->m_size;
+        }
+
+        -- worker->m_count;
+        __atomic_sub_fetch(&worker->m_executor->m_queued, 1, __ATOMIC_SEQ_CST);
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&worker->m_mutex);
+
+    return found;
+}
+
+// the caller must hold the worker's mutex
+int _executor_grow(ExecutorWorker *worker) {
+    size_t new_size = worker->m_size ? 2 * worker->m_size : EXECUTOR_QUEUE_INITIAL_SIZE;
+
+    ExecutorTask *tmp = malloc(new_size * sizeof(ExecutorTask));
+    if (NULL == tmp) return errno;
+
+    // unwrap the ring as we go
+    for (size_t i = 0; i < worker->m_count; i++) {
+        tmp[i] = worker->m_tasks[(worker->m_head + i) % worker->m_size];
+    }
+
+    free(worker->m_tasks);
+    worker->m_tasks = tmp;
+    worker->m_head = 0;
+    worker->m_size = new_size;
+
+    return 0;
+}
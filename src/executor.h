@@ -0,0 +1,36 @@
+#ifndef GOAT_EXECUTOR_H
+#define GOAT_EXECUTOR_H
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stddef.h>
+
+// a pool of threads for running tasks in the background.  each thread has a
+// queue of its own, and takes from the others' when its own is empty
+typedef struct {
+    void                (*m_func)(void *arg, int handle);
+    void                *m_arg;
+    int                 m_handle;
+} ExecutorTask;
+
+typedef struct executor_worker ExecutorWorker;
+
+typedef struct {
+    pthread_mutex_t     m_mutex;    // just for sleeping and waking
+    pthread_cond_t      m_cond;
+    ExecutorWorker      *m_workers;
+    unsigned            m_n_workers;
+    unsigned            m_next;     // round robin for submissions
+    size_t              m_queued;   // across all the queues
+    size_t              m_tasks;    // run so far
+    size_t              m_steals;   // ... of which were taken from another's queue
+    int                 m_stop;
+} Executor;
+
+int executor_init(Executor *executor, unsigned n_workers);
+void executor_destroy(Executor *executor);
+
+int executor_submit(Executor *executor, const ExecutorTask *task);
+
+#endif
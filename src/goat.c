@@ -14,11 +14,12 @@
 
 #include "connection.h"
 #include "context.h"
+#include "epoch.h"
 #include "error.h"
 #include "event.h"
 #include "irc.h"
-
-const size_t CONN_ALLOC_INCR = 16;
+#include "poller.h"
+#include "timer.h"
 
 static GoatError _goat_init() {
     static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -44,9 +45,29 @@ err:
     return r;
 }
 
+static int _goat_tick_poller(GoatContext *context, struct timeval *timeout);
+static void _goat_connection_free(EpochRetired *retired);
+static void _goat_dispatch_task(void *arg, int handle);
+static void _goat_resolved(void *arg, int handle);
+static int _goat_subscribe(GoatContext *context, size_t slot,
+                           GoatCommandCallback callback, void *user_data);
+static int _goat_unsubscribe(GoatContext *context, size_t slot,
+                             GoatCommandCallback callback, void *user_data);
+
 GoatContext *goat_context_new(GoatError *errp) {
+    return goat_context_new_with_mode(GOAT_MODE_SELECT, errp);
+}
+
+GoatContext *goat_context_new_with_mode(GoatContextMode mode, GoatError *errp) {
+    GoatError r = 0;
+
+    if (mode < GOAT_MODE_SELECT || mode >= GOAT_MODE_LAST) {
+        r = EINVAL;
+        goto err;
+    }
+
     // initialise global state if neccesary
-    GoatError r = _goat_init();
+    r = _goat_init();
     if (r) goto err;
 
     // we don't need to lock in here, because no other thread has a pointer to this context yet
@@ -57,12 +78,37 @@ GoatContext *goat_context_new(GoatError *errp) {
     }
 
     r = pthread_rwlock_init(&context->m_rwlock, NULL);
-    if (r) goto cleanup;
+    if (r) {
+        free(context);
+        goto err;
+    }
 
-    context->m_connections = calloc(CONN_ALLOC_INCR, sizeof(Connection *));
-    if (NULL == context->m_connections) {
-        r = errno;
-        goto cleanup;
+    r = poller_init(&context->m_poller, mode);
+    if (r && mode == GOAT_MODE_URING) {
+        // io_uring is optional, fall back to select if we can't have it
+        r = poller_init(&context->m_poller, GOAT_MODE_SELECT);
+    }
+    if (r) {
+        pthread_rwlock_destroy(&context->m_rwlock);
+        free(context);
+        goto err;
+    }
+
+    r = timer_wheel_init(&context->m_timers, timer_now_ms());
+    if (r) {
+        poller_destroy(&context->m_poller);
+        pthread_rwlock_destroy(&context->m_rwlock);
+        free(context);
+        goto err;
+    }
+
+    r = epoch_init(&context->m_epoch);
+    if (r) {
+        timer_wheel_destroy(&context->m_timers);
+        poller_destroy(&context->m_poller);
+        pthread_rwlock_destroy(&context->m_rwlock);
+        free(context);
+        goto err;
     }
 
     context->m_callbacks = calloc(GOAT_EVENT_LAST, sizeof(GoatCallback));
@@ -71,14 +117,28 @@ GoatContext *goat_context_new(GoatError *errp) {
         goto cleanup;
     }
 
-    context->m_connections_size = CONN_ALLOC_INCR;
+    context->m_subscriptions = event_slots_new();
+    if (NULL == context->m_subscriptions) {
+        r = errno;
+        goto cleanup;
+    }
+
+    r = tlscache_init(&context->m_tls_cache);
+    if (r) goto cleanup;
+
+    resolver_cache_init(&context->m_resolver_cache, RESOLVER_CACHE_TTL_MS, RESOLVER_CACHE_NEGATIVE_TTL_MS);
+
+    context->m_connections_size = 0;
     context->m_connections_count = 0;
 
     return context;
 
 cleanup:
+    if (context->m_subscriptions)  event_slots_delete(context->m_subscriptions);
     if (context->m_callbacks)  free(context->m_callbacks);
-    if (context->m_connections)  free(context->m_connections);
+    epoch_destroy(&context->m_epoch);
+    timer_wheel_destroy(&context->m_timers);
+    poller_destroy(&context->m_poller);
     pthread_rwlock_destroy(&context->m_rwlock);
     free(context);
 
@@ -87,9 +147,205 @@ err:
     return NULL;
 }
 
+// the context owns n_shards worker threads, each with its own poller, and
+// spreads connections across them.  callbacks run on the worker that owns
+// the connection, so goat_tick() and goat_dispatch_events() have nothing to
+// do.  n_shards of 0 means one per cpu.  with pin_cpus, worker n is pinned to
+// cpu n (modulo the number of cpus).  select mode gets epoll workers where
+// there's epoll, and workers that poll() their own connections where there
+// isn't; asking for epoll where there isn't fails with ENOTSUP
+GoatContext *goat_context_new_sharded(GoatContextMode mode, unsigned n_shards,
+                                      int pin_cpus, GoatError *errp) {
+    GoatError r = 0;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus < 1)  n_cpus = 1;
+
+    if (mode < GOAT_MODE_SELECT || mode >= GOAT_MODE_LAST) {
+        r = EINVAL;
+        goto err;
+    }
+
+    if (0 == n_shards)  n_shards = n_cpus;
+
+    // the context's own poller isn't used
+    GoatContext *context = goat_context_new_with_mode(GOAT_MODE_SELECT, &r);
+    if (NULL == context) goto err;
+
+    context->m_shards = calloc(n_shards, sizeof(Shard));
+    if (NULL == context->m_shards) {
+        r = errno;
+        goto cleanup;
+    }
+
+    for ( ; context->m_n_shards < n_shards; context->m_n_shards ++) {
+        const unsigned i = context->m_n_shards;
+
+        r = shard_init(&context->m_shards[i], context, i, mode, pin_cpus ? (int) (i % n_cpus) : -1);
+        if (r) goto cleanup;
+    }
+
+    // only once everything else is ready
+    for (unsigned i = 0; i < context->m_n_shards; i++) {
+        r = shard_start(&context->m_shards[i]);
+        if (r) goto cleanup;
+    }
+
+    return context;
+
+cleanup:
+    goat_context_delete(context);
+
+err:
+    if (NULL != errp) *errp = r;
+    return NULL;
+}
+
+GoatContextMode goat_context_get_mode(const GoatContext *context) {
+    assert(context != NULL);
+
+    if (context->m_n_shards) return context->m_shards[0].m_poller.m_mode;
+
+    return context->m_poller.m_mode;
+}
+
+// with n_threads, goat_dispatch_events() hands each connection's callbacks
+// to a pool of that many threads rather than running them itself, so a slow
+// callback only holds up its own connection.  each connection's callbacks
+// still run one at a time, in the order its messages arrived.  0 goes back
+// to running them inline, once any that are queued have run
+GoatError goat_context_set_dispatch_threads(GoatContext *context, unsigned n_threads) {
+    assert(context != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (context->m_n_shards) return EINVAL;
+
+    Executor *dispatcher = NULL, *old;
+    int r;
+
+    if (n_threads > 0) {
+        dispatcher = malloc(sizeof(Executor));
+        if (NULL == dispatcher) return errno;
+
+        r = executor_init(dispatcher, n_threads);
+        if (r) {
+            free(dispatcher);
+            return r;
+        }
+    }
+
+    r = pthread_rwlock_wrlock(&context->m_rwlock);
+    if (r) {
+        old = dispatcher;
+        goto done;
+    }
+
+    old = context->m_dispatcher;
+    context->m_dispatcher = dispatcher;
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+
+done:
+    // its tasks take the lock themselves
+    if (old) {
+        executor_destroy(old);
+        free(old);
+    }
+
+    return r;
+}
+
+GoatError goat_context_get_dispatch_stats(GoatContext *context, GoatDispatchStats *stats) {
+    assert(context != NULL);
+    assert(stats != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (NULL == stats) return EINVAL;
+
+    memset(stats, 0, sizeof(*stats));
+
+    int r = pthread_rwlock_rdlock(&context->m_rwlock);
+    if (r) return r;
+
+    const Executor *const dispatcher = context->m_dispatcher;
+
+    if (dispatcher) {
+        stats->threads = dispatcher->m_n_workers;
+        stats->queued = __atomic_load_n(&dispatcher->m_queued, __ATOMIC_RELAXED);
+        stats->tasks = __atomic_load_n(&dispatcher->m_tasks, __ATOMIC_RELAXED);
+        stats->steals = __atomic_load_n(&dispatcher->m_steals, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+    return 0;
+}
+
+// name lookups for the context's connections share recent answers, for
+// ttl_ms, and recent failures, for negative_ttl_ms.  0 for either stops
+// keeping them, though connections asking for a name that's already being
+// looked up still share the one lookup.  answers cached already keep the
+// time they were given
+GoatError goat_context_set_resolver_cache(GoatContext *context, unsigned ttl_ms, unsigned negative_ttl_ms) {
+    assert(context != NULL);
+
+    if (NULL == context) return EINVAL;
+
+    return resolver_cache_configure(&context->m_resolver_cache, ttl_ms, negative_ttl_ms);
+}
+
+GoatError goat_context_get_resolver_stats(GoatContext *context, GoatResolverStats *stats) {
+    assert(context != NULL);
+    assert(stats != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (NULL == stats) return EINVAL;
+
+    ResolverCache cache;
+
+    memset(stats, 0, sizeof(*stats));
+
+    int r = resolver_cache_stats(&context->m_resolver_cache, &cache);
+    if (r) return r;
+
+    stats->ttl_ms = cache.m_ttl_ms;
+    stats->negative_ttl_ms = cache.m_negative_ttl_ms;
+    stats->entries = cache.m_count;
+    stats->hits = cache.m_hits;
+    stats->negative_hits = cache.m_negative_hits;
+    stats->misses = cache.m_misses;
+    stats->coalesced = cache.m_coalesced;
+
+    return 0;
+}
+
+// tls connections share their context's configuration, which loads the ca
+// roots just the once.  the last session with each server is kept, and the
+// next connection to it tries to resume it rather than doing a full handshake
+GoatError goat_context_get_tls_stats(GoatContext *context, GoatTlsStats *stats) {
+    assert(context != NULL);
+    assert(stats != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (NULL == stats) return EINVAL;
+
+    memset(stats, 0, sizeof(*stats));
+
+    return tlscache_stats(&context->m_tls_cache, &stats->servers, &stats->handshakes, &stats->resumed);
+}
+
 int goat_context_delete(GoatContext *context) {
     assert(context != NULL);
 
+    // workers take the lock themselves, so stop them before taking it
+    for (unsigned i = 0; i < context->m_n_shards; i++) {
+        shard_stop(&context->m_shards[i]);
+    }
+
+    if (context->m_dispatcher) {
+        executor_destroy(context->m_dispatcher);
+        free(context->m_dispatcher);
+        context->m_dispatcher = NULL;
+    }
+
     int r = pthread_rwlock_wrlock(&context->m_rwlock);
     if (r) return r;
 
@@ -97,23 +353,37 @@ int goat_context_delete(GoatContext *context) {
     free(context->m_callbacks);
     context->m_callbacks = NULL;
 
-    for (size_t i = 0; i < context->m_connections_size; i++) {
-        if (context->m_connections[i] != NULL) {
-            Connection *conn = context->m_connections[i];
-            context->m_connections[i] = NULL;
-            -- context->m_connections_count;
+    event_slots_delete(context->m_subscriptions);
+    context->m_subscriptions = NULL;
 
-            conn_destroy(conn);
-            memset(conn, 0, sizeof(Connection));
-            free(conn);
-        }
+    while (context->m_connections_count > 0) {
+        int handle;
+        context_connection_at(context, 0, &handle);
+
+        Connection *conn = context_remove_connection(context, handle);
+
+        conn_destroy(conn);
+        memset(conn, 0, sizeof(Connection));
+        free(conn);
     }
-    free(context->m_connections);
-    context->m_connections = NULL;
-    context->m_connections_size = 0;
-    assert(context->m_connections_count == 0);
+    context_free_slots(context);
+
+    // connections deleted earlier may still be waiting to be freed
+    epoch_destroy(&context->m_epoch);
 
-    if (context->m_tls_config) tls_config_free(context->m_tls_config);
+    resolver_cache_destroy(&context->m_resolver_cache);
+
+    tlscache_destroy(&context->m_tls_cache);
+
+    timer_wheel_destroy(&context->m_timers);
+    poller_destroy(&context->m_poller);
+
+    for (unsigned i = 0; i < context->m_n_shards; i++) {
+        shard_destroy(&context->m_shards[i]);
+    }
+    free(context->m_shards);
+    context->m_shards = NULL;
+    context->m_n_shards = 0;
 
     pthread_rwlock_unlock(&context->m_rwlock);
     pthread_rwlock_destroy(&context->m_rwlock);
@@ -126,11 +396,17 @@ GoatError goat_error(const GoatContext *context, GoatConnection connection) {
     assert(context != NULL);
 
     if (context == NULL) return EINVAL;
-    if (connection < 0) return EINVAL;
-    if ((size_t) connection > context->m_connections_count) return EINVAL;
-    if (context->m_connections[connection] == NULL) return EINVAL;
 
-    return context->m_connections[connection]->m_state.error;
+    GoatContext *mutable = (GoatContext *) context;
+
+    int r = epoch_enter(&mutable->m_epoch);
+    if (r) return r;
+
+    Connection *const conn = context_get_connection(mutable, connection);
+    r = conn ? conn->m_state.error : EINVAL;
+
+    epoch_exit(&mutable->m_epoch);
+    return r;
 }
 
 const char *goat_strerror(GoatError error) {
@@ -144,11 +420,40 @@ int goat_reset_error(GoatContext *context, int connection) {
     assert(context != NULL);
 
     if (context == NULL)  return EINVAL;
-    if (connection < 0)  return EINVAL;
-    if ((size_t) connection >= context->m_connections_size)  return EINVAL;
-    if (context->m_connections[connection] == NULL)  return EINVAL;
 
-    return conn_reset_error(context->m_connections[connection]);
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
+    Connection *const conn = context_get_connection(context, connection);
+    if (NULL == conn) {
+        r = EINVAL;
+        goto done;
+    }
+
+    r = conn_reset_error(conn);
+    if (r) goto done;
+
+    r = context_update_connection(context, conn, connection);
+
+done:
+    epoch_exit(&context->m_epoch);
+    return r;
+}
+
+// which of a sharded context's workers looks after the connection, or -1 if
+// the context isn't sharded or the connection doesn't exist
+int goat_connection_get_shard(GoatContext *context, GoatConnection connection) {
+    assert(context != NULL);
+
+    if (NULL == context || 0 == context->m_n_shards) return -1;
+
+    if (epoch_enter(&context->m_epoch)) return -1;
+
+    Connection *const conn = context_get_connection(context, connection);
+    int shard = conn ? (int) conn->m_shard : -1;
+
+    epoch_exit(&context->m_epoch);
+    return shard;
 }
 
 GoatConnection goat_connection_new(GoatContext *context, GoatError *errp) {
@@ -162,24 +467,12 @@ GoatConnection goat_connection_new(GoatContext *context, GoatError *errp) {
         goto err;
     }
 
+    // a good time to finish off any connections deleted earlier
+    epoch_reclaim(&context->m_epoch);
+
     r = pthread_rwlock_wrlock(&context->m_rwlock);
     if (r) goto err;
 
-    if (context->m_connections_count == context->m_connections_size) {
-        size_t new_size = context->m_connections_size + CONN_ALLOC_INCR;
-
-        Connection **tmp = calloc(new_size, sizeof(Connection *));
-        if (NULL == tmp) {
-            r = errno;
-            goto done;
-        }
-
-        memcpy(tmp, context->m_connections, context->m_connections_size * sizeof(Connection *));
-        free(context->m_connections);
-        context->m_connections = tmp;
-        context->m_connections_size = new_size;
-    }
-
     Connection *conn = malloc(sizeof(Connection));
     if (NULL == conn) {
         r = errno;
@@ -192,8 +485,28 @@ GoatConnection goat_connection_new(GoatContext *context, GoatError *errp) {
         goto done;
     }
 
-    handle = context->m_connections_count ++;
-    context->m_connections[handle] = conn;
+    // the least busy worker gets it
+    for (unsigned i = 1; i < context->m_n_shards; i++) {
+        if (context->m_shards[i].m_n_connections < context->m_shards[conn->m_shard].m_n_connections) {
+            conn->m_shard = i;
+        }
+    }
+
+    handle = context_add_connection(context, conn);
+    if (handle < 0) {
+        r = -handle;
+        handle = -1;
+        conn_destroy(conn);
+        free(conn);
+        goto done;
+    }
+
+    if (context->m_n_shards)  ++ context->m_shards[conn->m_shard].m_n_connections;
+
+    // lookups finish on a resolver thread, and its poller picks them up
+    conn->m_resolved = (ResolverNotify) { &_goat_resolved, context_poller(context, conn), handle };
+    conn->m_resolver_cache = &context->m_resolver_cache;
+    conn->m_tls_cache = &context->m_tls_cache;
 
 done:
     pthread_rwlock_unlock(&context->m_rwlock);
@@ -206,58 +519,185 @@ err:
 GoatError goat_connection_delete(GoatContext *context, GoatConnection *connection) {
     assert(context != NULL);
     assert(connection != NULL);
-    assert(connection >= 0);
-    assert((size_t) *connection < context->m_connections_size);
+    assert(*connection >= 0);
 
     if (NULL == context) return EINVAL;
     if (NULL == connection) return EINVAL;
     if (*connection < 0) return EINVAL;
-    if ((size_t) *connection >= context->m_connections_size) return EINVAL;
 
     int r = 0;
 
     r = pthread_rwlock_wrlock(&context->m_rwlock);
     if (r) return r;
 
-    if (NULL == context->m_connections[*connection]) {
+    Connection *const tmp = context_remove_connection(context, *connection);
+    if (NULL == tmp) {
         r = EINVAL;
         goto done;
     }
 
-    Connection *const tmp = context->m_connections[*connection];
-
-    context->m_connections[*connection] = NULL;
-    -- context->m_connections_count;
+    poller_remove(context_poller(context, tmp), tmp, *connection);
     *connection = -1;
 
-    conn_destroy(tmp);
-    free(tmp);
+    // a sender that found it before it was removed may be about to update
+    // its timer, but will see it's gone once it has the mutex
+    if (0 == pthread_mutex_lock(&tmp->m_mutex)) {
+        timer_cancel(context_timers(context, tmp), &tmp->m_timer);
+        tmp->m_timing.deadline = tmp->m_timing.armed = 0;
+        pthread_mutex_unlock(&tmp->m_mutex);
+    }
+
+    if (context->m_n_shards)  -- context->m_shards[tmp->m_shard].m_n_connections;
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+
+    // other threads may still be using it until they leave their epochs
+    epoch_retire(&context->m_epoch, &tmp->m_retired, &_goat_connection_free);
+    return 0;
 
 done:
     pthread_rwlock_unlock(&context->m_rwlock);
     return r;
 }
 
+void _goat_connection_free(EpochRetired *retired) {
+    Connection *conn = (Connection *) ((char *) retired - offsetof(Connection, m_retired));
+
+    conn_destroy(conn);
+    free(conn);
+}
+
 GoatError goat_connect(GoatContext *context, int connection,
     const char *hostname, const char *servname, int ssl
 ) {
     if (NULL == context) return EINVAL;
 
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
     Connection *conn = context_get_connection(context, connection);
+    if (NULL == conn) {
+        r = EINVAL;
+        goto done;
+    }
 
-    if (NULL == conn) return EINVAL;
+    r = conn_connect(conn, hostname, servname, ssl);
+    if (r) goto done;
 
-    return conn_connect(conn, hostname, servname, ssl);
+    r = context_update_connection(context, conn, connection);
+
+done:
+    epoch_exit(&context->m_epoch);
+    return r;
 }
 
 GoatError goat_disconnect(GoatContext *context, int connection) {
     if (NULL == context) return EINVAL;
 
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
+    Connection *conn = context_get_connection(context, connection);
+    if (NULL == conn) {
+        r = EINVAL;
+        goto done;
+    }
+
+    r = conn_disconnect(conn);
+    if (r) goto done;
+
+    r = context_update_connection(context, conn, connection);
+
+done:
+    epoch_exit(&context->m_epoch);
+    return r;
+}
+
+GoatError goat_get_timeouts(GoatContext *context, GoatConnection connection, GoatTimeouts *timeouts) {
+    if (NULL == context) return EINVAL;
+    if (NULL == timeouts) return EINVAL;
+
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
+    Connection *conn = context_get_connection(context, connection);
+    r = conn ? conn_get_timeouts(conn, timeouts) : EINVAL;
+
+    epoch_exit(&context->m_epoch);
+    return r;
+}
+
+// new timeouts apply from the connection's next state change or ping, so
+// set them before connecting.  reconnecting is off unless reconnect_ms is set
+GoatError goat_set_timeouts(GoatContext *context, GoatConnection connection, const GoatTimeouts *timeouts) {
+    if (NULL == context) return EINVAL;
+    if (NULL == timeouts) return EINVAL;
+
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
+    Connection *conn = context_get_connection(context, connection);
+    r = conn ? conn_set_timeouts(conn, timeouts) : EINVAL;
+
+    epoch_exit(&context->m_epoch);
+    return r;
+}
+
+GoatError goat_get_flood_control(GoatContext *context, GoatConnection connection, GoatFloodControl *flood) {
+    if (NULL == context) return EINVAL;
+    if (NULL == flood) return EINVAL;
+
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
     Connection *conn = context_get_connection(context, connection);
+    r = conn ? conn_get_flood_control(conn, flood) : EINVAL;
 
-    if (NULL == conn) return EINVAL;
+    epoch_exit(&context->m_epoch);
+    return r;
+}
+
+// lines past the burst are held back and sent one per interval, keepalives
+// and registration ahead of everything else, and messages to users and
+// channels last.  an interval of 0 sends everything as fast as it can
+GoatError goat_set_flood_control(GoatContext *context, GoatConnection connection, const GoatFloodControl *flood) {
+    if (NULL == context) return EINVAL;
+    if (NULL == flood) return EINVAL;
+
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
 
-    return conn_disconnect(conn);
+    Connection *conn = context_get_connection(context, connection);
+    if (NULL == conn) {
+        r = EINVAL;
+        goto done;
+    }
+
+    r = conn_set_flood_control(conn, flood);
+    if (r) goto done;
+
+    // it might have let some go, or be due to sooner
+    r = context_update_connection(context, conn, connection);
+
+done:
+    epoch_exit(&context->m_epoch);
+    return r;
+}
+
+// what's waiting to be sent, and about how long it'll take at the
+// connection's flood control rate
+GoatError goat_get_queue_stats(GoatContext *context, GoatConnection connection, GoatQueueStats *stats) {
+    if (NULL == context) return EINVAL;
+    if (NULL == stats) return EINVAL;
+
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
+    Connection *conn = context_get_connection(context, connection);
+    r = conn ? conn_get_queue_stats(conn, stats) : EINVAL;
+
+    epoch_exit(&context->m_epoch);
+    return r;
 }
 
 // use this to get fdsets to select on from your app, if you have your own
@@ -269,14 +709,26 @@ GoatError goat_select_fds(GoatContext *context,
 
     if (NULL == context) return EINVAL;
 
+    // workers do their own waiting
+    if (context->m_n_shards) return 0;
+
+    if (context->m_poller.m_mode != GOAT_MODE_SELECT) {
+        // the poller's own descriptor becomes readable when any of its
+        // connections are ready
+        if (NULL != readfds)  FD_SET(context->m_poller.m_fd, readfds);
+        return 0;
+    }
+
+    // readable when another thread has queued something to send
+    if (NULL != readfds)  FD_SET(context->m_poller.m_wake_fd, readfds);
+
     int r = pthread_rwlock_rdlock(&context->m_rwlock);
     if (r) return r;
 
     if (context->m_connections_count > 0) {
-        for (size_t i = 0; i < context->m_connections_size; i++) {
-            if (context->m_connections[i] != NULL) {
-                Connection *const conn = context->m_connections[i];
-
+        for (size_t i = 0; i < context->m_connections_count; i++) {
+            Connection *const conn = context_connection_at(context, i, NULL);
+            if (conn != NULL) {
                 if (NULL != readfds && conn_wants_read(conn)) {
                     FD_SET(conn->m_network.socket, readfds);
                 }
@@ -291,20 +743,33 @@ GoatError goat_select_fds(GoatContext *context,
     return 0;
 }
 
+// waits up to timeout for connections to need attention, and moves them
+// along.  returns roughly how many events there are to dispatch, or -1 with
+// errno set if the wait failed
 int goat_tick(GoatContext *context, struct timeval *timeout) {
     fd_set readfds, writefds;
+    struct timeval timer_timeout;
     int nfds = -1;
     int events = 0;
 
+    if (context->m_n_shards) return 0;
+
+    if (context->m_poller.m_mode != GOAT_MODE_SELECT) {
+        return _goat_tick_poller(context, timeout);
+    }
+
     FD_ZERO(&readfds);
     FD_ZERO(&writefds);
 
+    // so that sends from other threads don't wait for the timeout
+    FD_SET(context->m_poller.m_wake_fd, &readfds);
+    nfds = context->m_poller.m_wake_fd;
+
     if (0 == pthread_rwlock_tryrdlock(&context->m_rwlock)) {
         if (context->m_connections_count > 0) {
-            for (size_t i = 0; i < context->m_connections_size; i++) {
-                if (context->m_connections[i] != NULL) {
-                    Connection *const conn = context->m_connections[i];
-
+            for (size_t i = 0; i < context->m_connections_count; i++) {
+                Connection *const conn = context_connection_at(context, i, NULL);
+                if (conn != NULL) {
                     if (conn_wants_read(conn)) {
                         nfds = (conn->m_network.socket > nfds ? conn->m_network.socket : nfds);
                         FD_SET(conn->m_network.socket, &readfds);
@@ -324,25 +789,77 @@ int goat_tick(GoatContext *context, struct timeval *timeout) {
     // we unlock here because the select might block indefinitely,
     // and we don't want to do that while holding a lock
 
-    if (select(nfds + 1, &readfds, &writefds, NULL, timeout) >= 0) {
-        if (0 == pthread_rwlock_tryrdlock(&context->m_rwlock)) {
-            if (context->m_connections_count > 0) {
-                for (size_t i = 0; i < context->m_connections_size; i++) {
-                    if (context->m_connections[i] != NULL) {
-                        Connection *const conn = context->m_connections[i];
+    timeout = context_timeout(&context->m_timers, timeout, &timer_timeout);
 
-                        int read_ready = FD_ISSET(conn->m_network.socket, &readfds);
-                        int write_ready = FD_ISSET(conn->m_network.socket, &writefds);
+    if (select(nfds + 1, &readfds, &writefds, NULL, timeout) < 0) {
+        if (errno != EINTR) return -1;
 
-                        int conn_events = conn_tick(conn, read_ready, write_ready);
+        // the sets are undefined now, so carry on as if nothing was ready
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+    }
 
-                        if (conn_events > 0)  events += conn_events;
-                    }
+    if (FD_ISSET(context->m_poller.m_wake_fd, &readfds)) {
+        poller_clear_wake(&context->m_poller);
+    }
+
+    if (0 == pthread_rwlock_tryrdlock(&context->m_rwlock)) {
+        if (context->m_connections_count > 0) {
+            for (size_t i = 0; i < context->m_connections_count; i++) {
+                int handle;
+                Connection *const conn = context_connection_at(context, i, &handle);
+                if (conn != NULL) {
+                    const int socket = conn->m_network.socket;
+
+                    int read_ready = socket >= 0 && FD_ISSET(socket, &readfds);
+                    int write_ready = socket >= 0 && FD_ISSET(socket, &writefds);
+
+                    int conn_events = conn_tick(conn, read_ready, write_ready);
+                    context_update_connection(context, conn, handle);
+
+                    if (conn_events > 0)  events += conn_events;
                 }
             }
+        }
 
-            pthread_rwlock_unlock(&context->m_rwlock);
+        events += context_run_timers(context, &context->m_timers, 0);
+
+        pthread_rwlock_unlock(&context->m_rwlock);
+    }
+
+    return events;
+}
+
+int _goat_tick_poller(GoatContext *context, struct timeval *timeout) {
+    PollerEvent ready[POLLER_MAX_EVENTS];
+    struct timeval timer_timeout;
+    int events = 0;
+
+    // the poller only reports connections that have something to do, so
+    // we don't need to look at the rest of them at all, except those whose
+    // timers are up
+    timeout = context_timeout(&context->m_timers, timeout, &timer_timeout);
+
+    int n_ready = poller_wait(&context->m_poller, ready, POLLER_MAX_EVENTS, timeout);
+    if (n_ready < 0) {
+        // interrupted just means nothing's ready yet, but timers may be due
+        if (errno != EINTR) return -1;
+        n_ready = 0;
+    }
+
+    // not tryrdlock: these events have already been taken from the kernel,
+    // and the poller may be holding received data for them
+    if (0 == pthread_rwlock_rdlock(&context->m_rwlock)) {
+        for (int i = 0; i < n_ready; i++) {
+            Connection *conn;
+            int conn_events = context_complete_event(context, &context->m_poller, &ready[i], &conn);
+
+            if (conn_events > 0)  events += conn_events;
         }
+
+        events += context_run_timers(context, &context->m_timers, 0);
+
+        pthread_rwlock_unlock(&context->m_rwlock);
     }
 
     return events;
@@ -353,19 +870,33 @@ GoatError goat_dispatch_events(GoatContext *context) {
 
     if (NULL == context) return EINVAL;
 
+    // workers dispatch their own connections' events
+    if (context->m_n_shards) return 0;
+
     int r = pthread_rwlock_rdlock(&context->m_rwlock);
     if (r) return r;
 
+    Executor *const dispatcher = context->m_dispatcher;
+
     if (context->m_connections_count > 0) {
-        for (size_t i = 0; i < context->m_connections_size; i++) {
-            if (context->m_connections[i] != NULL) {
-                Connection *const conn = context->m_connections[i];
-
-                GoatMessage *message;
-                while ((message = conn_recv_message(conn))) {
-                    event_process(context, i, message);
-                    goat_message_delete(message);
-                }
+        for (size_t i = 0; i < context->m_connections_count; i++) {
+            int handle;
+            Connection *const conn = context_connection_at(context, i, &handle);
+            if (NULL == conn) continue;
+
+            if (NULL == dispatcher) {
+                context_dispatch_connection(context, conn, handle);
+                continue;
+            }
+
+            // one task per connection at a time keeps its callbacks in order
+            if (!conn_has_message(conn)) continue;
+            if (__atomic_exchange_n(&conn->m_dispatch_queued, 1, __ATOMIC_ACQ_REL)) continue;
+
+            ExecutorTask task = { &_goat_dispatch_task, context, handle };
+            if (executor_submit(dispatcher, &task)) {
+                __atomic_store_n(&conn->m_dispatch_queued, 0, __ATOMIC_RELEASE);
+                context_dispatch_connection(context, conn, handle);
             }
         }
     }
@@ -374,6 +905,33 @@ GoatError goat_dispatch_events(GoatContext *context) {
     return 0;
 }
 
+// runs on a dispatcher thread
+void _goat_dispatch_task(void *arg, int handle) {
+    GoatContext *const context = arg;
+
+    if (pthread_rwlock_rdlock(&context->m_rwlock)) return;
+
+    Connection *const conn = context_get_connection(context, handle);
+
+    if (conn != NULL) {
+        do {
+            context_dispatch_connection(context, conn, handle);
+            __atomic_store_n(&conn->m_dispatch_queued, 0, __ATOMIC_RELEASE);
+
+            // anything that arrived after we'd finished, but before we said
+            // so, would otherwise wait for the next goat_dispatch_events()
+        } while (conn_has_message(conn)
+                 && 0 == __atomic_exchange_n(&conn->m_dispatch_queued, 1, __ATOMIC_ACQ_REL));
+    }
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+}
+
+// runs on a resolver thread
+void _goat_resolved(void *arg, int handle) {
+    poller_post(arg, handle);
+}
+
 GoatError goat_install_callback(GoatContext *context, GoatEvent event, GoatCallback callback) {
     assert(context != NULL);
     assert(event >= GOAT_EVENT_GENERIC);
@@ -415,12 +973,101 @@ GoatError goat_uninstall_callback(GoatContext *context, GoatEvent event, GoatCal
     return r;
 }
 
+GoatError goat_subscribe_command(GoatContext *context, GoatCommand command,
+                                 GoatCommandCallback callback, void *user_data) {
+    assert(context != NULL);
+    assert(command >= GOAT_IRC_FIRST);
+    assert(command < GOAT_IRC_LAST);
+    assert(callback != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (command < GOAT_IRC_FIRST) return EINVAL;
+    if (command >= GOAT_IRC_LAST) return EINVAL;
+    if (NULL == callback) return EINVAL;
+
+    return _goat_subscribe(context, command, callback, user_data);
+}
+
+GoatError goat_unsubscribe_command(GoatContext *context, GoatCommand command,
+                                   GoatCommandCallback callback, void *user_data) {
+    assert(context != NULL);
+    assert(command >= GOAT_IRC_FIRST);
+    assert(command < GOAT_IRC_LAST);
+
+    if (NULL == context) return EINVAL;
+    if (command < GOAT_IRC_FIRST) return EINVAL;
+    if (command >= GOAT_IRC_LAST) return EINVAL;
+
+    return _goat_unsubscribe(context, command, callback, user_data);
+}
+
+GoatError goat_subscribe_numeric(GoatContext *context, unsigned numeric,
+                                 GoatCommandCallback callback, void *user_data) {
+    assert(context != NULL);
+    assert(callback != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (numeric > 999) return EINVAL;
+    if (NULL == callback) return EINVAL;
+
+    return _goat_subscribe(context, event_slot_for_numeric(numeric), callback, user_data);
+}
+
+GoatError goat_unsubscribe_numeric(GoatContext *context, unsigned numeric,
+                                   GoatCommandCallback callback, void *user_data) {
+    assert(context != NULL);
+
+    if (NULL == context) return EINVAL;
+    if (numeric > 999) return EINVAL;
+
+    return _goat_unsubscribe(context, event_slot_for_numeric(numeric), callback, user_data);
+}
+
+int _goat_subscribe(GoatContext *context, size_t slot, GoatCommandCallback callback, void *user_data) {
+    int r = pthread_rwlock_wrlock(&context->m_rwlock);
+    if (r) return r;
+
+    r = event_subscribe(&context->m_subscriptions[slot], callback, user_data);
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+    return r;
+}
+
+int _goat_unsubscribe(GoatContext *context, size_t slot, GoatCommandCallback callback, void *user_data) {
+    int r = pthread_rwlock_wrlock(&context->m_rwlock);
+    if (r) return r;
+
+    r = event_unsubscribe(&context->m_subscriptions[slot], callback, user_data);
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+    return r;
+}
+
 GoatError goat_send_message(GoatContext *context, GoatConnection connection, const GoatMessage *message) {
     if (NULL == context) return EINVAL;
     if (NULL == message) return EINVAL;
 
+    // no context lock: senders on any number of threads don't contend
+    int r = epoch_enter(&context->m_epoch);
+    if (r) return r;
+
     Connection *conn = context_get_connection(context, connection);
-    if (NULL == conn) return EINVAL;
+    if (NULL == conn) {
+        r = EINVAL;
+        goto done;
+    }
 
-    return conn_send_message(conn, message);
+    int was_idle;
+    r = conn_send_message(conn, message, &was_idle);
+    if (r) goto done;
+
+    Poller *const poller = context_poller(context, conn);
+    r = context_update_connection(context, conn, connection);
+
+    // after the update, so that once it's awake it finds everything ready
+    if (was_idle)  poller_wake(poller);
+
+done:
+    epoch_exit(&context->m_epoch);
+    return r;
 }
@@ -8,12 +8,21 @@ typedef struct goat_message GoatMessage;
 typedef int GoatConnection;
 typedef int GoatError;
 
+/* message is only valid until the callback returns; goat_message_clone() it to keep it */
 typedef void (*GoatCallback)(
     GoatContext       *context,
     int                  connection,
     const GoatMessage *message
 );
 
+/* like GoatCallback, plus the user_data it was subscribed with */
+typedef void (*GoatCommandCallback)(
+    GoatContext       *context,
+    int                  connection,
+    const GoatMessage *message,
+    void              *user_data
+);
+
 typedef enum {
     GOAT_EVENT_GENERIC = 0,
     GOAT_EVENT_NUMERIC = 1,
@@ -21,6 +30,71 @@ typedef enum {
     GOAT_EVENT_LAST /* don't use; keep last */
 } GoatEvent;
 
+typedef enum {
+    GOAT_MODE_SELECT = 0,   /* poll every connection with select() on each tick */
+    GOAT_MODE_EPOLL  = 1,   /* register sockets with epoll, tick only ready connections */
+    GOAT_MODE_URING  = 2,   /* io_uring does the socket io itself, select as fallback */
+
+    GOAT_MODE_LAST /* don't use; keep last */
+} GoatContextMode;
+
+typedef enum {
+    GOAT_POOL_MESSAGES = 0,
+    GOAT_POOL_TAGS     = 1,
+
+    GOAT_POOL_LAST /* don't use; keep last */
+} GoatPool;
+
+typedef struct {
+    size_t allocs;  /* objects handed out */
+    size_t reuses;  /* ... of which came from the pool rather than malloc */
+    size_t frees;   /* objects given back to the pool */
+    size_t cached;  /* objects currently held for reuse */
+    size_t cap;     /* most objects the shared pool will hold, per size class */
+} GoatPoolStats;
+
+typedef struct {
+    unsigned connect_ms;    /* to resolve, connect and finish any tls handshake */
+    unsigned ping_ms;       /* quiet for this long, send a PING */
+    unsigned pong_ms;       /* ... and give up if nothing comes back within this */
+    unsigned reconnect_ms;  /* after an unrequested disconnect, or 0 to stay down */
+} GoatTimeouts;             /* 0 turns any of them off */
+
+typedef struct {
+    unsigned burst;         /* lines that can go straight out after a quiet spell */
+    unsigned interval_ms;   /* ... and then one more every this, or 0 for no limit */
+} GoatFloodControl;
+
+typedef struct {
+    size_t lines;       /* queued and not yet sent */
+    size_t bytes;       /* ... and how long they are */
+    size_t held;        /* lines flood control is holding back */
+    unsigned drain_ms;  /* about how long until the last of them can go */
+} GoatQueueStats;
+
+typedef struct {
+    size_t threads; /* dispatcher threads, or 0 if callbacks run inline */
+    size_t queued;  /* connections waiting for a thread */
+    size_t tasks;   /* connections' callbacks run so far */
+    size_t steals;  /* ... of which a thread took from another's queue */
+} GoatDispatchStats;
+
+typedef struct {
+    unsigned ttl_ms;            /* how long answers are reused, or 0 for not at all */
+    unsigned negative_ttl_ms;   /* ... and failures */
+    size_t entries;             /* names cached or being looked up */
+    size_t hits;                /* lookups answered from the cache */
+    size_t negative_hits;       /* ... of which were cached failures */
+    size_t misses;              /* lookups that had to ask */
+    size_t coalesced;           /* lookups that joined one already underway */
+} GoatResolverStats;
+
+typedef struct {
+    size_t servers;     /* server names with a session kept for resuming */
+    size_t handshakes;  /* tls handshakes completed */
+    size_t resumed;     /* ... of which resumed an earlier session */
+} GoatTlsStats;
+
 #define GOAT_E_FIRST (1024)
 enum {
     GOAT_E_NONE = 0,
@@ -257,8 +331,18 @@ typedef enum {
 } GoatCommand;
 
 GoatContext *goat_context_new(GoatError *errp);
+GoatContext *goat_context_new_with_mode(GoatContextMode mode, GoatError *errp);
+GoatContext *goat_context_new_sharded(GoatContextMode mode, unsigned n_shards,
+    int pin_cpus, GoatError *errp);
+GoatContextMode goat_context_get_mode(const GoatContext *context);
 int goat_context_delete(GoatContext *context);
 
+GoatError goat_context_set_dispatch_threads(GoatContext *context, unsigned n_threads);
+GoatError goat_context_get_dispatch_stats(GoatContext *context, GoatDispatchStats *stats);
+GoatError goat_context_set_resolver_cache(GoatContext *context, unsigned ttl_ms, unsigned negative_ttl_ms);
+GoatError goat_context_get_resolver_stats(GoatContext *context, GoatResolverStats *stats);
+GoatError goat_context_get_tls_stats(GoatContext *context, GoatTlsStats *stats);
+
 GoatError goat_error(const GoatContext *context, int connection);
 const char *goat_strerror(GoatError error);
 int goat_reset_error(GoatContext *context, int connection);
@@ -268,10 +352,16 @@ GoatError goat_command(const char *command_string, GoatCommand *command);
 
 GoatConnection goat_connection_new(GoatContext *context, GoatError *errp);
 GoatError goat_connection_delete(GoatContext *context, GoatConnection *connection);
+int goat_connection_get_shard(GoatContext *context, GoatConnection connection);
 
 GoatError goat_connect(GoatContext *context, GoatConnection connection,
     const char *hostname, const char *servname, int ssl);
 GoatError goat_disconnect(GoatContext *context, int connection);
+GoatError goat_get_timeouts(GoatContext *context, GoatConnection connection, GoatTimeouts *timeouts);
+GoatError goat_set_timeouts(GoatContext *context, GoatConnection connection, const GoatTimeouts *timeouts);
+GoatError goat_get_flood_control(GoatContext *context, GoatConnection connection, GoatFloodControl *flood);
+GoatError goat_set_flood_control(GoatContext *context, GoatConnection connection, const GoatFloodControl *flood);
+GoatError goat_get_queue_stats(GoatContext *context, GoatConnection connection, GoatQueueStats *stats);
 int goat_is_connected(GoatContext *connect, int connection);
 int goat_get_hostname(GoatContext *connect, int connection, char **hostname);
 
@@ -280,11 +370,28 @@ GoatError goat_send_message(GoatContext *context, GoatConnection connection, con
 GoatError goat_install_callback(GoatContext *context, GoatEvent event, GoatCallback callback);
 GoatError goat_uninstall_callback(GoatContext *context, GoatEvent event, GoatCallback callback);
 
+/* any number of subscribers per command or numeric, called in the order they
+ * subscribed, before the event callbacks.  numerics we recognise share their
+ * subscribers with the matching command */
+GoatError goat_subscribe_command(GoatContext *context, GoatCommand command,
+                                 GoatCommandCallback callback, void *user_data);
+GoatError goat_unsubscribe_command(GoatContext *context, GoatCommand command,
+                                   GoatCommandCallback callback, void *user_data);
+GoatError goat_subscribe_numeric(GoatContext *context, unsigned numeric,
+                                 GoatCommandCallback callback, void *user_data);
+GoatError goat_unsubscribe_numeric(GoatContext *context, unsigned numeric,
+                                   GoatCommandCallback callback, void *user_data);
+
 GoatError goat_select_fds(GoatContext *context, fd_set *restrict readfds, fd_set *restrict writefds);
 int goat_tick(GoatContext *context, struct timeval *timeout);
 GoatError goat_dispatch_events(GoatContext *context);
 
-#define GOAT_MESSAGE_BUF_SZ (1025)
+/* messages and tags are recycled through process-wide pools */
+GoatError goat_pool_set_cap(GoatPool pool, size_t cap);
+GoatError goat_pool_get_stats(GoatPool pool, GoatPoolStats *stats);
+
+/* big enough for any message: 8191 bytes of tags, 512 of line, and a nul */
+#define GOAT_MESSAGE_BUF_SZ (8704)
 
 GoatMessage *goat_message_new(const char *prefix, const char *command, const char **params);
 GoatMessage *goat_message_new_from_string(const char *str, size_t len);
@@ -305,6 +412,10 @@ GoatError goat_message_get_command(const GoatMessage *message, GoatCommand *comm
 size_t goat_message_has_tags(const GoatMessage *message);
 int goat_message_has_tag(const GoatMessage *message, const char *key);
 GoatError goat_message_get_tag_value(const GoatMessage *message, const char *key, char *value, size_t *size);
+/* like goat_message_get_tag_value(), but points value at the unescaped value
+ * rather than copying it.  it is NOT nul-terminated, and is only valid until
+ * the message is changed or deleted */
+GoatError goat_message_get_tag_value_view(const GoatMessage *message, const char *key, const char **value, size_t *len);
 GoatError goat_message_set_tag(GoatMessage *message, const char *key, const char *value);
 GoatError goat_message_unset_tag(GoatMessage *message, const char *key);
 
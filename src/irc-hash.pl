@@ -0,0 +1,106 @@
+#!/usr/bin/env perl
+
+# generates the command lookup tables for src/irc.c from its irc_strings
+# table: a direct table for three-digit numerics, indexed by value, and a
+# perfect hash for everything else.  the hash function must match
+# _irc_hash() in src/irc.c
+
+use warnings;
+use strict;
+
+sub irc_hash;
+sub try_seed;
+
+my @numerics;
+my @words;
+
+my $in_strings = 0;
+while (<>) {
+    if (m/^const\s+char\s+\*const\s+irc_strings\[/) {
+        $in_strings = 1;
+    }
+    elsif ($in_strings && m/^\s*\[(GOAT_IRC_[A-Z0-9_]+)\]\s*=\s*"([^"]+)"/) {
+        my ($name, $string) = ($1, $2);
+
+        if ($string =~ m/^[0-9]{3}$/) {
+            push @numerics, { name => $name, value => $string + 0 };
+        }
+        else {
+            push @words, { name => $name, string => $string };
+        }
+    }
+    elsif ($in_strings && m/^\};/) {
+        last;
+    }
+}
+
+if (not @words) {
+    print STDERR "error: didn't find any commands in irc_strings\n";
+    exit 1;
+}
+
+# smallest power-of-two table with a seed that gives no collisions
+my ($bits, $seed, $slots);
+for ($bits = 1; (1 << $bits) < 2 * @words; $bits ++) { }
+SEARCH: for ( ; $bits <= 16; $bits ++) {
+    for ($seed = 1; $seed <= 100000; $seed ++) {
+        $slots = try_seed(\@words, $seed, $bits);
+        last SEARCH if $slots;
+    }
+}
+
+if (not $slots) {
+    print STDERR "error: couldn't find a perfect hash for irc_strings\n";
+    exit 1;
+}
+
+print "/****************************************************************************\n";
+print " * generated by $0 - do not edit\n";
+print " */\n";
+print "\n";
+print "#define IRC_HASH_SEED (${seed}u)\n";
+print "#define IRC_HASH_BITS ($bits)\n";
+print "\n";
+print "/* GoatCommand plus one, or 0 if not a command */\n";
+print "static const uint16_t irc_numerics[1000] = {\n";
+foreach my $numeric (@numerics) {
+    printf "    [%3d] = %s + 1,\n", $numeric->{value}, $numeric->{name};
+}
+print "};\n";
+print "\n";
+print "/* GoatCommand plus one, or 0 if not a command */\n";
+print "static const uint16_t irc_hash_slots[1 << IRC_HASH_BITS] = {\n";
+for (my $i = 0; $i < (1 << $bits); $i ++) {
+    printf "    [%3d] = %s + 1,\n", $i, $slots->[$i] if defined $slots->[$i];
+}
+print "};\n";
+print "/****************************************************************************/\n";
+
+exit 0;
+
+# fnv-1a with a seed for the offset basis
+sub irc_hash {
+    my ($str, $seed, $bits) = @_;
+
+    my $h = (2166136261 ^ $seed) & 0xffffffff;
+    foreach my $c (unpack 'C*', $str) {
+        $h = (($h ^ $c) * 16777619) & 0xffffffff;
+    }
+    $h ^= $h >> 16;
+
+    return $h & ((1 << $bits) - 1);
+}
+
+# returns the slot table if the seed places every word without collision
+sub try_seed {
+    my ($words, $seed, $bits) = @_;
+    my @slots;
+
+    foreach my $word (@$words) {
+        my $slot = irc_hash($word->{string}, $seed, $bits);
+        return undef if defined $slots[$slot];
+        $slots[$slot] = $word->{name};
+    }
+
+    return \@slots;
+}
@@ -1,11 +1,13 @@
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "goat.h"
 
 #include "irc.h"
+#include "irc-hash.h" /* generated from irc_strings by irc-hash.pl */
 
 const char *const irc_strings[GOAT_IRC_LAST] = {
     [GOAT_IRC_RPL_WELCOME]              = "001",
@@ -427,8 +429,39 @@ const EventPair irc_events[GOAT_IRC_LAST] = {
     [GOAT_IRC_WHOWAS]   = { GOAT_EVENT_GENERIC, GOAT_EVENT_GENERIC },
 };
 
-static int _irc_strings_cmp(const void *key, const void *iter) {
-    return strcmp((const char *) key, *(const char **) iter);
+// must match irc_hash() in irc-hash.pl
+static inline uint32_t _irc_hash(const char *str) {
+    uint32_t h = 2166136261u ^ IRC_HASH_SEED;
+
+    for ( ; *str; str++) {
+        h = (h ^ (unsigned char) *str) * 16777619u;
+    }
+    h ^= h >> 16;
+
+    return h & ((1u << IRC_HASH_BITS) - 1);
+}
+
+// returns the value of a three-digit numeric, or -1 if str isn't one
+int irc_numeric(const char *str) {
+    assert(str != NULL);
+
+    if (str[0] >= '0' && str[0] <= '9' && str[1] >= '0' && str[1] <= '9'
+        && str[2] >= '0' && str[2] <= '9' && str[3] == '\0'
+    ) {
+        return (str[0] - '0') * 100 + (str[1] - '0') * 10 + (str[2] - '0');
+    }
+
+    return -1;
+}
+
+// finds the command for a numeric, if it's one we recognise
+GoatError irc_numeric_command(unsigned numeric, GoatCommand *command) {
+    assert(command != NULL);
+
+    if (numeric > 999 || 0 == irc_numerics[numeric]) return GOAT_E_UNREC;
+
+    *command = (GoatCommand) (irc_numerics[numeric] - 1);
+    return 0;
 }
 
 const char *goat_command_string(GoatCommand command) {
@@ -444,16 +477,23 @@ GoatError goat_command(const char *command_string, GoatCommand *command) {
     assert(command_string != NULL);
     assert(command != NULL);
 
-    static const size_t width = sizeof(irc_strings[0]);
-    static const size_t nel = sizeof(irc_strings) / sizeof(irc_strings[0]);
-
-    const char **ptr = bsearch(command_string, irc_strings, nel, width, _irc_strings_cmp);
+    const char *s = command_string;
+    const int numeric = irc_numeric(s);
+    uint16_t found;
 
-    if (NULL == ptr) return GOAT_E_UNREC;
+    if (numeric >= 0) {
+        // numerics index straight into their own table
+        found = irc_numerics[numeric];
+    }
+    else {
+        // perfect hash: the only candidate is the one in its slot
+        found = irc_hash_slots[_irc_hash(s)];
+        if (found && 0 != strcmp(s, irc_strings[found - 1]))  found = 0;
+    }
 
-    ptrdiff_t elem = ptr - irc_strings;
+    if (0 == found) return GOAT_E_UNREC;
 
-    if (NULL != command) *command = (GoatCommand) elem;
+    if (NULL != command) *command = (GoatCommand) (found - 1);
 
     return 0;
 }
@@ -10,4 +10,7 @@ extern const char *const irc_strings[];
 
 extern const EventPair irc_events[];
 
+int irc_numeric(const char *str);
+GoatError irc_numeric_command(unsigned numeric, GoatCommand *command);
+
 #endif
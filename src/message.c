@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,9 +9,15 @@
 
 #include "irc.h"
 #include "message.h"
+#include "pool.h"
+#include "scan.h"
 #include "tags.h"
 #include "util.h"
 
+static GoatMessage *_message_alloc(size_t size);
+static int _message_parse(GoatMessage *message, char *str, size_t len);
+static int _message_end_token(const LineScan *scan, char *str, size_t pos, size_t len);
+
 GoatMessage *goat_message_new(const char *prefix, const char *command, const char **params) {
     assert(command != NULL);
     size_t len = 0, n_params = 0;
@@ -46,37 +53,37 @@ GoatMessage *goat_message_new(const char *prefix, const char *command, const cha
     }
     if (len > GOAT_MESSAGE_MAX_LEN)  return NULL;
 
-    GoatMessage *message = calloc(1, sizeof(GoatMessage));
+    GoatMessage *message = _message_alloc(len + 1);
     if (message == NULL)  return NULL;
 
     char *position = message->m_bytes;
 
     if (prefix) {
         *position++ = ':';
-        message->m_prefix = position;
+        message->m_prefix = MESSAGE_OFFSET(message, position);
         position = stpcpy(position, prefix);
         ++ position;
     }
 
     if (0 == goat_command(command, &message->m_command)) {
         message->m_have_recognised_command = 1;
-        message->m_command_string = goat_command_string(message->m_command);
     }
     else {
-        message->m_command_string = position;
+        message->m_command_string = MESSAGE_OFFSET(message, position);
     }
+    message->m_numeric = irc_numeric(command) + 1;
     position = stpcpy(position, command);
 
-    if (params) {
+    if (params && n_params) {
         size_t i;
         for (i = 0; i < n_params - 1; i++) {
             ++position;
-            message->m_params[i] = position;
+            message->m_params[i] = MESSAGE_OFFSET(message, position);
             position = stpcpy(position, params[i]);
         }
         ++position;
         *position++ = ':';
-        message->m_params[i] = position;
+        message->m_params[i] = MESSAGE_OFFSET(message, position);
         position = stpcpy(position, params[i]);
     }
 
@@ -95,119 +102,141 @@ GoatMessage *goat_message_new_from_string(const char *str, size_t len) {
         if (str[len - 1] == '\x0d')  -- len;
     }
 
-    GoatMessage *message = calloc(1, sizeof(GoatMessage));
-    if (message == NULL)  return NULL;
+    const char *tags = NULL;
+    size_t tags_len = 0;
 
     // [ '@' tags SPACE ]
     if (str[0] == '@') {
-        size_t consumed = tags_parse(str, &message->m_tags);
-        if (consumed < 2) goto cleanup; // at least @ and space
+        size_t consumed = tags_parse(str, &tags, &tags_len);
+        if (consumed < 2) return NULL; // at least @ and space
 
         len -= consumed;
         str += consumed;
     }
 
-    if (len > GOAT_MESSAGE_MAX_LEN) goto cleanup;
+    if (len > GOAT_MESSAGE_MAX_LEN) return NULL;
+
+    GoatMessage *message = _message_alloc(len + 1 + (tags ? tags_len + 1 : 0));
+    if (message == NULL)  return NULL;
 
     message->m_len = len;
     strncpy(message->m_bytes, str, len);
 
-    if (str_has_crlf(message->m_bytes)) goto cleanup;
-
-    char *position = message->m_bytes;
-    char *token;
-
-    // [ ':' prefix SPACE ]
-    if (position[0] == ':') {
-        ++ position;
-        token = strsep(&position, " ");
-        if (token[0] == '\0')  goto cleanup;
-        message->m_prefix = token;
-    }
-
-    // command
-    token = strsep(&position, " ");
-    if (token == NULL || token[0] == '\0')  goto cleanup;
-    if (0 == goat_command(token, &message->m_command)) {
-        message->m_have_recognised_command = 1;
-        message->m_command_string = goat_command_string(message->m_command);
-    }
-    else {
-        message->m_command_string = token;
+    if (tags) {
+        message->m_have_inline_tags = 1;
+        message->m_tags_len = tags_len;
+        memcpy(&message->m_bytes[len + 1], tags, tags_len);
     }
 
-    // *14( SPACE middle ) [ SPACE ":" trailing ]
-    // 14( SPACE middle ) [ SPACE [ ":" ] trailing ]
-    unsigned i = 0;
-    while (i < 14 && position) {
-        if (position[0] == ':')  break;
-        token = strsep(&position, " ");
-        message->m_params[i] = token;
-        ++ i;
-    }
-    if (position && position[0] == ':')  ++position;
-    message->m_params[i] = position;
+    if (_message_parse(message, message->m_bytes, len)) goto cleanup;
 
     return message;
 
 cleanup:
-    free(message);
+    goat_message_delete(message);
     return NULL;
 }
 
+// parses a line in place, without copying it or allocating anything.  str
+// must be chomped and nul-terminated, and is modified.  the resulting view
+// must not outlive it, and must not be passed to goat_message_delete()
+int message_view_init(GoatMessage *view, char *str, size_t len) {
+    assert(view != NULL);
+    assert(str != NULL);
+    assert(len > 0);
+    assert(str[len] == '\0');
+
+    memset(view, 0, sizeof(*view));
+
+    // [ '@' tags SPACE ]
+    if (str[0] == '@') {
+        const char *tags = NULL;
+        size_t tags_len = 0;
+
+        size_t consumed = tags_parse(str, &tags, &tags_len);
+        if (consumed < 2) return EINVAL; // at least @ and space
+
+        if (tags) {
+            view->m_tags_view = tags;
+            view->m_tags_len = tags_len;
+        }
+
+        // terminate the tags in place
+        str[consumed - 1] = '\0';
+        len -= consumed;
+        str += consumed;
+    }
+
+    if (len == 0) return EINVAL;
+    if (len > GOAT_MESSAGE_MAX_LEN) return GOAT_E_MSGLEN;
+    view->m_view = str;
+    view->m_len = len;
+
+    if (_message_parse(view, str, len)) return EINVAL;
+
+    return 0;
+}
+
+// lets go of anything the view acquired while it was being looked at
+void message_view_fini(GoatMessage *view) {
+    assert(view != NULL);
+    assert(MESSAGE_IS_VIEW(view));
+
+    tags_index_free(view);
+}
+
 GoatMessage *goat_message_clone(const GoatMessage *orig) {
     assert(orig != NULL);
 
-    GoatMessage *clone = calloc(1, sizeof(GoatMessage));
-    if (NULL == clone) return NULL;
+    GoatMessage *clone;
 
-    if (NULL != orig->m_tags) {
-        clone->m_tags = calloc(1, sizeof(MessageTags));
-        if (NULL == clone->m_tags) goto cleanup;
+    if (!MESSAGE_IS_VIEW(orig) && NULL == orig->m_tags) {
+        // offsets don't need fixing up, so it's just a copy
+        clone = _message_alloc(orig->m_size);
+        if (NULL == clone) return NULL;
 
-        memcpy(clone->m_tags, orig->m_tags, sizeof(MessageTags));
+        memcpy(clone, orig, MESSAGE_ALLOC_SIZE(orig));
+        clone->m_tag_index = NULL;
+        return clone;
     }
 
-    memcpy(clone->m_bytes, orig->m_bytes, orig->m_len);
-    clone->m_len = orig->m_len;
+    // borrowed or modified bytes get gathered into a single allocation
+    const char *tags = MESSAGE_TAGS(orig);
+    size_t tags_len = MESSAGE_TAGS_LEN(orig);
 
-    if (orig->m_prefix) {
-        clone->m_prefix = clone->m_bytes + (orig->m_prefix - orig->m_bytes);
-    }
+    clone = _message_alloc(orig->m_len + 1 + (tags ? tags_len + 1 : 0));
+    if (NULL == clone) return NULL;
 
-    if (orig->m_have_recognised_command) {
-        clone->m_have_recognised_command = orig->m_have_recognised_command;
-        clone->m_command = orig->m_command;
-        clone->m_command_string = goat_command_string(clone->m_command);
-        assert(clone->m_command_string == orig->m_command_string);
-    }
-    else {
-        clone->m_command_string = clone->m_bytes + (orig->m_command_string - orig->m_bytes);
-    }
+    uint16_t size = clone->m_size;
+    memcpy(clone, orig, offsetof(GoatMessage, m_bytes));
+    clone->m_size = size;
+    clone->m_view = clone->m_tags_view = NULL;
+    clone->m_tags = NULL;
+    clone->m_tag_index = NULL;
 
-    for (int i = 0; i < 16; i++) {
-        if (orig->m_params[i]) {
-            clone->m_params[i] = clone->m_bytes + (orig->m_params[i] - orig->m_bytes);
-        }
-    }
+    memcpy(clone->m_bytes, MESSAGE_BYTES(orig), orig->m_len);
 
-    return clone;
+    clone->m_have_inline_tags = (tags != NULL);
+    clone->m_tags_len = tags ? tags_len : 0;
+    if (tags) memcpy(&clone->m_bytes[clone->m_len + 1], tags, tags_len);
 
-cleanup:
-    if (clone && clone->m_tags) free(clone->m_tags);
-    if (clone) free(clone);
-    return NULL;
+    return clone;
 }
 
 void goat_message_delete(GoatMessage *message) {
-    if (message->m_tags) free(message->m_tags);
-    free(message);
+    assert(!MESSAGE_IS_VIEW(message));
+
+    tags_index_free(message);
+    tags_free(message);
+    pool_free(GOAT_POOL_MESSAGES, message, MESSAGE_ALLOC_SIZE(message));
 }
 
 char *goat_message_strdup(const GoatMessage *message) {
     if (NULL == message) return NULL;
 
     size_t len = message->m_len + 1;
+    if (MESSAGE_TAGS(message)) len += 2 + MESSAGE_TAGS_LEN(message); // at, space
+
     char *str = malloc(len);
     if (str == NULL)  return NULL;
 
@@ -224,55 +253,86 @@ char *goat_message_cstring(const GoatMessage *message, char *buf, size_t *len) {
     if (NULL == buf) return NULL;
     if (NULL == len) return NULL;
 
-    size_t min_len = message->m_len;
-    if (message->m_tags) {
-        min_len += 2 + message->m_tags->m_len; // at, space
+    if (*len > message_serialized_len(message)) {
+        char *p = message_serialize(message, buf);
+        *p = '\0';
+        *len = p - buf;
+
+        return buf;
     }
 
-    if (*len > min_len) {
-        char *p = buf;
+    return NULL;
+}
 
-        memset(p, 0, *len);
+// how many bytes message_serialize() will write: the line, and its tags if
+// it has any, but no crlf or nul
+size_t message_serialized_len(const GoatMessage *message) {
+    assert(message != NULL);
 
-        if (message->m_tags) {
-            *p++ = '@';
-            p = stpncpy(p, message->m_tags->m_bytes, message->m_tags->m_len);
-            *p++ = ' ';
-        }
+    size_t len = message->m_len;
+    if (MESSAGE_TAGS(message))  len += 2 + MESSAGE_TAGS_LEN(message); // at, space
 
-        // embedded nulls, so use memcpy rather than str funcs
-        memcpy(p, message->m_bytes, message->m_len);
-        p += message->m_len;
-        *len = p - buf;
+    return len;
+}
 
-        // replace embedded nulls with spaces
-        for (size_t i = 0; i < *len; i++) {
-            if (buf[i] == '\0') buf[i] = ' ';
+// writes the message into buf as it goes on the wire, returning where it
+// finished.  buf must have room for message_serialized_len() bytes.  it's a
+// single pass: the nuls the line was split on become spaces as it's copied
+char *message_serialize(const GoatMessage *message, char *buf) {
+    assert(message != NULL);
+    assert(buf != NULL);
+
+    const char *tags = MESSAGE_TAGS(message);
+    char *p = buf;
+
+    if (tags) {
+        *p++ = '@';
+        memcpy(p, tags, MESSAGE_TAGS_LEN(message));
+        p += MESSAGE_TAGS_LEN(message);
+        *p++ = ' ';
+    }
+
+    const char *src = MESSAGE_BYTES(message);
+    size_t n = message->m_len;
+
+    while (n > 0) {
+        char *end = memccpy(p, src, '\0', n);
+        if (NULL == end) {
+            p += n;
+            break;
         }
 
-        return buf;
+        const size_t copied = end - p;
+        end[-1] = ' ';
+        src += copied;
+        n -= copied;
+        p = end;
     }
 
-    return NULL;
+    return p;
 }
 
 const char *goat_message_get_prefix(const GoatMessage *message) {
     if (NULL == message) return NULL;
 
-    return message->m_prefix;
+    return MESSAGE_PTR(message, message->m_prefix);
 }
 
 const char *goat_message_get_command_string(const GoatMessage *message) {
     if (NULL == message) return NULL;
 
-    return message->m_command_string;
+    if (message->m_have_recognised_command) {
+        return goat_command_string(message->m_command);
+    }
+
+    return MESSAGE_PTR(message, message->m_command_string);
 }
 
 const char *goat_message_get_param(const GoatMessage *message, size_t index) {
     if (NULL == message) return NULL;
     if (index >= 16) return NULL;
 
-    return message->m_params[index];
+    return MESSAGE_PTR(message, message->m_params[index]);
 }
 
 size_t goat_message_get_nparams(const GoatMessage *message) {
@@ -297,3 +357,72 @@ GoatError goat_message_get_command(const GoatMessage *message, GoatCommand *comm
 
     return GOAT_E_UNREC;
 }
+
+// splits the line into tokens in place, the same way strsep(3) would, but
+// finding the spaces (and checking for cr/lf) in a single vectorised pass
+int _message_parse(GoatMessage *message, char *str, size_t len) {
+    LineScan scan;
+    size_t pos = 0;
+    int sp;
+
+    scan_line(str, len, &scan);
+    if (scan.m_invalid) return -1;
+
+    // [ ':' prefix SPACE ]
+    if (str[0] == ':') {
+        pos = 1;
+        sp = _message_end_token(&scan, str, pos, len);
+        if (sp < 0 || str[pos] == '\0')  return -1;
+        message->m_prefix = MESSAGE_OFFSET(message, &str[pos]);
+        pos = sp + 1;
+    }
+
+    // command
+    sp = _message_end_token(&scan, str, pos, len);
+    if (str[pos] == '\0')  return -1;
+    if (0 == goat_command(&str[pos], &message->m_command)) {
+        message->m_have_recognised_command = 1;
+    }
+    else {
+        message->m_command_string = MESSAGE_OFFSET(message, &str[pos]);
+    }
+    message->m_numeric = irc_numeric(&str[pos]) + 1;
+    if (sp < 0)  return 0;
+    pos = sp + 1;
+
+    // *14( SPACE middle ) [ SPACE ":" trailing ]
+    // 14( SPACE middle ) [ SPACE [ ":" ] trailing ]
+    unsigned i = 0;
+    while (i < 14) {
+        if (str[pos] == ':')  break;
+        sp = _message_end_token(&scan, str, pos, len);
+        message->m_params[i] = MESSAGE_OFFSET(message, &str[pos]);
+        ++ i;
+        if (sp < 0)  return 0;
+        pos = sp + 1;
+    }
+    if (str[pos] == ':')  ++pos;
+    message->m_params[i] = MESSAGE_OFFSET(message, &str[pos]);
+
+    return 0;
+}
+
+GoatMessage *_message_alloc(size_t size) {
+    assert(size <= UINT16_MAX);
+
+    GoatMessage *message = pool_alloc(GOAT_POOL_MESSAGES, offsetof(GoatMessage, m_bytes) + size);
+    if (NULL == message) return NULL;
+
+    message->m_size = size;
+    return message;
+}
+
+// terminates the token starting at pos, returning where its space was, or
+// -1 if it runs to the end of the line
+int _message_end_token(const LineScan *scan, char *str, size_t pos, size_t len) {
+    int sp = scan_next_space(scan, pos, len);
+
+    if (sp >= 0) str[sp] = '\0';
+
+    return sp;
+}
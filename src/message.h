@@ -1,23 +1,98 @@
 #ifndef GOAT_MESSAGE_H
 #define GOAT_MESSAGE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// tags that have been modified since parsing, sized to fit from the tags
+// pool's size classes.  m_size is the capacity of m_bytes, including room
+// for the terminating nul
 typedef struct goat_message_tags {
     size_t m_len;
-    char m_bytes[512];
+    size_t m_size;
+    char m_bytes[];
 } MessageTags;
 
+#define MESSAGE_TAGS_ALLOC_SIZE(size) (offsetof(MessageTags, m_bytes) + (size))
+
+#define MESSAGE_TAG_INDEX_MAX   (32)
+#define MESSAGE_TAG_INDEX_SLOTS (64) /* power of two, at least twice max */
+
+// key and value spans of one tag.  value is an offset into the tags, or
+// into the index's m_unescaped if the tag's value needed unescaping
+typedef struct {
+    uint32_t m_hash;
+    uint16_t m_key;
+    uint16_t m_key_len;
+    uint16_t m_value;
+    uint16_t m_value_len;
+    uint8_t  m_has_value;
+    uint8_t  m_unescaped;
+} MessageTagEntry;
+
+// built from a message's tags the first time they're read, so lookups
+// after that are a hash probe.  tags past MESSAGE_TAG_INDEX_MAX aren't
+// indexed, but are still found by scanning on from m_rest
+typedef struct goat_message_tag_index {
+    const char *m_source;       // tags it was built from
+    size_t m_source_len;
+    uint16_t m_count;
+    uint16_t m_n_entries;
+    uint16_t m_rest;            // where indexing stopped, if incomplete
+    uint16_t m_rest_unescaped;
+    uint8_t m_complete;
+    uint8_t m_slots[MESSAGE_TAG_INDEX_SLOTS]; // entry + 1, or 0 if empty
+    MessageTagEntry m_entries[MESSAGE_TAG_INDEX_MAX];
+    size_t m_unescaped_size;    // capacity of m_unescaped
+    char m_unescaped[];         // never longer than the tags themselves
+} MessageTagIndex;
+
+#define MESSAGE_TAG_INDEX_ALLOC_SIZE(size) (offsetof(MessageTagIndex, m_unescaped) + (size))
+
+// messages are a single allocation sized to fit.  m_bytes holds the line
+// (nul-separated once parsed) and then, if it arrived with any, its tags.
+// prefix, command and params are stored as offsets into the line plus one,
+// so 0 means absent and copying a message needs no pointer fixups
 struct goat_message {
-    MessageTags *m_tags;
+    const char *m_view;         // borrowed: line bytes live here instead
+    const char *m_tags_view;    // borrowed: tag bytes live here instead
+    MessageTags *m_tags;        // tags that have been modified since parsing
+    MessageTagIndex *m_tag_index;
     GoatCommand m_command;
-    int m_have_recognised_command;
-    const char *m_prefix;
-    const char *m_command_string;
-    const char *m_params[16];
-    size_t m_len;
-    char m_bytes[512];
+    uint8_t m_have_recognised_command;
+    uint8_t m_have_inline_tags;
+    uint16_t m_size;            // bytes allocated for m_bytes
+    uint16_t m_len;             // length of the line
+    uint16_t m_tags_len;        // length of the inline or borrowed tags
+    uint16_t m_prefix;
+    uint16_t m_command_string;  // only if not recognised
+    uint16_t m_numeric;         // three-digit numeric plus one, if it is one
+    uint16_t m_params[16];
+    char m_bytes[];
 }; /* typedef'd as GoatMessage in goat.h */
 
+// borrowed messages are parsed in place over someone else's buffer rather
+// than copied into m_bytes, and are only valid for as long as that is
+#define MESSAGE_IS_VIEW(m)  ((m)->m_view != NULL)
+#define MESSAGE_BYTES(m)    (MESSAGE_IS_VIEW(m) ? (m)->m_view : (m)->m_bytes)
+#define MESSAGE_PTR(m, off) ((off) ? MESSAGE_BYTES(m) + (off) - 1 : NULL)
+#define MESSAGE_OFFSET(m, p) ((uint16_t) ((p) - MESSAGE_BYTES(m) + 1))
+
+#define MESSAGE_TAGS(m)     ((m)->m_tags ? (m)->m_tags->m_bytes             \
+                                : (m)->m_tags_view ? (m)->m_tags_view       \
+                                : (m)->m_have_inline_tags ? &(m)->m_bytes[(m)->m_len + 1] \
+                                : NULL)
+#define MESSAGE_TAGS_LEN(m) ((m)->m_tags ? (m)->m_tags->m_len : (size_t) (m)->m_tags_len)
+
+#define MESSAGE_ALLOC_SIZE(m) (offsetof(GoatMessage, m_bytes) + (m)->m_size)
+
 #define GOAT_MESSAGE_MAX_LEN  (510)
-#define GOAT_MESSAGE_MAX_TAGS (510)
+#define GOAT_MESSAGE_MAX_TAGS (8189) /* 8191 including '@' and space */
+
+int message_view_init(GoatMessage *view, char *str, size_t len);
+void message_view_fini(GoatMessage *view);
+
+size_t message_serialized_len(const GoatMessage *message);
+char *message_serialize(const GoatMessage *message, char *buf);
 
 #endif
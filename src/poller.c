@@ -0,0 +1,952 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "poller.h"
+#include "util.h"
+
+#define POLLER_READ     (1)
+#define POLLER_WRITE    (2)
+
+// epoll data for the wakeup fd, which no handle can have
+#define POLLER_WAKE_DATA (UINT64_MAX)
+
+static const size_t TICKING_ALLOC_INCR = 16;
+
+#ifdef HAVE_LIBURING
+#define URING_ENTRIES   (1024)
+#define URING_BUFS      (256)   /* must be a power of two */
+#define URING_BUF_SZ    (4096)
+#define URING_BGID      (0)
+
+// user data packs the handle, a generation number and the op into 64 bits.
+// sends carry a pointer to their PollerSend instead of handle and generation
+#define URING_OP_MASK   (0x7)
+#define URING_GEN_MASK  (0x1fffffff)
+
+struct poller_send {
+    LIST_ENTRY(poller_send) entries;
+    int             handle;
+    StrQueueHead    queue;
+    size_t          offset;
+    struct msghdr   msg;
+    struct iovec    iov[];
+};
+
+static inline uint64_t _poller_uring_data(int handle, unsigned gen, PollerOp op) {
+    return ((uint64_t) (uint32_t) handle << 32) | ((uint64_t) (gen & URING_GEN_MASK) << 3) | op;
+}
+
+static int _poller_uring_init(Poller *poller);
+static void _poller_uring_destroy(Poller *poller);
+static struct io_uring_sqe *_poller_uring_get_sqe(Poller *poller);
+static int _poller_uring_arm_wake(Poller *poller);
+static int _poller_uring_send(Poller *poller, Connection *conn, int handle);
+#endif
+
+static int _poller_epoll_update(Poller *poller, Connection *conn, int handle);
+static int _poller_epoll_register(Poller *poller, Connection *conn, int handle, int fd, int events);
+static int _poller_uring_update(Poller *poller, Connection *conn, int handle);
+static int _poller_uring_remove(Poller *poller, Connection *conn, int handle);
+static int _poller_ticking_add(Poller *poller, int handle);
+static int _poller_ticking_remove(Poller *poller, int handle);
+static int _poller_wake_init(Poller *poller);
+static void _poller_wake_destroy(Poller *poller);
+
+int poller_init(Poller *poller, GoatContextMode mode) {
+    assert(poller != NULL);
+
+    memset(poller, 0, sizeof(*poller));
+    poller->m_mode = mode;
+    poller->m_fd = -1;
+    poller->m_wake_fd = poller->m_wake_signal_fd = -1;
+
+    switch (mode) {
+        case GOAT_MODE_SELECT:
+            return _poller_wake_init(poller);
+
+        case GOAT_MODE_EPOLL:
+#ifdef HAVE_SYS_EPOLL_H
+            break;
+#else
+            return ENOTSUP;
+#endif
+
+        case GOAT_MODE_URING:
+#ifdef HAVE_LIBURING
+            break;
+#else
+            return ENOTSUP;
+#endif
+
+        default:
+            return EINVAL;
+    }
+
+    int r = pthread_mutex_init(&poller->m_mutex, NULL);
+    if (r) return r;
+
+    r = _poller_wake_init(poller);
+    if (r) goto cleanup_mutex;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (mode == GOAT_MODE_EPOLL) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = POLLER_WAKE_DATA };
+
+        poller->m_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (poller->m_fd < 0) {
+            r = errno;
+        }
+        else if (0 != epoll_ctl(poller->m_fd, EPOLL_CTL_ADD, poller->m_wake_fd, &ev)) {
+            r = errno;
+            close(poller->m_fd);
+            poller->m_fd = -1;
+        }
+    }
+#endif
+
+#ifdef HAVE_LIBURING
+    if (mode == GOAT_MODE_URING) {
+        r = _poller_uring_init(poller);
+    }
+#endif
+
+    if (0 == r) return 0;
+
+    _poller_wake_destroy(poller);
+cleanup_mutex:
+    pthread_mutex_destroy(&poller->m_mutex);
+    return r;
+}
+
+int poller_destroy(Poller *poller) {
+    assert(poller != NULL);
+
+    if (poller->m_mode == GOAT_MODE_SELECT) {
+        _poller_wake_destroy(poller);
+        return 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (poller->m_mode == GOAT_MODE_URING) {
+        _poller_uring_destroy(poller);
+    }
+#endif
+
+    if (poller->m_fd >= 0) close(poller->m_fd);
+    poller->m_fd = -1;
+
+    _poller_wake_destroy(poller);
+
+    if (poller->m_ticking) free(poller->m_ticking);
+    poller->m_ticking = NULL;
+    poller->m_ticking_count = poller->m_ticking_size = 0;
+
+    if (poller->m_posted) free(poller->m_posted);
+    poller->m_posted = NULL;
+    poller->m_posted_count = poller->m_posted_size = 0;
+
+    return pthread_mutex_destroy(&poller->m_mutex);
+}
+
+// makes a poller_wait() that's blocked in another thread return, so it can
+// pick up work that was queued without any io happening.  in select mode,
+// selecting on m_wake_fd does the same for whoever is doing that
+void poller_wake(Poller *poller) {
+    assert(poller != NULL);
+
+    const uint64_t one = 1;
+
+    // if it's full, the waiter has plenty to wake it already
+    while (write(poller->m_wake_signal_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+// done by whoever was woken, before looking for more work
+void poller_clear_wake(Poller *poller) {
+    assert(poller != NULL);
+
+    char buf[64];
+
+    while (read(poller->m_wake_fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+// for work finished on some other thread, such as a name lookup: the
+// connection is ticked by the next poller_wait(), which is woken to do so.
+// in select mode, waking it is enough, since every connection gets ticked
+int poller_post(Poller *poller, int handle) {
+    assert(poller != NULL);
+
+    int r = 0;
+
+    if (poller->m_mode != GOAT_MODE_SELECT) {
+        r = pthread_mutex_lock(&poller->m_mutex);
+        if (r) return r;
+
+        if (poller->m_posted_count == poller->m_posted_size) {
+            size_t new_size = poller->m_posted_size + TICKING_ALLOC_INCR;
+
+            int *tmp = realloc(poller->m_posted, new_size * sizeof(int));
+            if (NULL == tmp) {
+                r = errno;
+                pthread_mutex_unlock(&poller->m_mutex);
+                return r;
+            }
+
+            poller->m_posted = tmp;
+            poller->m_posted_size = new_size;
+        }
+
+        poller->m_posted[poller->m_posted_count ++] = handle;
+
+        pthread_mutex_unlock(&poller->m_mutex);
+    }
+
+    poller_wake(poller);
+    return r;
+}
+
+// brings the poller's view of the connection up to date with what the
+// connection currently wants.  only touches the kernel if that has changed
+int poller_update(Poller *poller, Connection *conn, int handle) {
+    assert(poller != NULL);
+    assert(conn != NULL);
+
+    if (poller->m_mode == GOAT_MODE_SELECT) return 0;
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    switch (poller->m_mode) {
+        case GOAT_MODE_EPOLL:
+            r = _poller_epoll_update(poller, conn, handle);
+            break;
+
+        case GOAT_MODE_URING:
+            r = _poller_uring_update(poller, conn, handle);
+            break;
+
+        default:
+            r = EINVAL;
+            break;
+    }
+
+    // connections that need to make progress without socket activity (e.g.
+    // while resolving) get ticked every time regardless of readiness
+    int ticking = conn_wants_timeout(conn);
+
+    if (0 == r && ticking != conn->m_poll.ticking) {
+        r = ticking ? _poller_ticking_add(poller, handle)
+                    : _poller_ticking_remove(poller, handle);
+        if (0 == r) conn->m_poll.ticking = ticking;
+    }
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return r;
+}
+
+int poller_remove(Poller *poller, Connection *conn, int handle) {
+    assert(poller != NULL);
+    assert(conn != NULL);
+
+    if (poller->m_mode == GOAT_MODE_SELECT) return 0;
+
+    int r = pthread_mutex_lock(&conn->m_mutex);
+    if (r) return r;
+
+    if (poller->m_mode == GOAT_MODE_URING) {
+        r = _poller_uring_remove(poller, conn, handle);
+    }
+    else if (conn->m_poll.fd >= 0) {
+        r = _poller_epoll_register(poller, conn, handle, -1, 0);
+    }
+
+    if (conn->m_poll.ticking) {
+        _poller_ticking_remove(poller, handle);
+        conn->m_poll.ticking = 0;
+    }
+
+    pthread_mutex_unlock(&conn->m_mutex);
+    return r;
+}
+
+// waits for connections to become ready, and fills in events with their
+// handles.  connections that were posted, or want ticking regardless, are
+// appended after the ready ones.  returns the number of events, or -1 on
+// error
+int poller_wait(Poller *poller, PollerEvent *events, size_t n_events, struct timeval *timeout) {
+    assert(poller != NULL);
+    assert(events != NULL);
+
+    size_t n = 0;
+
+    switch (poller->m_mode) {
+#ifdef HAVE_SYS_EPOLL_H
+        case GOAT_MODE_EPOLL: {
+            struct epoll_event ready[POLLER_MAX_EVENTS];
+            int max = n_events < POLLER_MAX_EVENTS ? n_events : POLLER_MAX_EVENTS;
+            int ms = -1;
+
+            if (timeout) {
+                ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+            }
+
+            int n_ready = epoll_wait(poller->m_fd, ready, max, ms);
+            if (n_ready < 0) return errno == EINTR ? 0 : -1;
+
+            for (int i = 0; i < n_ready; i++) {
+                const uint32_t e = ready[i].events;
+
+                if (ready[i].data.u64 == POLLER_WAKE_DATA) {
+                    poller_clear_wake(poller);
+                    continue;
+                }
+
+                memset(&events[n], 0, sizeof(events[n]));
+                events[n].handle = (int) ready[i].data.u64;
+                events[n].op = POLLER_OP_POLL;
+                events[n].readable = !!(e & (EPOLLIN | EPOLLHUP | EPOLLERR));
+                events[n].writeable = !!(e & (EPOLLOUT | EPOLLHUP | EPOLLERR));
+                ++ n;
+            }
+            break;
+        }
+#endif
+
+#ifdef HAVE_LIBURING
+        case GOAT_MODE_URING: {
+            struct __kernel_timespec ts, *tsp = NULL;
+            struct io_uring_cqe *cqe;
+            unsigned head, seen = 0;
+
+            // everything queued up since the last tick, for every connection,
+            // goes to the kernel in a single submission
+            if (0 == pthread_mutex_lock(&poller->m_mutex)) {
+                io_uring_submit(&poller->m_ring);
+                pthread_mutex_unlock(&poller->m_mutex);
+            }
+
+            if (timeout) {
+                ts.tv_sec = timeout->tv_sec;
+                ts.tv_nsec = timeout->tv_usec * 1000;
+                tsp = &ts;
+            }
+
+            int r = io_uring_wait_cqe_timeout(&poller->m_ring, &cqe, tsp);
+            if (r < 0 && r != -ETIME && r != -EINTR) {
+                errno = -r;
+                return -1;
+            }
+
+            r = pthread_mutex_lock(&poller->m_mutex);
+            if (r) {
+                errno = r;
+                return -1;
+            }
+
+            io_uring_for_each_cqe(&poller->m_ring, head, cqe) {
+                if (n == n_events) break;
+                ++ seen;
+
+                const uint64_t data = io_uring_cqe_get_data64(cqe);
+                PollerEvent *const ev = &events[n];
+
+                memset(ev, 0, sizeof(*ev));
+                ev->op = (PollerOp) (data & URING_OP_MASK);
+                ev->res = cqe->res;
+                ev->flags = cqe->flags;
+
+                switch (ev->op) {
+                    case POLLER_OP_CANCEL:
+                        continue;
+
+                    case POLLER_OP_WAKE:
+                        poller_clear_wake(poller);
+                        if (!(ev->flags & IORING_CQE_F_MORE))  _poller_uring_arm_wake(poller);
+                        continue;
+
+                    case POLLER_OP_SEND:
+                        ev->ptr = (void *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK);
+                        ev->handle = ((PollerSend *) ev->ptr)->handle;
+                        break;
+
+                    case POLLER_OP_POLL:
+                        if (ev->res > 0) {
+                            ev->readable = !!(ev->res & (POLLIN | POLLHUP | POLLERR));
+                            ev->writeable = !!(ev->res & (POLLOUT | POLLHUP | POLLERR));
+                        }
+                        /* fall through */
+                    default:
+                        ev->handle = (int) (data >> 32);
+                        ev->gen = (data >> 3) & URING_GEN_MASK;
+                        break;
+                }
+
+                ++ n;
+            }
+            io_uring_cq_advance(&poller->m_ring, seen);
+
+            pthread_mutex_unlock(&poller->m_mutex);
+            break;
+        }
+#endif
+
+        default:
+            ARG_UNUSED(timeout);
+            errno = ENOTSUP;
+            return -1;
+    }
+
+    if (0 == pthread_mutex_lock(&poller->m_mutex)) {
+        size_t taken = 0;
+
+        while (taken < poller->m_posted_count && n < n_events) {
+            memset(&events[n], 0, sizeof(events[n]));
+            events[n].handle = poller->m_posted[taken ++];
+            events[n].op = POLLER_OP_TICK;
+            ++ n;
+        }
+
+        if (taken > 0) {
+            poller->m_posted_count -= taken;
+            memmove(poller->m_posted, poller->m_posted + taken, poller->m_posted_count * sizeof(int));
+
+            // any that didn't fit mustn't wait for io that may never come
+            if (poller->m_posted_count)  poller_wake(poller);
+        }
+
+        for (size_t i = 0; i < poller->m_ticking_count && n < n_events; i++) {
+            memset(&events[n], 0, sizeof(events[n]));
+            events[n].handle = poller->m_ticking[i];
+            events[n].op = POLLER_OP_TICK;
+            ++ n;
+        }
+
+        pthread_mutex_unlock(&poller->m_mutex);
+    }
+
+    return (int) n;
+}
+
+// finishes off an event returned by poller_wait.  for io the poller did on
+// the connection's behalf, hands the results over to the connection and
+// releases the poller's resources.  conn may be NULL if it has since been
+// deleted.  returns an estimate of the number of events now queued
+int poller_complete(Poller *poller, Connection *conn, PollerEvent *event) {
+    assert(poller != NULL);
+    assert(event != NULL);
+
+    if (poller->m_mode != GOAT_MODE_URING) return 0;
+
+#ifdef HAVE_LIBURING
+    const int more = !!(event->flags & IORING_CQE_F_MORE);
+    int current = 0;
+    int events = 0;
+
+    switch (event->op) {
+        case POLLER_OP_POLL:
+            // a multishot poll stays armed until it's removed or fails
+            if (conn && !more && 0 == pthread_mutex_lock(&poller->m_mutex)) {
+                if (event->gen == (conn->m_poll.gen & URING_GEN_MASK)) {
+                    conn->m_poll.fd = -1;
+                    conn->m_poll.events = 0;
+                }
+                pthread_mutex_unlock(&poller->m_mutex);
+            }
+            break;
+
+        case POLLER_OP_RECV: {
+            const char *buf = NULL;
+            unsigned short bid = 0;
+
+            if (event->flags & IORING_CQE_F_BUFFER) {
+                bid = event->flags >> IORING_CQE_BUFFER_SHIFT;
+                buf = &poller->m_bufs[bid * URING_BUF_SZ];
+            }
+
+            if (conn && 0 == pthread_mutex_lock(&poller->m_mutex)) {
+                if (conn->m_poll.recv && event->gen == (conn->m_poll.recv_gen & URING_GEN_MASK)) {
+                    current = 1;
+                    if (!more) conn->m_poll.recv = 0;
+                }
+                pthread_mutex_unlock(&poller->m_mutex);
+            }
+
+            // running out of buffers just ends the multishot, it'll be
+            // rearmed on the next update
+            if (current && event->res != -ENOBUFS && event->res != -ECANCELED) {
+                events = conn_recv_bytes(conn, buf, event->res);
+            }
+
+            if (buf && 0 == pthread_mutex_lock(&poller->m_mutex)) {
+                io_uring_buf_ring_add(poller->m_buf_ring, (void *) buf, URING_BUF_SZ, bid,
+                    io_uring_buf_ring_mask(URING_BUFS), 0);
+                io_uring_buf_ring_advance(poller->m_buf_ring, 1);
+                pthread_mutex_unlock(&poller->m_mutex);
+            }
+            break;
+        }
+
+        case POLLER_OP_SEND: {
+            PollerSend *pending = event->ptr;
+
+            if (0 == pthread_mutex_lock(&poller->m_mutex)) {
+                LIST_REMOVE(pending, entries);
+                if (conn && conn->m_poll.send == pending) {
+                    conn->m_poll.send = NULL;
+                    current = 1;
+                }
+                pthread_mutex_unlock(&poller->m_mutex);
+            }
+
+            if (current) {
+                conn_finish_write(conn, &pending->queue, pending->offset, event->res > 0 ? (size_t) event->res : 0);
+                if (event->res < 0 && event->res != -ECANCELED) {
+                    events = conn_recv_bytes(conn, NULL, event->res);
+                }
+            }
+            else {
+                StrQueueEntry *node = STAILQ_FIRST(&pending->queue);
+                while (NULL != node) {
+                    StrQueueEntry *next = STAILQ_NEXT(node, entries);
+                    free(node);
+                    node = next;
+                }
+            }
+
+            free(pending);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return events;
+#else
+    ARG_UNUSED(conn);
+    return 0;
+#endif
+}
+
+// called with the connection's mutex held
+int _poller_epoll_update(Poller *poller, Connection *conn, int handle) {
+    int fd = conn->m_network.socket;
+    int events = 0;
+
+    if (fd >= 0) {
+        if (conn_wants_read(conn))  events |= POLLER_READ;
+        if (conn_wants_write(conn)) events |= POLLER_WRITE;
+    }
+
+    if (0 == events) fd = -1;
+
+    if (fd == conn->m_poll.fd && events == conn->m_poll.events) return 0;
+
+    return _poller_epoll_register(poller, conn, handle, fd, events);
+}
+
+// called with the connection's mutex held
+int _poller_epoll_register(Poller *poller, Connection *conn, int handle, int fd, int events) {
+#ifdef HAVE_SYS_EPOLL_H
+    if (conn->m_poll.fd >= 0 && conn->m_poll.fd != fd) {
+        // socket may already have been closed, which removes it implicitly
+        if (0 != epoll_ctl(poller->m_fd, EPOLL_CTL_DEL, conn->m_poll.fd, NULL)
+            && errno != ENOENT && errno != EBADF
+        ) {
+            return errno;
+        }
+        conn->m_poll.fd = -1;
+        conn->m_poll.events = 0;
+    }
+
+    if (fd >= 0) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.data.u64 = (uint64_t) handle;
+        if (events & POLLER_READ)  ev.events |= EPOLLIN;
+        if (events & POLLER_WRITE) ev.events |= EPOLLOUT;
+
+        // the same descriptor number may have been closed and reopened since
+        // we last saw it, so fall back if the kernel disagrees with us
+        int op = (conn->m_poll.fd == fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+        if (0 != epoll_ctl(poller->m_fd, op, fd, &ev)) {
+            if (op == EPOLL_CTL_MOD && errno == ENOENT)  op = EPOLL_CTL_ADD;
+            else if (op == EPOLL_CTL_ADD && errno == EEXIST)  op = EPOLL_CTL_MOD;
+            else return errno;
+
+            if (0 != epoll_ctl(poller->m_fd, op, fd, &ev))  return errno;
+        }
+    }
+
+    conn->m_poll.fd = fd;
+    conn->m_poll.events = events;
+    return 0;
+#else
+    ARG_UNUSED(poller);
+    ARG_UNUSED(conn);
+    ARG_UNUSED(handle);
+    ARG_UNUSED(fd);
+    ARG_UNUSED(events);
+    return ENOTSUP;
+#endif
+}
+
+// called with the connection's mutex held
+int _poller_uring_update(Poller *poller, Connection *conn, int handle) {
+#ifdef HAVE_LIBURING
+    const int fd = conn->m_network.socket;
+
+    // plain connected sockets are read and written by the ring itself,
+    // everything else (including tls) just gets readiness notifications
+    const int direct = fd >= 0 && !conn->m_use_ssl
+                       && conn->m_state.state == GOAT_CONN_CONNECTED;
+
+    int poll_fd = -1, events = 0;
+
+    if (fd >= 0 && !direct) {
+        if (conn_wants_read(conn))  events |= POLLER_READ;
+        if (conn_wants_write(conn)) events |= POLLER_WRITE;
+        if (events) poll_fd = fd;
+    }
+
+    int r = pthread_mutex_lock(&poller->m_mutex);
+    if (r) return r;
+
+    struct io_uring_sqe *sqe;
+
+    if (poll_fd != conn->m_poll.fd || events != conn->m_poll.events) {
+        if (conn->m_poll.fd >= 0) {
+            if (NULL == (sqe = _poller_uring_get_sqe(poller))) goto busy;
+
+            io_uring_prep_poll_remove(sqe, _poller_uring_data(handle, conn->m_poll.gen, POLLER_OP_POLL));
+            io_uring_sqe_set_data64(sqe, POLLER_OP_CANCEL);
+
+            conn->m_poll.fd = -1;
+            conn->m_poll.events = 0;
+        }
+
+        if (poll_fd >= 0) {
+            if (NULL == (sqe = _poller_uring_get_sqe(poller))) goto busy;
+
+            unsigned mask = 0;
+            if (events & POLLER_READ)  mask |= POLLIN;
+            if (events & POLLER_WRITE) mask |= POLLOUT;
+
+            ++ conn->m_poll.gen;
+            io_uring_prep_poll_multishot(sqe, poll_fd, mask);
+            io_uring_sqe_set_data64(sqe, _poller_uring_data(handle, conn->m_poll.gen, POLLER_OP_POLL));
+
+            conn->m_poll.fd = poll_fd;
+            conn->m_poll.events = events;
+        }
+    }
+
+    if (direct && !conn->m_poll.recv) {
+        if (NULL == (sqe = _poller_uring_get_sqe(poller))) goto busy;
+
+        // received bytes land in whichever provided buffer is free next
+        ++ conn->m_poll.recv_gen;
+        io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        io_uring_sqe_set_data64(sqe, _poller_uring_data(handle, conn->m_poll.recv_gen, POLLER_OP_RECV));
+        conn->m_poll.recv = 1;
+    }
+    else if (!direct && conn->m_poll.recv) {
+        if (NULL == (sqe = _poller_uring_get_sqe(poller))) goto busy;
+
+        io_uring_prep_cancel64(sqe, _poller_uring_data(handle, conn->m_poll.recv_gen, POLLER_OP_RECV), 0);
+        io_uring_sqe_set_data64(sqe, POLLER_OP_CANCEL);
+        conn->m_poll.recv = 0;
+    }
+
+    if (direct && NULL == conn->m_poll.send && !STAILQ_EMPTY(&conn->m_write_queue)) {
+        r = _poller_uring_send(poller, conn, handle);
+    }
+
+    pthread_mutex_unlock(&poller->m_mutex);
+    return r;
+
+busy:
+    pthread_mutex_unlock(&poller->m_mutex);
+    return EBUSY;
+#else
+    ARG_UNUSED(poller);
+    ARG_UNUSED(conn);
+    ARG_UNUSED(handle);
+    return ENOTSUP;
+#endif
+}
+
+// called with the connection's mutex held
+int _poller_uring_remove(Poller *poller, Connection *conn, int handle) {
+#ifdef HAVE_LIBURING
+    int r = pthread_mutex_lock(&poller->m_mutex);
+    if (r) return r;
+
+    struct io_uring_sqe *sqe;
+
+    if (conn->m_poll.fd >= 0 && NULL != (sqe = _poller_uring_get_sqe(poller))) {
+        io_uring_prep_poll_remove(sqe, _poller_uring_data(handle, conn->m_poll.gen, POLLER_OP_POLL));
+        io_uring_sqe_set_data64(sqe, POLLER_OP_CANCEL);
+    }
+
+    if (conn->m_poll.recv && NULL != (sqe = _poller_uring_get_sqe(poller))) {
+        io_uring_prep_cancel64(sqe, _poller_uring_data(handle, conn->m_poll.recv_gen, POLLER_OP_RECV), 0);
+        io_uring_sqe_set_data64(sqe, POLLER_OP_CANCEL);
+    }
+
+    // an in-flight send still owns its buffers, so it stays on the poller's
+    // list and gets cleaned up when its completion arrives
+    if (conn->m_poll.send && NULL != (sqe = _poller_uring_get_sqe(poller))) {
+        io_uring_prep_cancel64(sqe, (uint64_t) (uintptr_t) conn->m_poll.send | POLLER_OP_SEND, 0);
+        io_uring_sqe_set_data64(sqe, POLLER_OP_CANCEL);
+    }
+
+    conn->m_poll.fd = -1;
+    conn->m_poll.events = 0;
+    conn->m_poll.recv = 0;
+    conn->m_poll.send = NULL;
+
+    io_uring_submit(&poller->m_ring);
+
+    pthread_mutex_unlock(&poller->m_mutex);
+    return 0;
+#else
+    ARG_UNUSED(poller);
+    ARG_UNUSED(conn);
+    ARG_UNUSED(handle);
+    return ENOTSUP;
+#endif
+}
+
+#ifdef HAVE_LIBURING
+int _poller_uring_init(Poller *poller) {
+    struct io_uring_params params;
+    int r;
+
+    memset(&params, 0, sizeof(params));
+    r = io_uring_queue_init_params(URING_ENTRIES, &poller->m_ring, &params);
+    if (r < 0) return -r;
+
+    // we wait for completions while other threads may be queueing up
+    // submissions, which is only safe if waiting leaves the sq alone
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        r = ENOTSUP;
+        goto cleanup;
+    }
+
+    poller->m_bufs = malloc(URING_BUFS * URING_BUF_SZ);
+    if (NULL == poller->m_bufs) {
+        r = errno;
+        goto cleanup;
+    }
+
+    poller->m_buf_ring = io_uring_setup_buf_ring(&poller->m_ring, URING_BUFS, URING_BGID, 0, &r);
+    if (NULL == poller->m_buf_ring) {
+        r = -r;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < URING_BUFS; i++) {
+        io_uring_buf_ring_add(poller->m_buf_ring, &poller->m_bufs[i * URING_BUF_SZ],
+            URING_BUF_SZ, i, io_uring_buf_ring_mask(URING_BUFS), i);
+    }
+    io_uring_buf_ring_advance(poller->m_buf_ring, URING_BUFS);
+
+    LIST_INIT(&poller->m_sends);
+
+    r = _poller_uring_arm_wake(poller);
+    if (r) goto cleanup_buf_ring;
+    io_uring_submit(&poller->m_ring);
+
+    // readable when completions are waiting, so it can go in a select set
+    poller->m_fd = poller->m_ring.ring_fd;
+
+    return 0;
+
+cleanup_buf_ring:
+    io_uring_free_buf_ring(&poller->m_ring, poller->m_buf_ring, URING_BUFS, URING_BGID);
+
+cleanup:
+    if (poller->m_bufs) free(poller->m_bufs);
+    poller->m_bufs = NULL;
+    io_uring_queue_exit(&poller->m_ring);
+    return r;
+}
+
+void _poller_uring_destroy(Poller *poller) {
+    io_uring_free_buf_ring(&poller->m_ring, poller->m_buf_ring, URING_BUFS, URING_BGID);
+    io_uring_queue_exit(&poller->m_ring);
+    poller->m_fd = -1;  // closed by io_uring_queue_exit
+
+    free(poller->m_bufs);
+    poller->m_bufs = NULL;
+
+    while (!LIST_EMPTY(&poller->m_sends)) {
+        PollerSend *pending = LIST_FIRST(&poller->m_sends);
+        LIST_REMOVE(pending, entries);
+
+        StrQueueEntry *node = STAILQ_FIRST(&pending->queue);
+        while (NULL != node) {
+            StrQueueEntry *next = STAILQ_NEXT(node, entries);
+            free(node);
+            node = next;
+        }
+
+        free(pending);
+    }
+}
+
+// called with the poller's mutex held
+struct io_uring_sqe *_poller_uring_get_sqe(Poller *poller) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&poller->m_ring);
+
+    if (NULL == sqe) {
+        // submission queue is full, flush it and try again
+        io_uring_submit(&poller->m_ring);
+        sqe = io_uring_get_sqe(&poller->m_ring);
+    }
+
+    return sqe;
+}
+
+// one poll for the life of the ring, unless the kernel ends it early.
+// called with the poller's mutex held, or before anyone else can see it
+int _poller_uring_arm_wake(Poller *poller) {
+    struct io_uring_sqe *sqe = _poller_uring_get_sqe(poller);
+    if (NULL == sqe) return EBUSY;
+
+    io_uring_prep_poll_multishot(sqe, poller->m_wake_fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, POLLER_OP_WAKE);
+
+    return 0;
+}
+
+// called with both the connection's and the poller's mutexes held.
+// hands the connection's whole write queue to the kernel as one sendmsg
+int _poller_uring_send(Poller *poller, Connection *conn, int handle) {
+    size_t count = 0;
+    StrQueueEntry *node;
+
+    STAILQ_FOREACH(node, &conn->m_write_queue, entries) {
+        if (++ count == IOV_MAX) break;
+    }
+
+    PollerSend *pending = malloc(sizeof(PollerSend) + count * sizeof(struct iovec));
+    if (NULL == pending) return errno;
+
+    struct io_uring_sqe *sqe = _poller_uring_get_sqe(poller);
+    if (NULL == sqe) {
+        free(pending);
+        return EBUSY;
+    }
+
+    pending->handle = handle;
+    count = conn_detach_write_queue(conn, &pending->queue, &pending->offset, count);
+    count = conn_write_iov(&pending->queue, pending->offset, pending->iov, count);
+
+    memset(&pending->msg, 0, sizeof(pending->msg));
+    pending->msg.msg_iov = pending->iov;
+    pending->msg.msg_iovlen = count;
+
+    io_uring_prep_sendmsg(sqe, conn->m_network.socket, &pending->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, (uint64_t) (uintptr_t) pending | POLLER_OP_SEND);
+
+    LIST_INSERT_HEAD(&poller->m_sends, pending, entries);
+    conn->m_poll.send = pending;
+
+    return 0;
+}
+#endif
+
+int _poller_ticking_add(Poller *poller, int handle) {
+    int r = pthread_mutex_lock(&poller->m_mutex);
+    if (r) return r;
+
+    if (poller->m_ticking_count == poller->m_ticking_size) {
+        size_t new_size = poller->m_ticking_size + TICKING_ALLOC_INCR;
+
+        int *tmp = realloc(poller->m_ticking, new_size * sizeof(int));
+        if (NULL == tmp) {
+            r = errno;
+            goto done;
+        }
+
+        poller->m_ticking = tmp;
+        poller->m_ticking_size = new_size;
+    }
+
+    poller->m_ticking[poller->m_ticking_count ++] = handle;
+
+done:
+    pthread_mutex_unlock(&poller->m_mutex);
+    return r;
+}
+
+int _poller_ticking_remove(Poller *poller, int handle) {
+    int r = pthread_mutex_lock(&poller->m_mutex);
+    if (r) return r;
+
+    for (size_t i = 0; i < poller->m_ticking_count; i++) {
+        if (poller->m_ticking[i] == handle) {
+            poller->m_ticking[i] = poller->m_ticking[-- poller->m_ticking_count];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&poller->m_mutex);
+    return 0;
+}
+
+int _poller_wake_init(Poller *poller) {
+#ifdef HAVE_SYS_EVENTFD_H
+    poller->m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (poller->m_wake_fd < 0) return errno;
+
+    poller->m_wake_signal_fd = poller->m_wake_fd;
+#else
+    int fds[2];
+
+    if (0 != pipe(fds)) return errno;
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    poller->m_wake_fd = fds[0];
+    poller->m_wake_signal_fd = fds[1];
+#endif
+
+    return 0;
+}
+
+void _poller_wake_destroy(Poller *poller) {
+    if (poller->m_wake_signal_fd >= 0 && poller->m_wake_signal_fd != poller->m_wake_fd) {
+        close(poller->m_wake_signal_fd);
+    }
+    if (poller->m_wake_fd >= 0) close(poller->m_wake_fd);
+
+    poller->m_wake_fd = poller->m_wake_signal_fd = -1;
+}
@@ -0,0 +1,74 @@
+#ifndef GOAT_POLLER_H
+#define GOAT_POLLER_H
+
+#include <config.h>
+
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "goat.h"
+#include "connection.h"
+
+#define POLLER_MAX_EVENTS (256)
+
+typedef enum {
+    POLLER_OP_POLL = 0,     // socket readiness
+    POLLER_OP_RECV,         // bytes received on the connection's behalf
+    POLLER_OP_SEND,         // queued lines written on the connection's behalf
+    POLLER_OP_CANCEL,
+    POLLER_OP_TICK,         // no io, connection just wants ticking
+    POLLER_OP_WAKE,         // poller_wake() was called; never returned
+} PollerOp;
+
+typedef struct {
+    int         handle;
+    int         readable;
+    int         writeable;
+    PollerOp    op;
+    unsigned    gen;
+    int         res;
+    unsigned    flags;
+    void        *ptr;
+} PollerEvent;
+
+typedef struct poller_send PollerSend;
+
+typedef struct {
+    GoatContextMode     m_mode;
+    int                 m_fd;
+    int                 m_wake_fd;          // readable after poller_wake()
+    int                 m_wake_signal_fd;   // written by it; same fd if eventfd
+    pthread_mutex_t     m_mutex;
+    int                 *m_ticking;
+    size_t              m_ticking_count;
+    size_t              m_ticking_size;
+    int                 *m_posted;          // to tick on the next wait, once each
+    size_t              m_posted_count;
+    size_t              m_posted_size;
+#ifdef HAVE_LIBURING
+    struct io_uring     m_ring;
+    struct io_uring_buf_ring *m_buf_ring;
+    char                *m_bufs;
+    LIST_HEAD(, poller_send) m_sends;
+#endif
+} Poller;
+
+int poller_init(Poller *poller, GoatContextMode mode);
+int poller_destroy(Poller *poller);
+
+void poller_wake(Poller *poller);
+void poller_clear_wake(Poller *poller);
+int poller_post(Poller *poller, int handle);
+
+int poller_update(Poller *poller, Connection *conn, int handle);
+int poller_remove(Poller *poller, Connection *conn, int handle);
+
+int poller_wait(Poller *poller, PollerEvent *events, size_t n_events, struct timeval *timeout);
+int poller_complete(Poller *poller, Connection *conn, PollerEvent *event);
+
+#endif
@@ -0,0 +1,334 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "goat.h"
+
+#include "message.h"
+#include "pool.h"
+
+// objects stay individually malloc'd, the pool just keeps freed ones on a
+// list for reuse instead of handing them back to the system.  each thread
+// keeps a small list of its own so the common case doesn't take a lock, and
+// trades batches with the shared list when it runs dry or fills up.
+//
+// messages and tags are sized to fit, so their pools are split into a few
+// size classes, each with its own lists.  anything bigger than the largest
+// class just goes straight to calloc/free.
+#define POOL_CACHE_MAX      (32)
+#define POOL_DEFAULT_CAP    (1024)
+
+// counters are only written by their owning thread, but read by any
+#define POOL_STAT_SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define POOL_STAT_GET(field)        __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+typedef struct pool_free_obj {
+    struct pool_free_obj *next;
+} PoolFreeObj;
+
+typedef struct pool Pool;
+
+typedef struct pool_cache {
+    LIST_ENTRY(pool_cache) entries;
+    Pool            *m_pool;
+    PoolFreeObj     *m_free;
+    size_t          m_count;
+    size_t          m_allocs;
+    size_t          m_reuses;
+    size_t          m_frees;
+} PoolCache;
+
+struct pool {
+    GoatPool        m_which;
+    pthread_mutex_t m_mutex;
+    pthread_key_t   m_key;
+    size_t          m_size;
+    size_t          m_cap;
+    PoolFreeObj     *m_free;
+    size_t          m_count;
+    LIST_HEAD(, pool_cache) m_caches;
+    // totals from threads that have since exited
+    size_t          m_allocs;
+    size_t          m_reuses;
+    size_t          m_frees;
+};
+
+#define POOL_CLASS(which, size) {              \
+    .m_which = (which),                         \
+    .m_mutex = PTHREAD_MUTEX_INITIALIZER,       \
+    .m_size = (size),                           \
+    .m_cap = POOL_DEFAULT_CAP,                  \
+}
+
+// ordered by pool, then by size
+static Pool _pools[] = {
+    POOL_CLASS(GOAT_POOL_MESSAGES, 128),
+    POOL_CLASS(GOAT_POOL_MESSAGES, 256),
+    POOL_CLASS(GOAT_POOL_MESSAGES, 512),
+    POOL_CLASS(GOAT_POOL_MESSAGES, 1024),
+    POOL_CLASS(GOAT_POOL_MESSAGES, 2048),
+    POOL_CLASS(GOAT_POOL_TAGS, 64),
+    POOL_CLASS(GOAT_POOL_TAGS, 128),
+    POOL_CLASS(GOAT_POOL_TAGS, 256),
+    POOL_CLASS(GOAT_POOL_TAGS, 512),
+    POOL_CLASS(GOAT_POOL_TAGS, 1024),
+    POOL_CLASS(GOAT_POOL_TAGS, 2048),
+    POOL_CLASS(GOAT_POOL_TAGS, 4096),
+    POOL_CLASS(GOAT_POOL_TAGS, MESSAGE_TAG_INDEX_ALLOC_SIZE(GOAT_MESSAGE_MAX_TAGS + 1)),
+};
+static const size_t _n_pools = sizeof(_pools) / sizeof(_pools[0]);
+
+static pthread_once_t _pools_once = PTHREAD_ONCE_INIT;
+static int _pools_ok = 0;
+
+static Pool *_pool_find(GoatPool which, size_t size);
+static void _pool_init_keys(void);
+static PoolCache *_pool_get_cache(Pool *pool);
+static void _pool_cache_destroy(void *arg);
+static void _pool_refill(Pool *pool, PoolCache *cache);
+static void _pool_drain(Pool *pool, PoolCache *cache, size_t keep);
+
+// like calloc, but reuses a pooled object if there is one.  the object may
+// be bigger than asked for, but only size bytes of it are zeroed
+void *pool_alloc(GoatPool which, size_t size) {
+    assert(which >= 0 && which < GOAT_POOL_LAST);
+
+    Pool *pool = _pool_find(which, size);
+    if (NULL == pool) return calloc(1, size);
+
+    PoolCache *cache = _pool_get_cache(pool);
+    PoolFreeObj *obj = NULL;
+
+    if (NULL == cache) return calloc(1, pool->m_size);
+
+    if (NULL == cache->m_free) _pool_refill(pool, cache);
+
+    if (NULL != (obj = cache->m_free)) {
+        cache->m_free = obj->next;
+        POOL_STAT_SET(cache->m_count, cache->m_count - 1);
+        POOL_STAT_SET(cache->m_reuses, cache->m_reuses + 1);
+        memset(obj, 0, size);
+    }
+    else {
+        obj = calloc(1, pool->m_size);
+    }
+
+    if (obj) POOL_STAT_SET(cache->m_allocs, cache->m_allocs + 1);
+
+    return obj;
+}
+
+// the size pool_alloc() really allocates when asked for size, so callers
+// can make use of the slack
+size_t pool_size(GoatPool which, size_t size) {
+    assert(which >= 0 && which < GOAT_POOL_LAST);
+
+    Pool *pool = _pool_find(which, size);
+
+    return pool ? pool->m_size : size;
+}
+
+// obj must have come from pool_alloc() with the same size, or from malloc
+// with the size of the pool's largest class
+void pool_free(GoatPool which, void *obj, size_t size) {
+    assert(which >= 0 && which < GOAT_POOL_LAST);
+
+    if (NULL == obj) return;
+
+    Pool *pool = _pool_find(which, size);
+    PoolCache *cache = pool ? _pool_get_cache(pool) : NULL;
+
+    if (NULL == cache || 0 == POOL_STAT_GET(pool->m_cap)) {
+        free(obj);
+        return;
+    }
+
+    PoolFreeObj *p = obj;
+    p->next = cache->m_free;
+    cache->m_free = p;
+    POOL_STAT_SET(cache->m_count, cache->m_count + 1);
+    POOL_STAT_SET(cache->m_frees, cache->m_frees + 1);
+
+    if (cache->m_count > POOL_CACHE_MAX) _pool_drain(pool, cache, POOL_CACHE_MAX / 2);
+}
+
+GoatError goat_pool_set_cap(GoatPool which, size_t cap) {
+    assert(which >= 0 && which < GOAT_POOL_LAST);
+
+    if (which < 0 || which >= GOAT_POOL_LAST) return EINVAL;
+
+    for (size_t i = 0; i < _n_pools; i++) {
+        Pool *pool = &_pools[i];
+        if (pool->m_which != which) continue;
+
+        int r = pthread_mutex_lock(&pool->m_mutex);
+        if (r) return r;
+
+        POOL_STAT_SET(pool->m_cap, cap);
+
+        // let go of anything over the new cap
+        while (pool->m_count > cap) {
+            PoolFreeObj *obj = pool->m_free;
+            pool->m_free = obj->next;
+            POOL_STAT_SET(pool->m_count, pool->m_count - 1);
+            free(obj);
+        }
+
+        pthread_mutex_unlock(&pool->m_mutex);
+    }
+
+    return 0;
+}
+
+GoatError goat_pool_get_stats(GoatPool which, GoatPoolStats *stats) {
+    assert(which >= 0 && which < GOAT_POOL_LAST);
+    assert(stats != NULL);
+
+    if (which < 0 || which >= GOAT_POOL_LAST) return EINVAL;
+    if (NULL == stats) return EINVAL;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i < _n_pools; i++) {
+        Pool *pool = &_pools[i];
+        PoolCache *cache;
+
+        if (pool->m_which != which) continue;
+
+        int r = pthread_mutex_lock(&pool->m_mutex);
+        if (r) return r;
+
+        stats->allocs += pool->m_allocs;
+        stats->reuses += pool->m_reuses;
+        stats->frees += pool->m_frees;
+        stats->cached += pool->m_count;
+        stats->cap = pool->m_cap;
+
+        LIST_FOREACH(cache, &pool->m_caches, entries) {
+            stats->allocs += POOL_STAT_GET(cache->m_allocs);
+            stats->reuses += POOL_STAT_GET(cache->m_reuses);
+            stats->frees += POOL_STAT_GET(cache->m_frees);
+            stats->cached += POOL_STAT_GET(cache->m_count);
+        }
+
+        pthread_mutex_unlock(&pool->m_mutex);
+    }
+
+    return 0;
+}
+
+// smallest class of the pool that fits size, or NULL if none does
+Pool *_pool_find(GoatPool which, size_t size) {
+    for (size_t i = 0; i < _n_pools; i++) {
+        if (_pools[i].m_which == which && _pools[i].m_size >= size) return &_pools[i];
+    }
+
+    return NULL;
+}
+
+void _pool_init_keys(void) {
+    for (size_t i = 0; i < _n_pools; i++) {
+        if (pthread_key_create(&_pools[i].m_key, &_pool_cache_destroy)) return;
+    }
+
+    _pools_ok = 1;
+}
+
+// returns the calling thread's cache for the pool, creating it if needed.
+// NULL means pooling isn't available, and callers fall back to malloc/free
+PoolCache *_pool_get_cache(Pool *pool) {
+    if (pthread_once(&_pools_once, &_pool_init_keys) || !_pools_ok) return NULL;
+
+    PoolCache *cache = pthread_getspecific(pool->m_key);
+    if (cache) return cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (NULL == cache) return NULL;
+
+    cache->m_pool = pool;
+
+    if (pthread_setspecific(pool->m_key, cache)) goto err;
+    if (pthread_mutex_lock(&pool->m_mutex)) goto err;
+
+    LIST_INSERT_HEAD(&pool->m_caches, cache, entries);
+
+    pthread_mutex_unlock(&pool->m_mutex);
+    return cache;
+
+err:
+    pthread_setspecific(pool->m_key, NULL);
+    free(cache);
+    return NULL;
+}
+
+// thread exit: give back everything the thread had cached
+void _pool_cache_destroy(void *arg) {
+    PoolCache *cache = arg;
+    Pool *pool = cache->m_pool;
+
+    _pool_drain(pool, cache, 0);
+
+    if (0 == pthread_mutex_lock(&pool->m_mutex)) {
+        pool->m_allocs += cache->m_allocs;
+        pool->m_reuses += cache->m_reuses;
+        pool->m_frees += cache->m_frees;
+        LIST_REMOVE(cache, entries);
+        pthread_mutex_unlock(&pool->m_mutex);
+
+        free(cache);
+    }
+}
+
+// takes up to half a cache's worth from the shared list
+void _pool_refill(Pool *pool, PoolCache *cache) {
+    if (0 == POOL_STAT_GET(pool->m_count)) return;
+    if (pthread_mutex_lock(&pool->m_mutex)) return;
+
+    while (pool->m_free && cache->m_count < POOL_CACHE_MAX / 2) {
+        PoolFreeObj *obj = pool->m_free;
+        pool->m_free = obj->next;
+        POOL_STAT_SET(pool->m_count, pool->m_count - 1);
+
+        obj->next = cache->m_free;
+        cache->m_free = obj;
+        POOL_STAT_SET(cache->m_count, cache->m_count + 1);
+    }
+
+    pthread_mutex_unlock(&pool->m_mutex);
+}
+
+// hands all but keep objects back to the shared list, freeing any over cap
+void _pool_drain(Pool *pool, PoolCache *cache, size_t keep) {
+    PoolFreeObj *spill = NULL;
+
+    if (pthread_mutex_lock(&pool->m_mutex)) return;
+
+    while (cache->m_count > keep) {
+        PoolFreeObj *obj = cache->m_free;
+        cache->m_free = obj->next;
+        POOL_STAT_SET(cache->m_count, cache->m_count - 1);
+
+        if (pool->m_count < pool->m_cap) {
+            obj->next = pool->m_free;
+            pool->m_free = obj;
+            POOL_STAT_SET(pool->m_count, pool->m_count + 1);
+        }
+        else {
+            obj->next = spill;
+            spill = obj;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->m_mutex);
+
+    while (spill) {
+        PoolFreeObj *next = spill->next;
+        free(spill);
+        spill = next;
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef GOAT_POOL_H
+#define GOAT_POOL_H
+
+#include <config.h>
+
+#include "goat.h"
+
+#include <stddef.h>
+
+void *pool_alloc(GoatPool which, size_t size);
+void pool_free(GoatPool which, void *obj, size_t size);
+size_t pool_size(GoatPool which, size_t size);
+
+#endif
@@ -0,0 +1,196 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+
+static const size_t RINGBUF_MIN_SIZE = 1024;
+
+static int _ringbuf_make_space(RingBuf *rb, size_t len);
+static void _ringbuf_scan(RingBuf *rb, size_t from);
+
+int ringbuf_init(RingBuf *rb, size_t size) {
+    assert(rb != NULL);
+
+    memset(rb, 0, sizeof(*rb));
+
+    if (size < RINGBUF_MIN_SIZE) size = RINGBUF_MIN_SIZE;
+
+    rb->m_buf = malloc(size);
+    if (NULL == rb->m_buf) return errno;
+
+    rb->m_size = size;
+    return 0;
+}
+
+void ringbuf_destroy(RingBuf *rb) {
+    assert(rb != NULL);
+
+    free(rb->m_buf);
+    free(rb->m_retired);
+    memset(rb, 0, sizeof(*rb));
+}
+
+// returns space for at least len bytes at the tail, or NULL if it couldn't
+// be made.  call ringbuf_commit() with however much was actually written
+char *ringbuf_reserve(RingBuf *rb, size_t len) {
+    assert(rb != NULL);
+
+    if (_ringbuf_make_space(rb, len)) return NULL;
+
+    return &rb->m_buf[rb->m_tail];
+}
+
+void ringbuf_commit(RingBuf *rb, size_t len) {
+    assert(rb != NULL);
+    assert(rb->m_tail + len <= rb->m_size);
+
+    size_t from = rb->m_tail;
+
+    rb->m_tail += len;
+    _ringbuf_scan(rb, from);
+}
+
+int ringbuf_write(RingBuf *rb, const char *buf, size_t len) {
+    assert(rb != NULL);
+    assert(buf != NULL);
+
+    char *p = ringbuf_reserve(rb, len);
+    if (NULL == p) return ENOMEM;
+
+    memcpy(p, buf, len);
+    ringbuf_commit(rb, len);
+
+    return 0;
+}
+
+// inserts a complete line after the last complete line, ahead of any
+// partial line that's still waiting for the rest of its bytes
+int ringbuf_insert_line(RingBuf *rb, const char *buf, size_t len) {
+    assert(rb != NULL);
+    assert(buf != NULL);
+    assert(len > 0 && buf[len - 1] == '\x0a');
+
+    if (_ringbuf_make_space(rb, len)) return ENOMEM;
+
+    char *const at = &rb->m_buf[rb->m_lines];
+
+    memmove(at + len, at, rb->m_tail - rb->m_lines);
+    memcpy(at, buf, len);
+
+    rb->m_lines += len;
+    rb->m_tail += len;
+
+    return 0;
+}
+
+// returns 0 and the span of the oldest complete line (including its eol),
+// or ENOENT if there isn't one yet
+int ringbuf_next_line(const RingBuf *rb, size_t *offset, size_t *len) {
+    assert(rb != NULL);
+    assert(offset != NULL);
+    assert(len != NULL);
+
+    if (!ringbuf_has_line(rb)) return ENOENT;
+
+    const char *eol = memchr(&rb->m_buf[rb->m_head], '\x0a', rb->m_lines - rb->m_head);
+    assert(eol != NULL);
+
+    *offset = rb->m_head;
+    *len = eol - &rb->m_buf[rb->m_head] + 1;
+
+    return 0;
+}
+
+void ringbuf_consume(RingBuf *rb, size_t len) {
+    assert(rb != NULL);
+    assert(rb->m_head + len <= rb->m_lines);
+
+    rb->m_head += len;
+
+    if (rb->m_head == rb->m_tail) ringbuf_clear(rb);
+}
+
+// like ringbuf_next_line, but the line's bytes stay put (and writable) until
+// it's released, even if the buffer has to grow in the meantime.  only one
+// line can be borrowed at a time
+int ringbuf_borrow_line(RingBuf *rb, char **line, size_t *len) {
+    assert(rb != NULL);
+    assert(line != NULL);
+
+    if (rb->m_pinned) return EBUSY;
+
+    size_t offset;
+    int r = ringbuf_next_line(rb, &offset, len);
+    if (r) return r;
+
+    rb->m_pinned = rb->m_buf;
+    *line = &rb->m_buf[offset];
+
+    return 0;
+}
+
+// consumes the borrowed line and lets go of any buffer kept alive for it
+void ringbuf_release_line(RingBuf *rb, size_t len) {
+    assert(rb != NULL);
+    assert(rb->m_pinned != NULL);
+
+    free(rb->m_retired);
+    rb->m_retired = NULL;
+    rb->m_pinned = NULL;
+
+    ringbuf_consume(rb, len);
+}
+
+void ringbuf_clear(RingBuf *rb) {
+    assert(rb != NULL);
+
+    rb->m_head = rb->m_lines = rb->m_tail = 0;
+}
+
+int _ringbuf_make_space(RingBuf *rb, size_t len) {
+    if (rb->m_size - rb->m_tail >= len) return 0;
+
+    size_t used = rb->m_tail - rb->m_head;
+    const int pinned = (rb->m_pinned == rb->m_buf);
+
+    if (!pinned && rb->m_size - used >= len && used <= rb->m_size / 2) {
+        // enough room once the consumed bytes are reclaimed
+        memmove(rb->m_buf, &rb->m_buf[rb->m_head], used);
+    }
+    else {
+        size_t size = rb->m_size;
+        while (size - used < len) size *= 2;
+
+        char *tmp = malloc(size);
+        if (NULL == tmp) return ENOMEM;
+
+        memcpy(tmp, &rb->m_buf[rb->m_head], used);
+
+        // a borrowed line still points into the old buffer
+        if (pinned)  rb->m_retired = rb->m_buf;
+        else  free(rb->m_buf);
+
+        rb->m_buf = tmp;
+        rb->m_size = size;
+    }
+
+    rb->m_lines -= rb->m_head;
+    rb->m_tail -= rb->m_head;
+    rb->m_head = 0;
+
+    return 0;
+}
+
+// finds the end of the last complete line among the bytes from 'from' on
+void _ringbuf_scan(RingBuf *rb, size_t from) {
+    const char *p = &rb->m_buf[from];
+    const char *const end = &rb->m_buf[rb->m_tail];
+
+    while (p < end && NULL != (p = memchr(p, '\x0a', end - p))) {
+        rb->m_lines = ++ p - rb->m_buf;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef GOAT_RINGBUF_H
+#define GOAT_RINGBUF_H
+
+#include <config.h>
+
+#include <stddef.h>
+
+// growable byte buffer for line-oriented input.  unread bytes are always
+// contiguous (when the tail runs off the end they're slid back to the start,
+// which is cheap since normally only a partial line is left), so lines can be
+// found with memchr and handed out as (offset, length) spans into m_buf
+typedef struct {
+    char    *m_buf;
+    size_t  m_size;
+    size_t  m_head;     // first unconsumed byte
+    size_t  m_lines;    // end of the last complete line
+    size_t  m_tail;     // end of data
+    char    *m_pinned;  // buffer a borrowed line lives in
+    char    *m_retired; // kept alive for the borrowed line after growing
+} RingBuf;
+
+int ringbuf_init(RingBuf *rb, size_t size);
+void ringbuf_destroy(RingBuf *rb);
+
+char *ringbuf_reserve(RingBuf *rb, size_t len);
+void ringbuf_commit(RingBuf *rb, size_t len);
+
+int ringbuf_write(RingBuf *rb, const char *buf, size_t len);
+int ringbuf_insert_line(RingBuf *rb, const char *buf, size_t len);
+
+int ringbuf_next_line(const RingBuf *rb, size_t *offset, size_t *len);
+void ringbuf_consume(RingBuf *rb, size_t len);
+void ringbuf_clear(RingBuf *rb);
+
+int ringbuf_borrow_line(RingBuf *rb, char **line, size_t *len);
+void ringbuf_release_line(RingBuf *rb, size_t len);
+
+static inline int ringbuf_has_line(const RingBuf *rb) {
+    return rb->m_lines > rb->m_head;
+}
+
+// bytes after the last complete line, still waiting for their eol
+static inline size_t ringbuf_partial_len(const RingBuf *rb) {
+    return rb->m_tail - rb->m_lines;
+}
+
+#endif
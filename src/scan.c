@@ -0,0 +1,181 @@
+#include <config.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// each implementation classifies a 64-byte block at a time, producing one
+// bitmap word.  the last partial block is copied into padding that is
+// neither a space nor invalid, so the kernels never read past the line
+#define SCAN_BLOCK      (64)
+#define SCAN_PADDING    ('x')
+
+typedef void (*ScanFn)(const char *, size_t, LineScan *);
+
+static void _scan_line_scalar(const char *str, size_t len, LineScan *scan);
+#ifdef SCAN_HAVE_X86
+static void _scan_line_sse2(const char *str, size_t len, LineScan *scan);
+static void _scan_line_avx2(const char *str, size_t len, LineScan *scan);
+#endif
+static void _scan_line_resolve(const char *str, size_t len, LineScan *scan);
+
+static ScanFn _scan_fn = &_scan_line_resolve;
+
+static const ScanFn _scan_impls[SCAN_IMPL_LAST] = {
+    [SCAN_IMPL_SCALAR]  = &_scan_line_scalar,
+#ifdef SCAN_HAVE_X86
+    [SCAN_IMPL_SSE2]    = &_scan_line_sse2,
+    [SCAN_IMPL_AVX2]    = &_scan_line_avx2,
+#endif
+};
+
+void scan_line(const char *str, size_t len, LineScan *scan) {
+    assert(str != NULL);
+    assert(len <= SCAN_MAX_LEN);
+    assert(scan != NULL);
+
+    __atomic_load_n(&_scan_fn, __ATOMIC_RELAXED)(str, len, scan);
+}
+
+int scan_impl_supported(ScanImpl impl) {
+    if (impl < 0 || impl >= SCAN_IMPL_LAST) return 0;
+    if (NULL == _scan_impls[impl]) return 0;
+
+#ifdef SCAN_HAVE_X86
+    if (impl == SCAN_IMPL_SSE2)  return __builtin_cpu_supports("sse2");
+    if (impl == SCAN_IMPL_AVX2)  return __builtin_cpu_supports("avx2");
+#endif
+
+    return 1;
+}
+
+// for testing: scans with a specific implementation, which must be supported
+void scan_line_impl(ScanImpl impl, const char *str, size_t len, LineScan *scan) {
+    assert(scan_impl_supported(impl));
+    assert(len <= SCAN_MAX_LEN);
+
+    _scan_impls[impl](str, len, scan);
+}
+
+// picks the best implementation the cpu supports the first time through
+void _scan_line_resolve(const char *str, size_t len, LineScan *scan) {
+    ScanFn fn = &_scan_line_scalar;
+
+    for (int i = SCAN_IMPL_LAST - 1; i > SCAN_IMPL_SCALAR; i--) {
+        if (scan_impl_supported(i)) {
+            fn = _scan_impls[i];
+            break;
+        }
+    }
+
+    __atomic_store_n(&_scan_fn, fn, __ATOMIC_RELAXED);
+    fn(str, len, scan);
+}
+
+// runs block over each whole block of the line, then over a padded copy of
+// whatever is left.  always inlined, so each implementation gets its own copy
+// with its block function inlined into it
+static inline __attribute__((always_inline))
+void _scan_blocks(const char *str, size_t len, LineScan *scan,
+                  uint64_t (*block)(const char *, uint64_t *)) {
+    uint64_t invalid = 0;
+    size_t i = 0, n;
+
+    memset(scan, 0, sizeof(*scan));
+
+    for (n = 0; len - i >= SCAN_BLOCK; i += SCAN_BLOCK, n++) {
+        scan->m_spaces[n] = block(&str[i], &invalid);
+    }
+
+    if (i < len) {
+        char tail[SCAN_BLOCK];
+
+        memset(tail, SCAN_PADDING, sizeof(tail));
+        memcpy(tail, &str[i], len - i);
+        scan->m_spaces[n] = block(tail, &invalid);
+    }
+
+    scan->m_invalid = (invalid != 0);
+}
+
+static inline __attribute__((always_inline))
+uint64_t _scan_block_scalar(const char *p, uint64_t *invalid) {
+    uint64_t spaces = 0;
+
+    for (unsigned i = 0; i < SCAN_BLOCK; i++) {
+        const char c = p[i];
+
+        if (c == ' ')  spaces |= UINT64_C(1) << i;
+        if (c == '\x0d' || c == '\x0a' || c == '\0')  *invalid = 1;
+    }
+
+    return spaces;
+}
+
+void _scan_line_scalar(const char *str, size_t len, LineScan *scan) {
+    _scan_blocks(str, len, scan, &_scan_block_scalar);
+}
+
+#ifdef SCAN_HAVE_X86
+static inline __attribute__((always_inline, target("sse2")))
+uint64_t _scan_block_sse2(const char *p, uint64_t *invalid) {
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i cr = _mm_set1_epi8('\x0d');
+    const __m128i lf = _mm_set1_epi8('\x0a');
+    const __m128i nul = _mm_setzero_si128();
+    uint64_t spaces = 0;
+
+    for (unsigned i = 0; i < SCAN_BLOCK; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) &p[i]);
+
+        const __m128i bad = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+            _mm_cmpeq_epi8(v, nul)
+        );
+
+        spaces |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)) << i;
+        *invalid |= (uint16_t) _mm_movemask_epi8(bad);
+    }
+
+    return spaces;
+}
+
+__attribute__((target("sse2")))
+void _scan_line_sse2(const char *str, size_t len, LineScan *scan) {
+    _scan_blocks(str, len, scan, &_scan_block_sse2);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+uint64_t _scan_block_avx2(const char *p, uint64_t *invalid) {
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i cr = _mm256_set1_epi8('\x0d');
+    const __m256i lf = _mm256_set1_epi8('\x0a');
+    const __m256i nul = _mm256_setzero_si256();
+    uint64_t spaces = 0;
+
+    for (unsigned i = 0; i < SCAN_BLOCK; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) &p[i]);
+
+        const __m256i bad = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+            _mm256_cmpeq_epi8(v, nul)
+        );
+
+        spaces |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp)) << i;
+        *invalid |= (uint32_t) _mm256_movemask_epi8(bad);
+    }
+
+    return spaces;
+}
+
+__attribute__((target("avx2")))
+void _scan_line_avx2(const char *str, size_t len, LineScan *scan) {
+    _scan_blocks(str, len, scan, &_scan_block_avx2);
+}
+#endif
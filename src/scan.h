@@ -0,0 +1,45 @@
+#ifndef GOAT_SCAN_H
+#define GOAT_SCAN_H
+
+#include <config.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_MAX_LEN (512)
+
+// one pass over a line: a bitmap of where its spaces are, which the parser
+// walks to split it into tokens, and whether it contains anything that may
+// not appear in a message (cr, lf or nul)
+typedef struct {
+    uint64_t    m_spaces[SCAN_MAX_LEN / 64];
+    int         m_invalid;
+} LineScan;
+
+typedef enum {
+    SCAN_IMPL_SCALAR = 0,
+    SCAN_IMPL_SSE2,
+    SCAN_IMPL_AVX2,
+
+    SCAN_IMPL_LAST /* don't use; keep last */
+} ScanImpl;
+
+void scan_line(const char *str, size_t len, LineScan *scan);
+
+int scan_impl_supported(ScanImpl impl);
+void scan_line_impl(ScanImpl impl, const char *str, size_t len, LineScan *scan);
+
+// returns the offset of the first space at or after from, or -1 if none
+static inline int scan_next_space(const LineScan *scan, size_t from, size_t len) {
+    for (size_t i = from / 64; i * 64 < len; i++) {
+        uint64_t word = scan->m_spaces[i];
+
+        if (i == from / 64 && from % 64) word &= ~UINT64_C(0) << (from % 64);
+
+        if (word) return i * 64 + __builtin_ctzll(word);
+    }
+
+    return -1;
+}
+
+#endif
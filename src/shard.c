@@ -0,0 +1,241 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context.h"
+#include "shard.h"
+#include "util.h"
+
+// how long a worker waits for io before checking whether it should stop.
+// shorter if it has connections that want ticking regardless of io
+#define SHARD_WAIT_MS           (100)
+#define SHARD_TICKING_WAIT_MS   (10)
+#define SHARD_POLLFDS_ALLOC_INCR (16)
+
+static void *_shard_main(void *arg);
+static void _shard_run_once(Shard *shard, PollerEvent *ready, size_t n_ready);
+static void _shard_poll_once(Shard *shard, struct timeval *timeout);
+static int _shard_pollfds_reserve(Shard *shard, size_t n);
+static void _shard_pin(Shard *shard);
+
+int shard_init(Shard *shard, GoatContext *context, unsigned index, GoatContextMode mode, int cpu) {
+    assert(shard != NULL);
+    assert(context != NULL);
+
+    memset(shard, 0, sizeof(*shard));
+    shard->m_context = context;
+    shard->m_index = index;
+    shard->m_cpu = cpu;
+
+    // workers have to block on something of their own, so select means
+    // epoll here where there is one.  where there isn't (bsd, macos) they
+    // poll() their own connections instead
+#ifdef HAVE_SYS_EPOLL_H
+    if (mode == GOAT_MODE_SELECT)  mode = GOAT_MODE_EPOLL;
+#endif
+
+    int r = poller_init(&shard->m_poller, mode);
+    if (r && mode == GOAT_MODE_URING) {
+        // io_uring is optional, fall back to epoll if we can't have it
+        r = poller_init(&shard->m_poller, GOAT_MODE_EPOLL);
+    }
+    if (r) return r;
+
+    r = timer_wheel_init(&shard->m_timers, timer_now_ms());
+    if (r)  poller_destroy(&shard->m_poller);
+
+    return r;
+}
+
+void shard_destroy(Shard *shard) {
+    assert(shard != NULL);
+    assert(!shard->m_started);
+
+    free(shard->m_pollfds);
+    free(shard->m_poll_handles);
+    timer_wheel_destroy(&shard->m_timers);
+    poller_destroy(&shard->m_poller);
+}
+
+int shard_start(Shard *shard) {
+    assert(shard != NULL);
+    assert(!shard->m_started);
+
+    __atomic_store_n(&shard->m_stop, 0, __ATOMIC_RELEASE);
+
+    int r = pthread_create(&shard->m_thread, NULL, &_shard_main, shard);
+    if (r) return r;
+
+    shard->m_started = 1;
+
+    if (shard->m_cpu >= 0) _shard_pin(shard);
+
+    return 0;
+}
+
+// waits for the worker to finish whatever it's doing.  must not be called
+// while holding the context's lock, or from the worker itself
+void shard_stop(Shard *shard) {
+    assert(shard != NULL);
+
+    if (!shard->m_started) return;
+
+    __atomic_store_n(&shard->m_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(shard->m_thread, NULL);
+
+    shard->m_started = 0;
+}
+
+void *_shard_main(void *arg) {
+    Shard *const shard = arg;
+    PollerEvent ready[POLLER_MAX_EVENTS];
+
+    while (!__atomic_load_n(&shard->m_stop, __ATOMIC_ACQUIRE)) {
+        int ticking = 0;
+        if (0 == pthread_mutex_lock(&shard->m_poller.m_mutex)) {
+            ticking = shard->m_poller.m_ticking_count != 0;
+            pthread_mutex_unlock(&shard->m_poller.m_mutex);
+        }
+
+        const int ms = ticking ? SHARD_TICKING_WAIT_MS : SHARD_WAIT_MS;
+        struct timeval wait = { ms / 1000, (ms % 1000) * 1000 }, timer_wait;
+
+        struct timeval *timeout = context_timeout(&shard->m_timers, &wait, &timer_wait);
+
+        if (shard->m_poller.m_mode == GOAT_MODE_SELECT) {
+            _shard_poll_once(shard, timeout);
+            continue;
+        }
+
+        int n_ready = poller_wait(&shard->m_poller, ready, POLLER_MAX_EVENTS, timeout);
+        if (n_ready >= 0)  _shard_run_once(shard, ready, n_ready);
+    }
+
+    return NULL;
+}
+
+void _shard_run_once(Shard *shard, PollerEvent *ready, size_t n_ready) {
+    GoatContext *const context = shard->m_context;
+
+    // not tryrdlock: these events have already been taken from the kernel,
+    // and the poller may be holding received data for them
+    if (pthread_rwlock_rdlock(&context->m_rwlock)) return;
+
+    for (size_t i = 0; i < n_ready; i++) {
+        Connection *conn;
+
+        context_complete_event(context, &shard->m_poller, &ready[i], &conn);
+
+        // callbacks run here, on the connection's own worker
+        if (conn)  context_dispatch_connection(context, conn, ready[i].handle);
+    }
+
+    context_run_timers(context, &shard->m_timers, 1);
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+}
+
+// without epoll, works like goat_tick() does in select mode, but only over
+// the worker's own connections, and with poll() so there's no FD_SETSIZE
+void _shard_poll_once(Shard *shard, struct timeval *timeout) {
+    GoatContext *const context = shard->m_context;
+    size_t n_fds = 0;
+
+    if (pthread_rwlock_rdlock(&context->m_rwlock)) return;
+
+    if (0 == _shard_pollfds_reserve(shard, context->m_connections_count + 1)) {
+        // so that sends from other threads don't wait for the timeout
+        shard->m_pollfds[n_fds] = (struct pollfd) { shard->m_poller.m_wake_fd, POLLIN, 0 };
+        shard->m_poll_handles[n_fds ++] = -1;
+
+        for (size_t i = 0; i < context->m_connections_count; i++) {
+            int handle;
+            Connection *const conn = context_connection_at(context, i, &handle);
+            if (NULL == conn || conn->m_shard != shard->m_index) continue;
+
+            short events = 0;
+            if (conn_wants_read(conn))  events |= POLLIN;
+            if (conn_wants_write(conn))  events |= POLLOUT;
+            if (0 == events) continue;
+
+            shard->m_pollfds[n_fds] = (struct pollfd) { conn->m_network.socket, events, 0 };
+            shard->m_poll_handles[n_fds ++] = handle;
+        }
+    }
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+
+    // unlocked, because it might block for a while
+    int ms = -1;
+    if (timeout)  ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+    if (poll(shard->m_pollfds, n_fds, ms) < 0 && errno != EINTR) return;
+
+    if (n_fds && shard->m_pollfds[0].revents)  poller_clear_wake(&shard->m_poller);
+
+    if (pthread_rwlock_rdlock(&context->m_rwlock)) return;
+
+    // every connection gets ticked, as in select mode, since that's how
+    // finished name lookups get noticed.  readiness is matched up by
+    // position: if the table changed meanwhile, anything missed is still
+    // ready next time round
+    size_t k = 1;
+    for (size_t i = 0; i < context->m_connections_count; i++) {
+        int handle;
+        Connection *const conn = context_connection_at(context, i, &handle);
+        if (NULL == conn || conn->m_shard != shard->m_index) continue;
+
+        short revents = 0;
+        if (k < n_fds && shard->m_poll_handles[k] == handle) {
+            if (shard->m_pollfds[k].fd == conn->m_network.socket)  revents = shard->m_pollfds[k].revents;
+            k ++;
+        }
+
+        conn_tick(conn, !!(revents & (POLLIN | POLLHUP | POLLERR)),
+                        !!(revents & (POLLOUT | POLLHUP | POLLERR)));
+        context_update_connection(context, conn, handle);
+
+        // callbacks run here, on the connection's own worker
+        context_dispatch_connection(context, conn, handle);
+    }
+
+    context_run_timers(context, &shard->m_timers, 1);
+
+    pthread_rwlock_unlock(&context->m_rwlock);
+}
+
+int _shard_pollfds_reserve(Shard *shard, size_t n) {
+    if (n <= shard->m_pollfds_size) return 0;
+
+    const size_t new_size = n + SHARD_POLLFDS_ALLOC_INCR;
+
+    struct pollfd *fds = realloc(shard->m_pollfds, new_size * sizeof(*fds));
+    if (NULL == fds) return errno;
+    shard->m_pollfds = fds;
+
+    int *handles = realloc(shard->m_poll_handles, new_size * sizeof(*handles));
+    if (NULL == handles) return errno;
+    shard->m_poll_handles = handles;
+
+    shard->m_pollfds_size = new_size;
+    return 0;
+}
+
+void _shard_pin(Shard *shard) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->m_cpu, &cpus);
+
+    // not fatal: the worker just runs wherever the scheduler puts it
+    pthread_setaffinity_np(shard->m_thread, sizeof(cpus), &cpus);
+#else
+    ARG_UNUSED(shard);
+#endif
+}
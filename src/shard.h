@@ -0,0 +1,37 @@
+#ifndef GOAT_SHARD_H
+#define GOAT_SHARD_H
+
+#include <config.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include "goat.h"
+#include "poller.h"
+#include "timer.h"
+
+// a worker thread with a poller of its own, which ticks the connections
+// assigned to it and runs their callbacks
+typedef struct {
+    GoatContext         *m_context;
+    Poller              m_poller;
+    TimerWheel          m_timers;           // for its connections
+    pthread_t           m_thread;
+    unsigned            m_index;
+    int                 m_cpu;              // to pin to, or -1
+    int                 m_started;
+    int                 m_stop;
+    size_t              m_n_connections;    // assigned; changed under the context's write lock
+    struct pollfd       *m_pollfds;         // when there's no epoll to block on
+    int                 *m_poll_handles;
+    size_t              m_pollfds_size;
+} Shard;
+
+int shard_init(Shard *shard, GoatContext *context, unsigned index, GoatContextMode mode, int cpu);
+void shard_destroy(Shard *shard);
+
+int shard_start(Shard *shard);
+void shard_stop(Shard *shard);
+
+#endif
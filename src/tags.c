@@ -7,36 +7,45 @@
 #include "goat.h"
 
 #include "message.h"
+#include "pool.h"
 #include "tags.h"
 #include "util.h"
 
+static int _tags_detach(GoatMessage *message);
+static const MessageTagIndex *_tags_index(const GoatMessage *message);
+static void _tags_index_free(MessageTagIndex *index);
+static void _tags_index_build(MessageTagIndex *index, const char *tags, size_t len);
+static int _tags_index_find(const MessageTagIndex *index, const char *key,
+                            const char **value, size_t *value_len);
+static size_t _tags_next_entry(const char *tags, size_t len, size_t pos, MessageTagEntry *entry);
+static uint32_t _tags_hash(const char *key, size_t len);
 static const char *_next_tag(const char *str);
 static const char *_find_tag(const char *str, const char *key);
-static const char *_find_value(const char *str);
-static const char *_escape_value(const char *value, char *buf, size_t *size);
-static const char *_unescape_value(const char *value, char *buf, size_t *size);
+static size_t _escape_value(const char *value, char *buf);
+static MessageTags *_tags_alloc(size_t size);
+static int _tags_reserve(MessageTags **tagsp, size_t size);
+static void _tags_free(MessageTags *tags);
+static size_t _unescape_span(const char *value, size_t len, char *buf);
 
 GoatError tags_init(MessageTags **tagsp, const char *key, const char *value) {
-    char escaped_value[GOAT_MESSAGE_MAX_TAGS];
-    size_t escaped_value_len = sizeof(escaped_value);
+    size_t key_len = strlen(key);
 
-    size_t len = strlen(key);
+    size_t len = key_len;
     if (value) {
-        _escape_value(value, escaped_value, &escaped_value_len);
-        len += 1 + escaped_value_len;  // = and value
+        len += 1 + _escape_value(value, NULL);  // = and value
     }
 
-    MessageTags *tags = calloc(1, sizeof(*tags));
-    if (NULL == tags) return errno;
-
     if (len > GOAT_MESSAGE_MAX_TAGS) return GOAT_E_MSGLEN;
 
+    MessageTags *tags = _tags_alloc(len + 1);
+    if (NULL == tags) return errno;
+
+    memcpy(tags->m_bytes, key, key_len);
     if (value) {
-        snprintf(tags->m_bytes, len + 1, "%s=%s", key, escaped_value);
-    }
-    else {
-        snprintf(tags->m_bytes, len + 1, "%s", key);
+        tags->m_bytes[key_len] = '=';
+        _escape_value(value, &tags->m_bytes[key_len + 1]);
     }
+    tags->m_len = len;
 
     *tagsp = tags;
     return 0;
@@ -45,30 +54,18 @@ GoatError tags_init(MessageTags **tagsp, const char *key, const char *value) {
 size_t goat_message_has_tags(const GoatMessage *message) {
     if (NULL == message) return 0;
 
-    const MessageTags *tags = message->m_tags;
-
-    if (NULL == tags) return 0;
-    if (tags->m_bytes[0] == '\0') return 0;
-
-    size_t count = 1;
-    const char *p = tags->m_bytes;
-    while (p[0] != '\0') {
-        if (p[0] == ';' && p[1] != '\0') count++;
-        p++;
-    }
+    const MessageTagIndex *index = _tags_index(message);
 
-    return count;
+    return index ? index->m_count : 0;
 }
 
 int goat_message_has_tag(const GoatMessage *message, const char *key) {
     if (NULL == message) return 0;
     if (NULL == key) return 0;
 
-    const MessageTags *tags = message->m_tags;
+    const MessageTagIndex *index = _tags_index(message);
 
-    if (NULL == tags || 0 == strlen(tags->m_bytes)) return 0;
-
-    return _find_tag(tags->m_bytes, key) ? 1 : 0;
+    return index ? 0 == _tags_index_find(index, key, NULL, NULL) : 0;
 }
 
 GoatError goat_message_get_tag_value(
@@ -79,37 +76,44 @@ GoatError goat_message_get_tag_value(
     if (NULL == value) return EINVAL;
     if (NULL == size) return EINVAL;
 
-    const MessageTags *tags = message->m_tags;
-
-    if (NULL == tags || 0 == strlen(tags->m_bytes)) return GOAT_E_NOTAG;
+    const char *v;
+    size_t len;
 
-    const char *p, *v, *end;
+    GoatError r = goat_message_get_tag_value_view(message, key, &v, &len);
+    if (r) return r;
 
-    p = _find_tag(tags->m_bytes, key);
-    if (NULL == p) return GOAT_E_NOTAG;
+    if (*size <= len) return EOVERFLOW;
 
-    v = _find_value(p);
-    if (NULL == v) return GOAT_E_NOTAGVAL;
+    memcpy(value, v, len);
+    value[len] = '\0';
+    *size = len;
 
-    end = _next_tag(v);
-    if ('\0' != *end) end--; // account for separator
-
-    char unescaped[GOAT_MESSAGE_MAX_TAGS];
-    size_t unescaped_len = sizeof(unescaped);
-    _unescape_value(v, unescaped, &unescaped_len);
+    return 0;
+}
 
-    if (*size <= unescaped_len) return EOVERFLOW;
+GoatError goat_message_get_tag_value_view(
+    const GoatMessage *message, const char *key, const char **value, size_t *len
+) {
+    if (NULL == message) return EINVAL;
+    if (NULL == key) return EINVAL;
+    if (NULL == value) return EINVAL;
+    if (NULL == len) return EINVAL;
 
-    memset(value, 0, *size);
-    strncpy(value, unescaped, unescaped_len);
-    *size = unescaped_len;
+    const MessageTagIndex *index = _tags_index(message);
+    if (NULL == index) return GOAT_E_NOTAG;
 
-    return 0;
+    return _tags_index_find(index, key, value, len);
 }
 
 GoatError goat_message_set_tag(GoatMessage *message, const char *key, const char *value) {
     if (NULL == message) return EINVAL;
     if (NULL == key) return EINVAL;
+    if (MESSAGE_IS_VIEW(message)) return EINVAL;
+
+    int r = _tags_detach(message);
+    if (r) return r;
+
+    tags_index_free(message);
 
     if (NULL == message->m_tags) {
         return tags_init(&message->m_tags, key, value);
@@ -120,36 +124,31 @@ GoatError goat_message_set_tag(GoatMessage *message, const char *key, const char
         goat_message_unset_tag(message, key);
     }
 
-    char buf[GOAT_MESSAGE_MAX_TAGS] = {0};
-    char *p = buf;
+    // separator if there's already tag data
+    const size_t sep = (message->m_tags->m_len > 0);
 
-    if (message->m_tags->m_len + strlen(key) + 1 > GOAT_MESSAGE_MAX_TAGS) {
-        return GOAT_E_MSGLEN;
+    size_t len = message->m_tags->m_len + sep + strlen(key);
+    if (value) {
+        len += 1 + _escape_value(value, NULL);  // = and value
     }
 
-    if (message->m_tags->m_len > 0) {
-        // separator if there's already tag data
-        *p++ = ';';
-    }
+    if (len > GOAT_MESSAGE_MAX_TAGS) return GOAT_E_MSGLEN;
 
-    p = stpcpy(p, key);
+    r = _tags_reserve(&message->m_tags, len + 1);
+    if (r) return r;
 
-    if (value) {
-        char escaped_value[GOAT_MESSAGE_MAX_TAGS] = {0};
-        size_t escaped_value_len = sizeof(escaped_value);
+    char *p = &message->m_tags->m_bytes[message->m_tags->m_len];
 
-        _escape_value(value, escaped_value, &escaped_value_len);
+    if (sep) *p++ = ';';
 
-        if (message->m_tags->m_len + strlen(buf) + escaped_value_len + 1 > GOAT_MESSAGE_MAX_TAGS) {
-            return GOAT_E_MSGLEN;
-        }
+    p = stpcpy(p, key);
 
+    if (value) {
         *p++ = '=';
-        p = stpcpy(p, escaped_value);
+        _escape_value(value, p);
     }
 
-    strcat(message->m_tags->m_bytes, buf);
-    message->m_tags->m_len += strlen(buf);
+    message->m_tags->m_len = len;
 
     return 0;
 }
@@ -157,6 +156,12 @@ GoatError goat_message_set_tag(GoatMessage *message, const char *key, const char
 GoatError goat_message_unset_tag(GoatMessage *message, const char *key) {
     if (NULL == message) return EINVAL;
     if (NULL == key) return EINVAL;
+    if (MESSAGE_IS_VIEW(message)) return EINVAL;
+
+    int r = _tags_detach(message);
+    if (r) return r;
+
+    tags_index_free(message);
 
     MessageTags *tags = message->m_tags;
 
@@ -176,11 +181,11 @@ GoatError goat_message_unset_tag(GoatMessage *message, const char *key) {
     if (p2[0] != '\0') {
         memmove(p1, p2, end - p2);
         tags->m_len -= (p2 - p1);
-        memset(&tags->m_bytes[tags->m_len], 0, sizeof(tags->m_bytes) - tags->m_len);
+        memset(&tags->m_bytes[tags->m_len], 0, tags->m_size - tags->m_len);
     }
     else {
         tags->m_len = p1 - tags->m_bytes;
-        memset(p1, 0, sizeof(tags->m_bytes) - tags->m_len);
+        memset(p1, 0, tags->m_size - tags->m_len);
     }
 
     // may be a trailing semicolon if tag removed from end, chomp it
@@ -191,32 +196,95 @@ GoatError goat_message_unset_tag(GoatMessage *message, const char *key) {
     return 0;
 }
 
-size_t tags_parse(const char *str, MessageTags **tagsp) {
-    if (NULL == tagsp) return 0;
-    if (str[0] != '@') return 0;
+// finds the tags at the start of str without copying them.  returns the
+// length consumed (including @ and space), or 0 if they're malformed.  *tags
+// is left alone if there aren't any worth keeping
+size_t tags_parse(const char *str, const char **tags, size_t *len) {
+    assert(str != NULL);
+    assert(tags != NULL);
+    assert(len != NULL);
 
-    // populate our struct, skipping the @
-    char *end = strchr(&str[1], ' ');
-    size_t len = end - &str[1];
+    if (str[0] != '@') return 0;
 
-    if (strn_has_crlf(&str[1], len)) return 0;
-    if (strn_has_sp(&str[1], len)) return 0;
+    const char *end = strchr(&str[1], ' ');
+    if (NULL == end) return 0;
 
-    if (len > 0 && len <= GOAT_MESSAGE_MAX_TAGS) {
-        MessageTags *tags = calloc(1, sizeof(MessageTags));
-        if (NULL == tags) return 0;
+    size_t tags_len = end - &str[1];
 
-        tags->m_len = len;
-        strncpy(tags->m_bytes, &str[1], len);
+    if (strn_has_crlf(&str[1], tags_len)) return 0;
 
-        *tagsp = tags;
+    // oversized tags are dropped, but the rest of the message is still good
+    if (tags_len > 0 && tags_len <= GOAT_MESSAGE_MAX_TAGS) {
+        *tags = &str[1];
+        *len = tags_len;
     }
 
-    // calculate consumed length (including @ and space)
-    if (*end != '\0') end ++;
-    size_t consumed = end - str;
+    return end + 1 - str;
+}
 
-    return consumed;
+// tags stored inline or borrowed from a line can't grow, so move them into
+// a MessageTags of their own before changing them
+int _tags_detach(GoatMessage *message) {
+    if (message->m_tags || !message->m_have_inline_tags) return 0;
+
+    MessageTags *tags = _tags_alloc(message->m_tags_len + 1);
+    if (NULL == tags) return errno;
+
+    tags->m_len = message->m_tags_len;
+    memcpy(tags->m_bytes, &message->m_bytes[message->m_len + 1], tags->m_len);
+
+    message->m_tags = tags;
+    message->m_have_inline_tags = 0;
+    message->m_tags_len = 0;
+
+    return 0;
+}
+
+// tags are sized to fit, using whatever slack their size class has.  size
+// includes the terminating nul
+MessageTags *_tags_alloc(size_t size) {
+    size_t alloc_size = pool_size(GOAT_POOL_TAGS, MESSAGE_TAGS_ALLOC_SIZE(size));
+
+    MessageTags *tags = pool_alloc(GOAT_POOL_TAGS, alloc_size);
+    if (NULL == tags) return NULL;
+
+    tags->m_size = alloc_size - MESSAGE_TAGS_ALLOC_SIZE(0);
+
+    return tags;
+}
+
+// makes sure *tagsp can hold size bytes, moving them somewhere bigger if not
+int _tags_reserve(MessageTags **tagsp, size_t size) {
+    MessageTags *tags = *tagsp;
+
+    if (size <= tags->m_size) return 0;
+
+    // grow geometrically, so repeated set_tag calls don't copy every time
+    size_t want = tags->m_size * 2;
+    if (want < size) want = size;
+    if (want > GOAT_MESSAGE_MAX_TAGS + 1) want = GOAT_MESSAGE_MAX_TAGS + 1;
+
+    MessageTags *bigger = _tags_alloc(want);
+    if (NULL == bigger) return errno;
+
+    bigger->m_len = tags->m_len;
+    memcpy(bigger->m_bytes, tags->m_bytes, tags->m_len + 1);
+
+    _tags_free(tags);
+    *tagsp = bigger;
+
+    return 0;
+}
+
+void _tags_free(MessageTags *tags) {
+    if (tags) pool_free(GOAT_POOL_TAGS, tags, MESSAGE_TAGS_ALLOC_SIZE(tags->m_size));
+}
+
+void tags_free(GoatMessage *message) {
+    assert(message != NULL);
+
+    _tags_free(message->m_tags);
+    message->m_tags = NULL;
 }
 
 const char *_next_tag(const char *str) {
@@ -254,98 +322,249 @@ const char *_find_tag(const char *str, const char *key) {
     return NULL;
 }
 
-const char *_find_value(const char *str) {
-    assert(str != NULL);
+// escapes value into buf, nul-terminated, returning the escaped length.
+// with a NULL buf, just works out the length
+size_t _escape_value(const char *value, char *buf) {
+    assert(value != NULL);
 
-    const char *p = str;
+    size_t n = 0;
 
-    while (*p != '\0' && *p != ';' && *p != '=') p++;
+    for (size_t i = 0; value[i] != '\0'; i++) {
+        char escape;
 
-    if (*p == '=' && *(p + 1) != '\0') return p + 1;
+        switch (value[i]) {
+            case ';':   escape = ':';   break;
+            case ' ':   escape = 's';   break;
+            case '\\':  escape = '\\';  break;
+            case '\r':  escape = 'r';   break;
+            case '\n':  escape = 'n';   break;
 
-    return NULL;
+            default:
+                if (buf) buf[n] = value[i];
+                n ++;
+                continue;
+        }
+
+        if (buf) {
+            buf[n] = '\\';
+            buf[n + 1] = escape;
+        }
+        n += 2;
+    }
+
+    if (buf) buf[n] = '\0';
+
+    return n;
 }
 
-const char *_escape_value(const char *value, char *buf, size_t *size) {
+// unescapes len bytes of value into buf, returning the unescaped length.
+// with a NULL buf, just works out the length
+size_t _unescape_span(const char *value, size_t len, char *buf) {
     assert(value != NULL);
-    assert(buf != NULL);
-    assert(size != NULL);
 
-    char *dest = buf;
+    size_t n = 0;
 
-    for (size_t i = 0; i < *size && value[i] != '\0'; i++) {
-        switch(value[i]) {
-            case ';':
-                dest[0] = '\\';
-                dest[1] = ':';
-                dest += 2;
-                break;
+    for (size_t i = 0; i < len; i++) {
+        char c = value[i];
 
-            case ' ':
-                dest[0] = '\\';
-                dest[1] = 's';
-                dest += 2;
-                break;
+        if (c == '\\') {
+            // a trailing backslash on its own is dropped
+            if (++ i == len) break;
 
-            case '\\':
-                dest[0] = '\\';
-                dest[1] = '\\';
-                dest += 2;
-                break;
+            switch ((c = value[i])) {
+                case ':':  c = ';';          break;
+                case 's':  c = ' ';          break;
+                case '\\': c = '\\';         break;
+                case 'r':  c = '\r';         break;
+                case 'n':  c = '\n';         break;
+            }
+        }
 
-            case '\r':
-                dest[0] = '\\';
-                dest[1] = 'r';
-                dest += 2;
-                break;
+        if (buf) buf[n] = c;
+        n ++;
+    }
 
-            case '\n':
-                dest[0] = '\\';
-                dest[1] = 'n';
-                dest += 2;
-                break;
+    return n;
+}
 
-            default:
-                *dest++ = value[i];
-                break;
-        }
+void _tags_index_free(MessageTagIndex *index) {
+    pool_free(GOAT_POOL_TAGS, index, MESSAGE_TAG_INDEX_ALLOC_SIZE(index->m_unescaped_size));
+}
+
+// only while nobody else can be reading the message: before its tags are
+// changed, or when it's going away
+void tags_index_free(GoatMessage *message) {
+    assert(message != NULL);
+
+    if (message->m_tag_index) {
+        _tags_index_free(message->m_tag_index);
+        message->m_tag_index = NULL;
     }
+}
+
+// returns the message's tag index, building it if this is the first time
+// its tags have been looked at.  readers may race to build it, but only one
+// gets installed
+const MessageTagIndex *_tags_index(const GoatMessage *message) {
+    const char *tags = MESSAGE_TAGS(message);
+    if (NULL == tags) return NULL;
+
+    const size_t len = MESSAGE_TAGS_LEN(message);
+    GoatMessage *mutable = (GoatMessage *) message;
+    MessageTagIndex *index = __atomic_load_n(&mutable->m_tag_index, __ATOMIC_ACQUIRE);
+
+    if (index) {
+        // set/unset drop the index before touching the tags, so it can't be
+        // stale here.  rebuilding or freeing it would pull it out from under
+        // whoever else is reading it
+        assert(index->m_source == tags && index->m_source_len == len);
+        return index;
+    }
+
+    // unescaping never makes a value longer, so the tags' length is enough
+    size_t alloc_size = pool_size(GOAT_POOL_TAGS, MESSAGE_TAG_INDEX_ALLOC_SIZE(len));
+
+    index = pool_alloc(GOAT_POOL_TAGS, alloc_size);
+    if (NULL == index) return NULL;
+
+    index->m_unescaped_size = alloc_size - MESSAGE_TAG_INDEX_ALLOC_SIZE(0);
 
-    *dest = '\0';
-    *size = dest - buf;
+    _tags_index_build(index, tags, len);
 
-    return buf;
+    MessageTagIndex *expected = NULL;
+    if (!__atomic_compare_exchange_n(&mutable->m_tag_index, &expected, index, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        _tags_index_free(index);
+        index = expected;
+    }
+
+    return index;
 }
 
-const char *_unescape_value(const char *value, char *buf, size_t *size) {
-    assert(value != NULL);
-    assert(buf != NULL);
-    assert(size != NULL);
+void _tags_index_build(MessageTagIndex *index, const char *tags, size_t len) {
+    MessageTagEntry entry;
+    size_t pos = 0, unescaped = 0;
 
-    char *dest = buf;
+    memset(index, 0, offsetof(MessageTagIndex, m_entries));
+    index->m_source = tags;
+    index->m_source_len = len;
+    index->m_complete = 1;
 
-    size_t value_len = strlen(value);
-    assert(value_len < *size);
+    while (pos < len) {
+        pos = _tags_next_entry(tags, len, pos, &entry);
+        index->m_count ++;
 
-    for (size_t i = 0; i < value_len; i++) {
-        if (value[i] == '\\') {
-            char c = value[i + 1];
-            switch (c) {
-                case ':':  c = ';';          break;
-                case 's':  c = ' ';          break;
-                case '\\': c = '\\';         break;
-                case 'r':  c = '\r';         break;
-                case 'n':  c = '\n';         break;
+        if (entry.m_unescaped) {
+            entry.m_value_len = _unescape_span(&tags[entry.m_value], entry.m_value_len,
+                                               &index->m_unescaped[unescaped]);
+            entry.m_value = unescaped;
+            unescaped += entry.m_value_len;
+        }
+
+        if (!index->m_complete) continue;
+
+        if (index->m_n_entries == MESSAGE_TAG_INDEX_MAX) {
+            index->m_complete = 0;
+            index->m_rest = entry.m_key;
+            index->m_rest_unescaped = entry.m_unescaped ? entry.m_value : unescaped;
+            continue;
+        }
+
+        // first one wins if a key is repeated
+        uint32_t slot = entry.m_hash;
+        for ( ; index->m_slots[slot % MESSAGE_TAG_INDEX_SLOTS]; slot++) {
+            const MessageTagEntry *e = &index->m_entries[index->m_slots[slot % MESSAGE_TAG_INDEX_SLOTS] - 1];
+
+            if (e->m_hash == entry.m_hash && e->m_key_len == entry.m_key_len
+                && 0 == memcmp(&tags[e->m_key], &tags[entry.m_key], entry.m_key_len)) {
+                break;
             }
-            *dest++ = c;
-            i++;
         }
-        else {
-            *dest++ = value[i];
+        if (index->m_slots[slot % MESSAGE_TAG_INDEX_SLOTS]) continue;
+
+        index->m_entries[index->m_n_entries ++] = entry;
+        index->m_slots[slot % MESSAGE_TAG_INDEX_SLOTS] = index->m_n_entries;
+    }
+}
+
+// finds key's value (unescaped, and not nul-terminated).  value and
+// value_len may be NULL to just check that the tag exists
+int _tags_index_find(const MessageTagIndex *index, const char *key,
+                     const char **value, size_t *value_len) {
+    const char *const tags = index->m_source;
+    const size_t key_len = strlen(key);
+    const uint32_t hash = _tags_hash(key, key_len);
+    const MessageTagEntry *found = NULL;
+    MessageTagEntry entry;
+
+    for (uint32_t slot = hash; index->m_slots[slot % MESSAGE_TAG_INDEX_SLOTS]; slot++) {
+        const MessageTagEntry *e = &index->m_entries[index->m_slots[slot % MESSAGE_TAG_INDEX_SLOTS] - 1];
+
+        if (e->m_hash == hash && e->m_key_len == key_len
+            && 0 == memcmp(&tags[e->m_key], key, key_len)) {
+            found = e;
+            break;
         }
     }
-    memset(dest, 0, *size - (dest - buf));
 
-    *size = dest - buf;
-    return buf;
+    if (NULL == found && !index->m_complete) {
+        // too many tags to index them all, look through the rest
+        size_t pos = index->m_rest, unescaped = index->m_rest_unescaped;
+
+        while (NULL == found && pos < index->m_source_len) {
+            pos = _tags_next_entry(tags, index->m_source_len, pos, &entry);
+
+            if (entry.m_unescaped) {
+                entry.m_value_len = _unescape_span(&tags[entry.m_value], entry.m_value_len, NULL);
+                entry.m_value = unescaped;
+                unescaped += entry.m_value_len;
+            }
+
+            if (entry.m_key_len == key_len && 0 == memcmp(&tags[entry.m_key], key, key_len)) {
+                found = &entry;
+            }
+        }
+    }
+
+    if (NULL == found) return GOAT_E_NOTAG;
+    if (NULL == value) return 0;
+
+    if (!found->m_has_value || 0 == found->m_value_len) return GOAT_E_NOTAGVAL;
+
+    *value = found->m_unescaped ? &index->m_unescaped[found->m_value] : &tags[found->m_value];
+    *value_len = found->m_value_len;
+
+    return 0;
+}
+
+// parses the tag starting at pos, returning where the next one starts
+size_t _tags_next_entry(const char *tags, size_t len, size_t pos, MessageTagEntry *entry) {
+    const char *end = memchr(&tags[pos], ';', len - pos);
+    const size_t tag_end = end ? (size_t) (end - tags) : len;
+    const char *eq = memchr(&tags[pos], '=', tag_end - pos);
+
+    memset(entry, 0, sizeof(*entry));
+    entry->m_key = pos;
+    entry->m_key_len = (eq ? (size_t) (eq - tags) : tag_end) - pos;
+    entry->m_hash = _tags_hash(&tags[pos], entry->m_key_len);
+
+    if (eq) {
+        entry->m_has_value = 1;
+        entry->m_value = eq + 1 - tags;
+        entry->m_value_len = tag_end - entry->m_value;
+        entry->m_unescaped = (NULL != memchr(eq + 1, '\\', entry->m_value_len));
+    }
+
+    return end ? tag_end + 1 : len;
+}
+
+// fnv-1a
+uint32_t _tags_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) key[i]) * 16777619u;
+    }
+
+    return h;
 }
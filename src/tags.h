@@ -1,8 +1,11 @@
 #ifndef GOAT_TAGS_H
 #define GOAT_TAGS_H
 
-size_t tags_parse(const char *str, MessageTags **tagsp);
+size_t tags_parse(const char *str, const char **tags, size_t *len);
 
 int tags_init(MessageTags **tagsp, const char *key, const char *val);
+void tags_free(GoatMessage *message);
+
+void tags_index_free(GoatMessage *message);
 
 #endif
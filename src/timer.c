@@ -0,0 +1,207 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_MAX_AHEAD (((uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+static void _timer_place(TimerWheel *wheel, Timer *timer);
+static void _timer_cascade(TimerWheel *wheel, unsigned level);
+
+int timer_wheel_init(TimerWheel *wheel, uint64_t now_ms) {
+    assert(wheel != NULL);
+
+    memset(wheel, 0, sizeof(*wheel));
+
+    for (unsigned level = 0; level < TIMER_LEVELS; level++) {
+        for (unsigned slot = 0; slot < TIMER_SLOTS; slot++) {
+            LIST_INIT(&wheel->m_slots[level][slot]);
+        }
+    }
+
+    wheel->m_now = now_ms / TIMER_TICK_MS;
+
+    return pthread_mutex_init(&wheel->m_mutex, NULL);
+}
+
+// timers still pending are just forgotten; they belong to someone else
+void timer_wheel_destroy(TimerWheel *wheel) {
+    assert(wheel != NULL);
+
+    pthread_mutex_destroy(&wheel->m_mutex);
+}
+
+// (re)schedules timer to expire at expires_ms, which may be in the past, in
+// which case it expires at the next advance
+int timer_add(TimerWheel *wheel, Timer *timer, int handle, uint64_t expires_ms) {
+    assert(wheel != NULL);
+    assert(timer != NULL);
+
+    int r = pthread_mutex_lock(&wheel->m_mutex);
+    if (r) return r;
+
+    if (timer->m_pending) {
+        LIST_REMOVE(timer, entries);
+        -- wheel->m_count;
+    }
+
+    // rounded up, so it never fires early
+    timer->m_expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer->m_handle = handle;
+    timer->m_pending = 1;
+
+    _timer_place(wheel, timer);
+    ++ wheel->m_count;
+
+    pthread_mutex_unlock(&wheel->m_mutex);
+    return 0;
+}
+
+int timer_cancel(TimerWheel *wheel, Timer *timer) {
+    assert(wheel != NULL);
+    assert(timer != NULL);
+
+    int r = pthread_mutex_lock(&wheel->m_mutex);
+    if (r) return r;
+
+    if (timer->m_pending) {
+        LIST_REMOVE(timer, entries);
+        timer->m_pending = 0;
+        -- wheel->m_count;
+    }
+
+    pthread_mutex_unlock(&wheel->m_mutex);
+    return 0;
+}
+
+// fires everything due by now_ms, filling in handles with whose timers they
+// were.  returns how many; if that's max, there may be more to come
+size_t timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms, int *handles, size_t max) {
+    assert(wheel != NULL);
+    assert(handles != NULL);
+
+    const uint64_t target = now_ms / TIMER_TICK_MS;
+    size_t n = 0;
+
+    if (pthread_mutex_lock(&wheel->m_mutex)) return 0;
+
+    while (wheel->m_now <= target && n < max) {
+        if (0 == wheel->m_count) {
+            // nothing to cascade or fire, so just catch up
+            wheel->m_now = target + 1;
+            break;
+        }
+
+        // at the start of each turn of a level, the next slot of the level
+        // above gets spread out over it
+        for (unsigned level = 1; level < TIMER_LEVELS; level++) {
+            if (wheel->m_now & ((1u << (TIMER_BITS * level)) - 1)) break;
+            _timer_cascade(wheel, level);
+        }
+
+        TimerList *const slot = &wheel->m_slots[0][wheel->m_now & TIMER_MASK];
+
+        while (!LIST_EMPTY(slot) && n < max) {
+            Timer *const timer = LIST_FIRST(slot);
+            LIST_REMOVE(timer, entries);
+
+            if (timer->m_expires > wheel->m_now) {
+                // further out than the wheel reaches, not due yet
+                _timer_place(wheel, timer);
+                continue;
+            }
+
+            timer->m_pending = 0;
+            -- wheel->m_count;
+            handles[n++] = timer->m_handle;
+        }
+
+        // stop mid-slot if the caller's run out of room, and carry on from
+        // here next time
+        if (LIST_EMPTY(slot))  ++ wheel->m_now;
+    }
+
+    pthread_mutex_unlock(&wheel->m_mutex);
+    return n;
+}
+
+// how long from now_ms until the wheel next needs advancing, or -1 if
+// nothing is pending.  for timers on the higher levels, that's when they
+// next move down, which may be sooner than they expire
+long timer_wheel_next_ms(TimerWheel *wheel, uint64_t now_ms) {
+    assert(wheel != NULL);
+
+    uint64_t next = UINT64_MAX;
+
+    if (pthread_mutex_lock(&wheel->m_mutex)) return -1;
+
+    if (wheel->m_count > 0) {
+        for (uint64_t i = 0; i < TIMER_SLOTS; i++) {
+            if (!LIST_EMPTY(&wheel->m_slots[0][(wheel->m_now + i) & TIMER_MASK])) {
+                next = wheel->m_now + i;
+                break;
+            }
+        }
+
+        for (unsigned level = 1; level < TIMER_LEVELS; level++) {
+            const unsigned shift = TIMER_BITS * level;
+            const uint64_t base = wheel->m_now >> shift;
+
+            for (uint64_t k = 1; k <= TIMER_SLOTS; k++) {
+                if (!LIST_EMPTY(&wheel->m_slots[level][(base + k) & TIMER_MASK])) {
+                    if (((base + k) << shift) < next)  next = (base + k) << shift;
+                    break;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&wheel->m_mutex);
+
+    if (UINT64_MAX == next) return -1;
+
+    const uint64_t next_ms = next * TIMER_TICK_MS;
+    return next_ms > now_ms ? (long) (next_ms - now_ms) : 0;
+}
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the caller must hold m_mutex
+void _timer_place(TimerWheel *wheel, Timer *timer) {
+    uint64_t expires = timer->m_expires;
+
+    if (expires < wheel->m_now)  expires = wheel->m_now;
+    if (expires - wheel->m_now > TIMER_MAX_AHEAD)  expires = wheel->m_now + TIMER_MAX_AHEAD;
+
+    const uint64_t ahead = expires - wheel->m_now;
+    unsigned level = 0;
+
+    while (level + 1 < TIMER_LEVELS && ahead >= ((uint64_t) 1 << (TIMER_BITS * (level + 1)))) {
+        ++ level;
+    }
+
+    TimerList *const slot = &wheel->m_slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    LIST_INSERT_HEAD(slot, timer, entries);
+}
+
+// the caller must hold m_mutex
+void _timer_cascade(TimerWheel *wheel, unsigned level) {
+    TimerList *const slot = &wheel->m_slots[level][(wheel->m_now >> (TIMER_BITS * level)) & TIMER_MASK];
+
+    while (!LIST_EMPTY(slot)) {
+        Timer *const timer = LIST_FIRST(slot);
+        LIST_REMOVE(timer, entries);
+        _timer_place(wheel, timer);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef GOAT_TIMER_H
+#define GOAT_TIMER_H
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+// hierarchical timing wheel: each level has TIMER_SLOTS slots, and each slot
+// of a level spans a whole turn of the level below.  timers go in the level
+// whose span fits their expiry, and move down a level as it comes round, so
+// adding and cancelling are O(1) however many are pending
+#define TIMER_TICK_MS   (10)
+#define TIMER_BITS      (6)
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_LEVELS    (4)     /* a little over 46 hours at 10ms ticks */
+
+typedef struct timer {
+    LIST_ENTRY(timer)   entries;
+    uint64_t            m_expires;  // in ticks
+    int                 m_handle;   // what expired, for whoever's advancing
+    int                 m_pending;
+} Timer;
+
+typedef LIST_HEAD(timer_list, timer) TimerList;
+
+typedef struct {
+    pthread_mutex_t     m_mutex;
+    uint64_t            m_now;      // in ticks; everything before it has fired
+    size_t              m_count;
+    TimerList           m_slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+int timer_wheel_init(TimerWheel *wheel, uint64_t now_ms);
+void timer_wheel_destroy(TimerWheel *wheel);
+
+int timer_add(TimerWheel *wheel, Timer *timer, int handle, uint64_t expires_ms);
+int timer_cancel(TimerWheel *wheel, Timer *timer);
+
+size_t timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms, int *handles, size_t max);
+long timer_wheel_next_ms(TimerWheel *wheel, uint64_t now_ms);
+
+uint64_t timer_now_ms(void);
+
+#endif
@@ -0,0 +1,242 @@
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tlscache.h"
+#include "util.h"
+
+struct tlscache_entry {
+    TAILQ_ENTRY(tlscache_entry) entries;
+    struct tls_config   *m_config;
+    int                 m_session_fd;   // libtls keeps the session in here
+    int                 m_busy;         // a handshake is using it
+    char                m_servername[];
+};
+
+static struct tls_config *_tlscache_config(TlsCache *cache, int session_fd);
+static TlsCacheEntry *_tlscache_entry_new(TlsCache *cache, const char *servername);
+static void _tlscache_entry_free(TlsCacheEntry *entry);
+static int _tlscache_session_fd(void);
+
+int tlscache_init(TlsCache *cache) {
+    assert(cache != NULL);
+
+    memset(cache, 0, sizeof(*cache));
+    TAILQ_INIT(&cache->m_entries);
+
+    return pthread_mutex_init(&cache->m_mutex, NULL);
+}
+
+// every connection that used one of its configs must already have freed
+// its tls context
+void tlscache_destroy(TlsCache *cache) {
+    assert(cache != NULL);
+
+    TlsCacheEntry *entry;
+    while (NULL != (entry = TAILQ_FIRST(&cache->m_entries))) {
+        TAILQ_REMOVE(&cache->m_entries, entry, entries);
+        _tlscache_entry_free(entry);
+    }
+    cache->m_count = 0;
+
+    if (cache->m_config)  tls_config_free(cache->m_config);
+    cache->m_config = NULL;
+
+    if (cache->m_ca)  tls_unload_file(cache->m_ca, cache->m_ca_len);
+    cache->m_ca = NULL;
+    cache->m_ca_len = 0;
+
+    pthread_mutex_destroy(&cache->m_mutex);
+}
+
+// the config for a connection to servername to use.  if *entryp is set, the
+// connection has its server name's session to itself, and must hand it back
+// with tlscache_release() once its handshake is over.  returns NULL, with
+// errno set, if the config couldn't be set up
+struct tls_config *tlscache_acquire(TlsCache *cache, const char *servername, TlsCacheEntry **entryp) {
+    assert(cache != NULL);
+    assert(servername != NULL);
+    assert(entryp != NULL);
+
+    struct tls_config *config = NULL;
+    int r;
+
+    *entryp = NULL;
+
+    if (0 != (r = pthread_mutex_lock(&cache->m_mutex))) {
+        errno = r;
+        return NULL;
+    }
+
+    if (NULL == cache->m_config && NULL == (cache->m_config = _tlscache_config(cache, -1))) {
+        r = errno;
+        goto done;
+    }
+
+    TlsCacheEntry *entry;
+    TAILQ_FOREACH(entry, &cache->m_entries, entries) {
+        if (0 == strcmp(entry->m_servername, servername)) break;
+    }
+
+    if (NULL == entry) {
+        entry = _tlscache_entry_new(cache, servername);
+    }
+    else {
+        TAILQ_REMOVE(&cache->m_entries, entry, entries);
+        TAILQ_INSERT_HEAD(&cache->m_entries, entry, entries);
+    }
+
+    if (entry && !entry->m_busy) {
+        entry->m_busy = 1;
+        *entryp = entry;
+        config = entry->m_config;
+    }
+    else {
+        // without a session of its own it can still share the roots
+        config = cache->m_config;
+    }
+
+done:
+    pthread_mutex_unlock(&cache->m_mutex);
+    if (NULL == config)  errno = r;
+    return config;
+}
+
+// the handshake is over: if tls is set, it succeeded, and counts towards the
+// stats.  the session, if the connection had one, is free for the next
+void tlscache_release(TlsCache *cache, TlsCacheEntry **entryp, struct tls *tls) {
+    assert(cache != NULL);
+    assert(entryp != NULL);
+
+    if (0 != pthread_mutex_lock(&cache->m_mutex)) return;
+
+    if (*entryp)  (*entryp)->m_busy = 0;
+    *entryp = NULL;
+
+    if (tls) {
+        ++ cache->m_handshakes;
+#ifdef HAVE_TLS_CONN_SESSION_RESUMED
+        if (tls_conn_session_resumed(tls))  ++ cache->m_resumed;
+#endif
+    }
+
+    pthread_mutex_unlock(&cache->m_mutex);
+}
+
+int tlscache_stats(TlsCache *cache, size_t *entries, size_t *handshakes, size_t *resumed) {
+    assert(cache != NULL);
+
+    int r = pthread_mutex_lock(&cache->m_mutex);
+    if (r) return r;
+
+    if (entries)  *entries = cache->m_count;
+    if (handshakes)  *handshakes = cache->m_handshakes;
+    if (resumed)  *resumed = cache->m_resumed;
+
+    pthread_mutex_unlock(&cache->m_mutex);
+    return 0;
+}
+
+// a new client config, with the roots and, if session_fd isn't -1, somewhere
+// to keep its session.  the caller must hold m_mutex
+struct tls_config *_tlscache_config(TlsCache *cache, int session_fd) {
+    struct tls_config *config = tls_config_new();
+    if (NULL == config) return NULL;
+
+    // read the roots once, rather than every config reading the file again.
+    // if they can't be, each config still knows where the default ones are
+    if (NULL == cache->m_ca) {
+        cache->m_ca = tls_load_file(tls_default_ca_cert_file(), &cache->m_ca_len, NULL);
+    }
+
+    if (cache->m_ca && 0 != tls_config_set_ca_mem(config, cache->m_ca, cache->m_ca_len)) {
+        tls_config_free(config);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+#ifdef HAVE_TLS_CONFIG_SET_SESSION_FD
+    if (session_fd >= 0 && 0 != tls_config_set_session_fd(config, session_fd)) {
+        tls_config_free(config);
+        errno = EINVAL;
+        return NULL;
+    }
+#else
+    ARG_UNUSED(session_fd);
+#endif
+
+    return config;
+}
+
+// remembers servername, forgetting the least recently used idle one to make
+// room if need be.  returns NULL if it can't, and connections to it just
+// don't get to resume.  the caller must hold m_mutex
+TlsCacheEntry *_tlscache_entry_new(TlsCache *cache, const char *servername) {
+    if (cache->m_count >= TLSCACHE_MAX_ENTRIES) {
+        TlsCacheEntry *victim = TAILQ_LAST(&cache->m_entries, tlscache_entry_list);
+        while (victim && victim->m_busy)  victim = TAILQ_PREV(victim, tlscache_entry_list, entries);
+
+        if (NULL == victim) return NULL;
+
+        TAILQ_REMOVE(&cache->m_entries, victim, entries);
+        _tlscache_entry_free(victim);
+        -- cache->m_count;
+    }
+
+    const size_t len = strlen(servername);
+    TlsCacheEntry *entry = calloc(1, sizeof(*entry) + len + 1);
+    if (NULL == entry) return NULL;
+
+    memcpy(entry->m_servername, servername, len + 1);
+
+    if (-1 == (entry->m_session_fd = _tlscache_session_fd())
+        || NULL == (entry->m_config = _tlscache_config(cache, entry->m_session_fd))
+    ) {
+        _tlscache_entry_free(entry);
+        return NULL;
+    }
+
+    TAILQ_INSERT_HEAD(&cache->m_entries, entry, entries);
+    ++ cache->m_count;
+
+    return entry;
+}
+
+// libtls holds a reference to the config for as long as any tls context
+// configured with it, so this only has to drop ours.  the session is only
+// touched during handshakes, which don't happen while it's not busy
+void _tlscache_entry_free(TlsCacheEntry *entry) {
+    if (entry->m_config)  tls_config_free(entry->m_config);
+    if (entry->m_session_fd >= 0)  close(entry->m_session_fd);
+    free(entry);
+}
+
+// sessions live in an anonymous file, which libtls insists be regular and
+// only readable by us.  mkstemp() makes it so
+int _tlscache_session_fd(void) {
+#ifdef HAVE_TLS_CONFIG_SET_SESSION_FD
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+
+    if (NULL == dir || '\0' == dir[0])  dir = P_tmpdir;
+
+    int n = snprintf(path, sizeof(path), "%s/goat-tls-XXXXXX", dir);
+    if (n < 0 || (size_t) n >= sizeof(path)) return -1;
+
+    const int fd = mkstemp(path);
+    if (fd < 0) return -1;
+
+    unlink(path);
+    return fd;
+#else
+    // nowhere to keep them, so none are kept
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
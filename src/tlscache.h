@@ -0,0 +1,43 @@
+#ifndef GOAT_TLSCACHE_H
+#define GOAT_TLSCACHE_H
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include <tls.h>
+
+// most server names a context remembers sessions for.  past this, the one
+// used least recently is forgotten
+#define TLSCACHE_MAX_ENTRIES (64)
+
+typedef struct tlscache_entry TlsCacheEntry;
+
+// tls configuration shared by a context's connections, set up the first time
+// one of them needs it.  each server name gets its own configuration, so that
+// it can keep the last session for resuming, but only one handshake at a time
+// may use it: libtls reads and writes the session without any locking.  any
+// others meanwhile get m_config, which has the same roots but no session
+typedef struct {
+    pthread_mutex_t     m_mutex;
+    struct tls_config   *m_config;
+    uint8_t             *m_ca;          // roots, loaded once for every config
+    size_t              m_ca_len;
+    TAILQ_HEAD(tlscache_entry_list, tlscache_entry) m_entries; // most recently used first
+    size_t              m_count;
+    size_t              m_handshakes;
+    size_t              m_resumed;
+} TlsCache;
+
+int tlscache_init(TlsCache *cache);
+void tlscache_destroy(TlsCache *cache);
+
+struct tls_config *tlscache_acquire(TlsCache *cache, const char *servername, TlsCacheEntry **entryp);
+void tlscache_release(TlsCache *cache, TlsCacheEntry **entryp, struct tls *tls);
+
+int tlscache_stats(TlsCache *cache, size_t *entries, size_t *handshakes, size_t *resumed);
+
+#endif
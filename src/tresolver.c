@@ -3,94 +3,300 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <time.h>
 
+#include "timer.h"
 #include "tresolver.h"
+#include "util.h"
+
+// how long a resolver thread waits for more work before going away
+#define RESOLVER_IDLE_SECS (30)
 
 enum e_resolver_status {
+    RESOLVER_QUEUED,
     RESOLVER_BUSY,
     RESOLVER_DONE,
     RESOLVER_ERROR,
-    RESOLVER_CANCELLED,
 };
 
-struct resolver_state {
-    pthread_t thread;
-    pthread_mutex_t mutex;
-    struct addrinfo *res;
+// one getaddrinfo call, and everyone waiting on its answer.  if it's in a
+// cache, it stays there holding the answer until it expires
+struct resolver_lookup {
+    TAILQ_ENTRY(resolver_lookup) queued;
+    LIST_ENTRY(resolver_lookup) cached;
+    LIST_HEAD(, resolver_state) waiters;
+    ResolverCache *cache;
     enum e_resolver_status status;
+    struct addrinfo *res;
     int error;
+    uint64_t expires;
     char *hostname;
     char *servname;
 };
 
-static int _resolver_init(ResolverState **statep, const char *hostname,
-    const char *servname, struct addrinfo **resp);
+// one request for an answer
+struct resolver_state {
+    LIST_ENTRY(resolver_state) entries;
+    ResolverLookup *lookup;     // until it's answered
+    enum e_resolver_status status;
+    struct addrinfo *res;
+    int error;
+    ResolverNotify notify;
+};
+
+// answers handed out are copies in a single block, shared by everyone who
+// asked for them and freed by whoever's last
+typedef struct {
+    unsigned refs;
+    struct addrinfo ai[];   // then their addresses, then their names
+} ResolverResult;
+
+// every lookup in the process shares at most RESOLVER_MAX_THREADS threads,
+// however many are asked for at once.  the rest wait their turn in the queue.
+// the mutex also protects every request, lookup and cache
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    TAILQ_HEAD(, resolver_lookup) queue;
+    size_t n_queued;
+    unsigned n_threads;
+    unsigned n_idle;
+} resolver_pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    TAILQ_HEAD_INITIALIZER(resolver_pool.queue),
+    0,
+    0,
+    0,
+};
+
+static int _resolver_init(ResolverState **statep, ResolverCache *cache, const char *hostname,
+    const char *servname, struct addrinfo **resp, const ResolverNotify *notify);
 static int _resolver_status(ResolverState **statep, struct addrinfo **resp);
+static ResolverLookup *_resolver_cache_find(ResolverCache *cache, const char *hostname,
+    const char *servname, uint64_t now);
+static int _resolver_enqueue(ResolverLookup *lookup);
+static void _resolver_finish(ResolverLookup *lookup, struct addrinfo *res, int error);
+static void _resolver_answer(ResolverState *state, const ResolverLookup *lookup);
+static void _resolver_lookup_free(ResolverLookup *lookup);
+static struct addrinfo *_resolver_copy(const struct addrinfo *src);
+static struct addrinfo *_resolver_share(struct addrinfo *ai);
 static void *_resolver_thread(void *);
 
+// starts a lookup if *statep is NULL, otherwise checks on the one it refers
+// to.  with a cache, recent answers are reused, and a lookup already underway
+// for the same name is shared.  notify, if not NULL, is called when the
+// answer's ready, so it can be collected without checking until then
 // returns:
 //  0 - ok: if res is set, finished, otherwise still busy
 //  nonzero - error
-int resolver_getaddrinfo(ResolverState **statep, const char *hostname,
-    const char *servname, struct addrinfo **resp)
+int resolver_getaddrinfo(ResolverState **statep, ResolverCache *cache, const char *hostname,
+    const char *servname, struct addrinfo **resp, const ResolverNotify *notify)
 {
     if (! *statep) {
-        return _resolver_init(statep, hostname, servname, resp);
+        return _resolver_init(statep, cache, hostname, servname, resp, notify);
     }
     else {
         return _resolver_status(statep, resp);
     }
 }
 
+// once this returns, the request's notify won't be called
 int resolver_cancel(ResolverState **statep) {
     ResolverState *state = *statep;
 
-    int r = pthread_mutex_lock(&state->mutex);
+    int r = pthread_mutex_lock(&resolver_pool.mutex);
     if (r) return r;
 
     *statep = NULL;
-    state->status = RESOLVER_CANCELLED;
-    pthread_detach(state->thread);
-    pthread_mutex_unlock(&state->mutex);
 
+    ResolverLookup *const lookup = state->lookup;
+
+    if (lookup) {
+        LIST_REMOVE(state, entries);
+
+        // a queued lookup that nobody wants, and won't be cached, needn't run
+        if (LIST_EMPTY(&lookup->waiters) && NULL == lookup->cache && lookup->status == RESOLVER_QUEUED) {
+            TAILQ_REMOVE(&resolver_pool.queue, lookup, queued);
+            -- resolver_pool.n_queued;
+            _resolver_lookup_free(lookup);
+        }
+    }
+    else {
+        // answered, but nobody came for it
+        resolver_freeaddrinfo(state->res);
+    }
+
+    pthread_mutex_unlock(&resolver_pool.mutex);
+
+    free(state);
     return 0;
 }
 
-static int _resolver_init(ResolverState **statep, const char *hostname,
-    const char *servname, struct addrinfo **resp)
+// for answers from resolver_getaddrinfo(), instead of freeaddrinfo()
+void resolver_freeaddrinfo(struct addrinfo *ai) {
+    if (NULL == ai) return;
+
+    ResolverResult *const result = (ResolverResult *) ((char *) ai - offsetof(ResolverResult, ai));
+
+    if (0 == __atomic_sub_fetch(&result->refs, 1, __ATOMIC_ACQ_REL))  free(result);
+}
+
+void resolver_cache_init(ResolverCache *cache, unsigned ttl_ms, unsigned negative_ttl_ms) {
+    assert(cache != NULL);
+
+    memset(cache, 0, sizeof(*cache));
+    LIST_INIT(&cache->m_entries);
+
+    cache->m_ttl_ms = ttl_ms;
+    cache->m_negative_ttl_ms = negative_ttl_ms;
+}
+
+// lookups still underway carry on without it
+void resolver_cache_destroy(ResolverCache *cache) {
+    assert(cache != NULL);
+
+    pthread_mutex_lock(&resolver_pool.mutex);
+
+    while (!LIST_EMPTY(&cache->m_entries)) {
+        ResolverLookup *const lookup = LIST_FIRST(&cache->m_entries);
+
+        LIST_REMOVE(lookup, cached);
+        lookup->cache = NULL;
+
+        if (lookup->status == RESOLVER_DONE || lookup->status == RESOLVER_ERROR) {
+            _resolver_lookup_free(lookup);
+        }
+        else if (lookup->status == RESOLVER_QUEUED && LIST_EMPTY(&lookup->waiters)) {
+            TAILQ_REMOVE(&resolver_pool.queue, lookup, queued);
+            -- resolver_pool.n_queued;
+            _resolver_lookup_free(lookup);
+        }
+    }
+    cache->m_count = 0;
+
+    pthread_mutex_unlock(&resolver_pool.mutex);
+}
+
+// answers already cached keep the expiry they were given
+int resolver_cache_configure(ResolverCache *cache, unsigned ttl_ms, unsigned negative_ttl_ms) {
+    assert(cache != NULL);
+
+    int r = pthread_mutex_lock(&resolver_pool.mutex);
+    if (r) return r;
+
+    cache->m_ttl_ms = ttl_ms;
+    cache->m_negative_ttl_ms = negative_ttl_ms;
+
+    pthread_mutex_unlock(&resolver_pool.mutex);
+    return 0;
+}
+
+// a snapshot of the settings and counters, without the entries
+int resolver_cache_stats(ResolverCache *cache, ResolverCache *stats) {
+    assert(cache != NULL);
+    assert(stats != NULL);
+
+    int r = pthread_mutex_lock(&resolver_pool.mutex);
+    if (r) return r;
+
+    // expired answers still count until something looks for them
+    *stats = *cache;
+    LIST_INIT(&stats->m_entries);
+
+    pthread_mutex_unlock(&resolver_pool.mutex);
+    return 0;
+}
+
+static int _resolver_init(ResolverState **statep, ResolverCache *cache, const char *hostname,
+    const char *servname, struct addrinfo **resp, const ResolverNotify *notify)
 {
     if (NULL == statep) return EINVAL;
     if (NULL == hostname) return EINVAL;
     if (NULL == servname) return EINVAL;
     if (NULL == resp) return EINVAL;
 
+    ResolverLookup *lookup = NULL;
+    int r;
+
     ResolverState *state = calloc(1, sizeof(ResolverState));
     if (!state)  return errno;
 
-    state->hostname = strdup(hostname);
-    if (NULL == state->hostname) return errno;
+    if (notify)  state->notify = *notify;
 
-    state->servname = strdup(servname);
-    if (NULL == state->servname) return errno;
+    r = pthread_mutex_lock(&resolver_pool.mutex);
+    if (r) goto cleanup;
 
-    state->status = RESOLVER_BUSY;
+    if (cache) {
+        lookup = _resolver_cache_find(cache, hostname, servname, timer_now_ms());
 
-    int r = pthread_mutex_init(&state->mutex, NULL);
-    if (r) goto cleanup;
+        if (lookup && (lookup->status == RESOLVER_DONE || lookup->status == RESOLVER_ERROR)) {
+            // already know the answer, so say so straight away
+            ++ cache->m_hits;
+            if (lookup->status == RESOLVER_ERROR)  ++ cache->m_negative_hits;
 
-    r = pthread_create(&state->thread, NULL, _resolver_thread, state);
-    if (r) goto cleanup;
+            _resolver_answer(state, lookup);
+            goto done;
+        }
+
+        if (lookup) {
+            // someone else is already asking
+            ++ cache->m_coalesced;
+
+            LIST_INSERT_HEAD(&lookup->waiters, state, entries);
+            state->lookup = lookup;
+            goto done;
+        }
+
+        ++ cache->m_misses;
+    }
+
+    lookup = calloc(1, sizeof(ResolverLookup));
+    if (NULL == lookup) {
+        r = errno;
+        goto unlock;
+    }
+
+    LIST_INIT(&lookup->waiters);
+    lookup->status = RESOLVER_QUEUED;
+    lookup->hostname = strdup(hostname);
+    lookup->servname = strdup(servname);
+    if (NULL == lookup->hostname || NULL == lookup->servname) {
+        r = errno;
+        _resolver_lookup_free(lookup);
+        goto unlock;
+    }
+
+    r = _resolver_enqueue(lookup);
+    if (r) {
+        _resolver_lookup_free(lookup);
+        goto unlock;
+    }
+
+    LIST_INSERT_HEAD(&lookup->waiters, state, entries);
+    state->lookup = lookup;
+
+    if (cache) {
+        LIST_INSERT_HEAD(&cache->m_entries, lookup, cached);
+        lookup->cache = cache;
+        ++ cache->m_count;
+    }
+
+done:
+    pthread_mutex_unlock(&resolver_pool.mutex);
 
     *statep = state;
     *resp = NULL;
     return 0;
 
+unlock:
+    pthread_mutex_unlock(&resolver_pool.mutex);
 cleanup:
-    pthread_mutex_destroy(&state->mutex);
-    free(state->servname);
-    free(state->hostname);
     free(state);
     *statep = NULL;
     *resp = NULL;
@@ -100,7 +306,7 @@ cleanup:
 static int _resolver_status(ResolverState **statep, struct addrinfo **resp) {
     ResolverState *state = *statep;
 
-    int r = pthread_mutex_lock(&state->mutex);
+    int r = pthread_mutex_lock(&resolver_pool.mutex);
     if (r) {
         // lock failed, maybe temporary?  return error but don't throw everything away
         *resp = NULL;
@@ -108,83 +314,242 @@ static int _resolver_status(ResolverState **statep, struct addrinfo **resp) {
     }
 
     enum e_resolver_status status = state->status;
-    int error = state->error;
-    struct addrinfo *res = state->res;
 
-    pthread_mutex_unlock(&state->mutex);
+    pthread_mutex_unlock(&resolver_pool.mutex);
 
     switch(status) {
+        case RESOLVER_QUEUED:
         case RESOLVER_BUSY:
             *resp = NULL;
             return 0;
 
         case RESOLVER_DONE:
-            *resp = res;
+            // answered, so the request is ours alone now
+            *resp = state->res;
             *statep = NULL;
-            pthread_join(state->thread, NULL);
-            pthread_mutex_destroy(&state->mutex);
-            free(state->servname);
-            free(state->hostname);
             free(state);
             return 0;
 
         case RESOLVER_ERROR:
-        case RESOLVER_CANCELLED:
         default:
+            r = state->error;
             *resp = NULL;
             *statep = NULL;
-            pthread_join(state->thread, NULL);
-            pthread_mutex_destroy(&state->mutex);
-            free(state->servname);
-            free(state->hostname);
             free(state);
-            return error;
+            return r;
     }
 }
 
-void *_resolver_thread(void *arg) {
-    assert(arg != NULL);
+// the cache's entry for hostname and servname, if it has one that's either
+// underway or still fresh.  expired ones are cleared out as we go.  the
+// caller must hold the mutex
+ResolverLookup *_resolver_cache_find(ResolverCache *cache, const char *hostname,
+    const char *servname, uint64_t now)
+{
+    ResolverLookup *lookup, *tmp, *found = NULL;
 
-    ResolverState *state = (ResolverState *) arg;
-    struct addrinfo *res = NULL;
+    for (lookup = LIST_FIRST(&cache->m_entries); lookup != NULL; lookup = tmp) {
+        tmp = LIST_NEXT(lookup, cached);
 
-    int r = getaddrinfo(state->hostname, state->servname, NULL, &res);
+        const int answered = lookup->status == RESOLVER_DONE || lookup->status == RESOLVER_ERROR;
 
-    if (0 == pthread_mutex_lock(&state->mutex)) {
-        if (state->status == RESOLVER_CANCELLED) {
-            // request has been cancelled and thread detached
-            // clean up after yourself, no-one else has pointers anymore
+        if (answered && now >= lookup->expires) {
+            LIST_REMOVE(lookup, cached);
+            -- cache->m_count;
+            _resolver_lookup_free(lookup);
+            continue;
+        }
 
-            if (res)  freeaddrinfo(res);
-            pthread_mutex_unlock(&state->mutex);
-            pthread_mutex_destroy(&state->mutex);
-            free(state->servname);
-            free(state->hostname);
-            free(state);
-            return NULL;
+        if (0 == strcmp(lookup->hostname, hostname) && 0 == strcmp(lookup->servname, servname)) {
+            found = lookup;
         }
+    }
+
+    return found;
+}
+
+// the caller must hold the mutex
+int _resolver_enqueue(ResolverLookup *lookup) {
+    int r = 0;
+
+    TAILQ_INSERT_TAIL(&resolver_pool.queue, lookup, queued);
+    ++ resolver_pool.n_queued;
 
+    // idle threads that have been woken but haven't yet taken anything are
+    // still counted as idle, so the queue length says whether they're enough
+    if (resolver_pool.n_queued <= resolver_pool.n_idle) {
+        pthread_cond_signal(&resolver_pool.cond);
+    }
+    else if (resolver_pool.n_threads < RESOLVER_MAX_THREADS) {
+        pthread_t thread;
+
+        r = pthread_create(&thread, NULL, _resolver_thread, NULL);
         if (0 == r) {
-            // resolution succeeded
-            state->status = RESOLVER_DONE;
-            state->error = 0;
-            state->res = res;
+            pthread_detach(thread);
+            ++ resolver_pool.n_threads;
+        }
+        else if (resolver_pool.n_threads > 0) {
+            // one of the others will get to it
+            r = 0;
         }
         else {
-            // resolution failed
-            state->status = RESOLVER_ERROR;
-            state->error = r;
-            state->res = NULL;
+            TAILQ_REMOVE(&resolver_pool.queue, lookup, queued);
+            -- resolver_pool.n_queued;
+        }
+    }
+
+    return r;
+}
+
+// hands the answer out to everyone waiting for it, then either keeps it in
+// the cache or throws it away.  the caller must hold the mutex
+void _resolver_finish(ResolverLookup *lookup, struct addrinfo *res, int error) {
+    lookup->status = error ? RESOLVER_ERROR : RESOLVER_DONE;
+    lookup->res = res;
+    lookup->error = error;
+
+    while (!LIST_EMPTY(&lookup->waiters)) {
+        ResolverState *const state = LIST_FIRST(&lookup->waiters);
+
+        LIST_REMOVE(state, entries);
+        _resolver_answer(state, lookup);
+    }
+
+    ResolverCache *const cache = lookup->cache;
+    const unsigned ttl_ms = cache ? (error ? cache->m_negative_ttl_ms : cache->m_ttl_ms) : 0;
+
+    if (ttl_ms) {
+        lookup->expires = timer_now_ms() + ttl_ms;
+        return;
+    }
+
+    if (cache) {
+        LIST_REMOVE(lookup, cached);
+        -- cache->m_count;
+    }
+
+    _resolver_lookup_free(lookup);
+}
+
+// under the lock, so notify can't be called once resolver_cancel() has
+// returned.  the caller must hold the mutex
+void _resolver_answer(ResolverState *state, const ResolverLookup *lookup) {
+    state->lookup = NULL;
+    state->status = lookup->status;
+    state->error = lookup->error;
+    state->res = _resolver_share(lookup->res);
+
+    if (state->notify.func)  state->notify.func(state->notify.arg, state->notify.handle);
+}
+
+void _resolver_lookup_free(ResolverLookup *lookup) {
+    resolver_freeaddrinfo(lookup->res);
+    free(lookup->servname);
+    free(lookup->hostname);
+    free(lookup);
+}
+
+// copies the whole list into one block, so it can be shared and freed
+// without caring where it came from
+struct addrinfo *_resolver_copy(const struct addrinfo *src) {
+    size_t n = 0, names = 0;
+
+    for (const struct addrinfo *ai = src; ai != NULL; ai = ai->ai_next) {
+        ++ n;
+        if (ai->ai_canonname)  names += strlen(ai->ai_canonname) + 1;
+    }
+    if (0 == n) return NULL;
+
+    // each address gets a whole sockaddr_storage, so they all stay aligned
+    const size_t addr_size = sizeof(struct sockaddr_storage);
+
+    ResolverResult *const result = malloc(sizeof(ResolverResult)
+                                          + n * (sizeof(struct addrinfo) + addr_size) + names);
+    if (NULL == result) return NULL;
+
+    char *addr = (char *) &result->ai[n];
+    char *name = addr + n * addr_size;
+    size_t i = 0;
 
-            if (res) freeaddrinfo(res);
+    result->refs = 1;
+
+    for (const struct addrinfo *ai = src; ai != NULL; ai = ai->ai_next, i++) {
+        struct addrinfo *const copy = &result->ai[i];
+
+        *copy = *ai;
+        copy->ai_next = ai->ai_next ? &result->ai[i + 1] : NULL;
+
+        if (ai->ai_addr && ai->ai_addrlen <= addr_size) {
+            memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+            copy->ai_addr = (struct sockaddr *) addr;
+        }
+        else {
+            copy->ai_addr = NULL;
+            copy->ai_addrlen = 0;
         }
+        addr += addr_size;
 
-        pthread_mutex_unlock(&state->mutex);
+        if (ai->ai_canonname) {
+            const size_t len = strlen(ai->ai_canonname) + 1;
 
-        // done, wait around to be joined
-        return NULL;
+            memcpy(name, ai->ai_canonname, len);
+            copy->ai_canonname = name;
+            name += len;
+        }
     }
 
+    return result->ai;
+}
+
+struct addrinfo *_resolver_share(struct addrinfo *ai) {
+    if (NULL == ai) return NULL;
+
+    ResolverResult *const result = (ResolverResult *) ((char *) ai - offsetof(ResolverResult, ai));
+    __atomic_add_fetch(&result->refs, 1, __ATOMIC_RELAXED);
+
+    return ai;
+}
+
+void *_resolver_thread(void *arg) {
+    ARG_UNUSED(arg);
+
     // FIXME mutex lock failed for some reason, crap out
-    return NULL;
+    if (pthread_mutex_lock(&resolver_pool.mutex)) return NULL;
+
+    for (;;) {
+        ResolverLookup *lookup;
+        struct timespec until;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += RESOLVER_IDLE_SECS;
+
+        while (NULL == (lookup = TAILQ_FIRST(&resolver_pool.queue))) {
+            ++ resolver_pool.n_idle;
+            int r = pthread_cond_timedwait(&resolver_pool.cond, &resolver_pool.mutex, &until);
+            -- resolver_pool.n_idle;
+
+            if (r == ETIMEDOUT && TAILQ_EMPTY(&resolver_pool.queue)) {
+                -- resolver_pool.n_threads;
+                pthread_mutex_unlock(&resolver_pool.mutex);
+                return NULL;
+            }
+        }
+
+        TAILQ_REMOVE(&resolver_pool.queue, lookup, queued);
+        -- resolver_pool.n_queued;
+        lookup->status = RESOLVER_BUSY;
+
+        // nothing else touches the names while it's busy
+        pthread_mutex_unlock(&resolver_pool.mutex);
+
+        struct addrinfo *res = NULL, *copy = NULL;
+        int r = getaddrinfo(lookup->hostname, lookup->servname, NULL, &res);
+
+        if (0 == r && NULL == (copy = _resolver_copy(res)))  r = EAI_MEMORY;
+        if (res)  freeaddrinfo(res);
+
+        pthread_mutex_lock(&resolver_pool.mutex);
+
+        _resolver_finish(lookup, copy, r);
+    }
 }
@@ -2,12 +2,50 @@
 #define GOAT_TRESOLVER_H
 
 #include <netdb.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+// most lookups that run at once, across the whole process
+#define RESOLVER_MAX_THREADS (4)
+
+// how long a context's cache keeps answers, and failures, by default
+#define RESOLVER_CACHE_TTL_MS           (60 * 1000)
+#define RESOLVER_CACHE_NEGATIVE_TTL_MS  (5 * 1000)
 
 typedef struct resolver_state ResolverState;
+typedef struct resolver_lookup ResolverLookup;
+
+// called on a resolver thread when a lookup finishes, or straight away if
+// the answer was already known
+typedef struct {
+    void (*func)(void *arg, int handle);
+    void *arg;
+    int handle;
+} ResolverNotify;
 
-int resolver_getaddrinfo(ResolverState **statep, const char *hostname,
-    const char *servname, struct addrinfo **resp);
+// recent answers, and lookups still underway, by hostname and servname.
+// everything in here is protected by the resolver's own lock
+typedef struct {
+    LIST_HEAD(, resolver_lookup) m_entries;
+    unsigned    m_ttl_ms;           // how long answers are kept, or 0 for not at all
+    unsigned    m_negative_ttl_ms;  // ... and failures
+    size_t      m_count;
+    size_t      m_hits;
+    size_t      m_negative_hits;
+    size_t      m_misses;
+    size_t      m_coalesced;
+} ResolverCache;
+
+int resolver_getaddrinfo(ResolverState **statep, ResolverCache *cache, const char *hostname,
+    const char *servname, struct addrinfo **resp, const ResolverNotify *notify);
 
 int resolver_cancel(ResolverState **statep);
 
+void resolver_freeaddrinfo(struct addrinfo *ai);
+
+void resolver_cache_init(ResolverCache *cache, unsigned ttl_ms, unsigned negative_ttl_ms);
+void resolver_cache_destroy(ResolverCache *cache);
+int resolver_cache_configure(ResolverCache *cache, unsigned ttl_ms, unsigned negative_ttl_ms);
+int resolver_cache_stats(ResolverCache *cache, ResolverCache *stats);
+
 #endif